@@ -10,33 +10,42 @@
 #include "xslib/hseq.h"
 #include "xslib/Enforce.h"
 #include <unistd.h>
+#include <algorithm>
 
-#define RCACHE_NUM_ITEM		(1024*64)
-#define RCACHE_MAX_TIME		(3600*24)
 
+#define UNKNOWN_TTL_DEFAULT	10
+#define UNKNOWN_MAX		4096
 
-BigServant::BigServant(const xic::EnginePtr& engine, const SettingPtr& setting)
-	: _engine(engine), _proxyConfig(setting->wantPathname("XiProxy.ListFile"))
+/* The servant being loaded by a thread, whose mutex is held by that
+ * thread till the loading is done. The other threads asking for the
+ * same service wait on the mutex instead of loading it again, and get
+ * the error of the loading if it failed.
+ */
+class BigServant::Loading: public XRefCount, public XMutex
 {
-	_hint = _map.end();
-
-	_rcache_expire_max = setting->getInt("XiProxy.Cache.ExpireMax");
-	if (_rcache_expire_max <= 0)
-		_rcache_expire_max = RCACHE_MAX_TIME;
-	else if (_rcache_expire_max > 3600*24*365)
-		_rcache_expire_max = 3600*24*365;
+public:
+	RevServantPtr srv;
+	bool failed;
+	std::string error;
 
-	int rcache_number_max = setting->getInt("XiProxy.Cache.NumberMax");
-	if (rcache_number_max <= 0 || rcache_number_max > INT_MAX)
-		rcache_number_max = RCACHE_NUM_ITEM;
+	Loading(): failed(false) {}
+};
 
-	_rcache.reset(new RCache(rcache_number_max));
+BigServant::BigServant(const xic::EnginePtr& engine, const SettingPtr& setting)
+	: _engine(engine), _reloads(0), _proxyConfig(setting->wantPathname("XiProxy.ListFile"))
+{
+	_unknown_ttl = setting->getInt("XiProxy.Service.UnknownTTL", UNKNOWN_TTL_DEFAULT);
+	_rcache.reset(new RCache(setting));
+	_rcache->restore();
 	_timer = XTimer::create();
 	_timer->start();
+	_peerbus.reset(new PeerBus(engine, setting, _rcache, _timer));
 
 	xref_inc();
 	XThread::create(this, &BigServant::reload_thread);
 	XThread::create(this, &BigServant::reap_thread);
+	if (setting->getBool("XiProxy.Service.Prewarm", false))
+		XThread::create(this, &BigServant::prewarm_thread);
 	xref_dec_only();
 }
 
@@ -51,21 +60,24 @@ void BigServant::reload_thread()
 	{
 		if (seconds % 5 == 0 && _proxyConfig.reload())
 		{
+			// The servants loaded with the old config before this
+			// are checked below, those after are not registered.
 			Lock sync(*this);
-			for (ServantMap::iterator iter = _map.begin(); iter != _map.end(); )
+			++_reloads;
+			_unknown.clear();
+
+			std::vector<RevServantPtr> srvs, changed;
+			_registry.snapshot()->servants(srvs);
+			for (size_t i = 0; i < srvs.size(); ++i)
 			{
 				ProxyDetail pd;
-				if (!_proxyConfig.find(iter->second->service(), pd)
-					|| iter->second->revision() != pd.revision)
-				{
-					_map.erase(iter++);
-				}
-				else
+				if (!_proxyConfig.find(srvs[i]->service(), pd)
+					|| srvs[i]->revision() != pd.revision)
 				{
-					++iter;
+					changed.push_back(srvs[i]);
 				}
 			}
-			_hint = _map.end();
+			_registry.remove(changed);
 		}
 	}
 	catch (std::exception& ex)
@@ -76,20 +88,23 @@ void BigServant::reload_thread()
 
 void BigServant::reap_thread()
 {
-	while (true)
+	size_t num = 0;
+	for (int seconds = 1; true; _engine->sleep(1), ++seconds)
 	try 
 	{
-		_engine->sleep(60);
-		uint64_t before = rdtsc() - (_rcache_expire_max * cpu_frequency());
-		size_t n, num = 0;
-		const size_t NNN = 10;
-		do {
-			n = _rcache->reap(NNN, before);
-			num += n;
-		} while (n >= NNN);
+		num += _rcache->expire(rdtsc());
+		num += _rcache->sweep();
+		_rcache->pruneIndex();
 
-		if (num > 0)
+		int interval = _rcache->snapshotInterval();
+		if (interval > 0 && seconds % interval == 0)
+			_rcache->save();
+
+		if (seconds % 60 == 0 && num > 0)
+		{
 			dlog("RCACHE_REAP", "num=%zd", num);
+			num = 0;
+		}
 	}
 	catch (std::exception& ex)
 	{
@@ -97,6 +112,30 @@ void BigServant::reap_thread()
 	}
 }
 
+void BigServant::prewarm_thread()
+{
+	std::vector<std::string> ids;
+	_proxyConfig.identities(ids);
+
+	size_t num = 0, failed = 0;
+	for (size_t i = 0; i < ids.size(); ++i)
+	{
+		try
+		{
+			if (find(ids[i], true))
+				++num;
+			else
+				++failed;
+		}
+		catch (std::exception& ex)
+		{
+			++failed;
+			dlog("ERROR", "service=%s ex=%s", ids[i].c_str(), ex.what());
+		}
+	}
+	dlog("PREWARM", "num=%zd failed=%zd", num, failed);
+}
+
 static std::string _reorder_endpoints(const std::string& endpoints, int max)
 {
 	xstr_t xs = XSTR_CXX(endpoints);
@@ -153,33 +192,33 @@ RevServantPtr BigServant::_load(const std::string& service)
 		{
 			if (xstr_equal_cstr(&id, "MCache"))
 			{
-				srv.reset(new MCache(_engine, service, pd.revision, pd.value, _rcache));
+				srv.reset(new MCache(_engine, service, pd.revision, pd.value, _rcache, _peerbus));
 			}
 			else if (xstr_equal_cstr(&id, "Redis"))
 			{
-				srv.reset(new Redis(_engine, service, pd.revision, pd.value));
+				srv.reset(new Redis(_engine, service, pd.revision, pd.value, _rcache, _peerbus));
 			}
 		}
 		else
 		{
 			std::string identity = make_string(id);
+			std::string option = pd.option;
 			std::string endpoints = _reorder_endpoints(pd.value, INT_MAX);
-			xic::ProxyPtr prx = _engine->stringToProxy(identity + ' ' + pd.option + endpoints);
-			srv.reset(new XiServant(_engine, service, pd.revision, prx, this));
+			P2cBalancerPtr balancer;
+			if (P2cBalancer::takeOption(option))
+				balancer.reset(new P2cBalancer(_engine, identity, option, endpoints));
+			xic::ProxyPtr prx = _engine->stringToProxy(identity + ' ' + option + endpoints);
+			srv.reset(new XiServant(_engine, service, pd.revision, prx, balancer, pd.cache, this));
 		}
-
-		if (srv)
-			_hint = _map.insert(_hint, std::make_pair(service, srv));
 	}
 	return srv;
 }
 
 xic::AnswerPtr BigServant::process(const xic::QuestPtr& quest, const xic::Current& current)
 {
-	std::string service = make_string(quest->service());
-	RevServantPtr srv = find(service, true);
+	RevServantPtr srv = find(quest->service(), true);
 	if (!srv)
-		throw XERROR_MSG(xic::ServiceNotFoundException, service);
+		throw XERROR_MSG(xic::ServiceNotFoundException, make_string(quest->service()));
 
 	return srv->process(quest, current);
 }
@@ -287,11 +326,11 @@ xic::AnswerPtr BigServant::salvo(const xic::QuestPtr& quest, const xic::Current&
 		xic::AnswerPtr answer;
 		try
 		{
-			std::string sxx = make_string(s);
-			xic::ServantPtr srv = find(sxx, true);
+			xic::ServantPtr srv = find(s, true);
 
 			if (!srv)
 			{
+				std::string sxx = make_string(s);
 				srv = current.con->getAdapter()->findServant(sxx);
 				if (!srv)
 					throw XERROR_MSG(xic::ServiceNotFoundException, sxx);
@@ -320,49 +359,117 @@ xic::AnswerPtr BigServant::salvo(const xic::QuestPtr& quest, const xic::Current&
 	return xic::ASYNC_ANSWER;
 }
 
-RevServantPtr BigServant::find(const std::string& service, bool load)
+RevServantPtr BigServant::find(const xstr_t& service, bool load)
 {
-	RevServantPtr srv;
+	RevServantPtr srv = _registry.find(service);
+	if (srv || !load)
+		return srv;
 
-	Lock lock(*this);
-	ServantMap::iterator iter = _hint;
-	if (iter != _map.end() && iter->first == service)
+	std::string name = make_string(service);
+	LoadingPtr loading;
+	int reloads = 0;
 	{
-		srv = iter->second;
-	}
-	else
-	{
-		iter = _map.find(service);
-		if (iter != _map.end())
+		Lock lock(*this);
+		srv = _registry.find(service);
+		if (srv)
+			return srv;
+
+		std::map<std::string, time_t>::iterator uiter = _unknown.find(name);
+		if (uiter != _unknown.end())
+		{
+			if (uiter->second > _engine->time())
+				return srv;
+			_unknown.erase(uiter);
+		}
+
+		std::map<std::string, LoadingPtr>::iterator iter = _loading.find(name);
+		if (iter != _loading.end())
 		{
-			_hint = iter;
-			srv = iter->second;
+			loading = iter->second;
 		}
-		else if (load)
+		else
 		{
-			srv = _load(service);
+			Loading *l = new Loading();
+			l->lock();
+			_loading[name].reset(l);
+			reloads = _reloads;
 		}
 	}
+
+	if (loading)
+	{
+		Lock lock(*loading);
+		if (loading->failed)
+			throw XERROR_MSG(XError, loading->error);
+		return loading->srv;
+	}
+
+	// The service is loaded without holding the lock, so that the
+	// other services are not blocked.
+	try
+	{
+		srv = _load(name);
+	}
+	catch (std::exception& ex)
+	{
+		_loaded(name, reloads, srv, ex.what());
+		throw;
+	}
+	_loaded(name, reloads, srv, NULL);
 	return srv;
 }
 
-void BigServant::remove(const std::string& service)
+/* Register the servant loaded, or remember the service as unknown if
+ * not found, and wake up the threads waiting for it.
+ */
+void BigServant::_loaded(const std::string& name, int reloads, const RevServantPtr& srv, const char *error)
 {
 	Lock lock(*this);
-	_map.erase(service);
-	_hint = _map.end();
+	std::map<std::string, LoadingPtr>::iterator iter = _loading.find(name);
+	LoadingPtr loading = iter->second;
+	_loading.erase(iter);
+
+	if (srv)
+	{
+		if (reloads == _reloads)
+			_registry.insert(name, srv);
+	}
+	else if (!error && _unknown_ttl > 0)
+	{
+		if (_unknown.size() >= UNKNOWN_MAX)
+			_unknown.clear();
+		_unknown[name] = _engine->time() + _unknown_ttl;
+	}
+
+	loading->srv = srv;
+	if (error)
+	{
+		loading->failed = true;
+		loading->error = error;
+	}
+	loading->unlock();
+}
+
+void BigServant::remove(const std::string& service)
+{
+	_registry.remove(service);
 }
 
 xic::AnswerPtr BigServant::stats(const xic::QuestPtr& quest, const xic::Current& current)
 {
+	std::vector<RevServantPtr> srvs;
+	_registry.snapshot()->servants(srvs);
+
+	std::vector<std::string> names;
+	for (size_t i = 0; i < srvs.size(); ++i)
+		names.push_back(srvs[i]->service());
+	std::sort(names.begin(), names.end());
+
 	xic::AnswerWriter aw;
 	xic::VListWriter lw = aw.paramVList("services");
+	for (size_t i = 0; i < names.size(); ++i)
 	{
-		Lock lock(*this);
-		for (ServantMap::iterator iter = _map.begin(); iter != _map.end(); ++iter)
-		{
-			lw.v(iter->first);
-		}
+		lw.v(names[i]);
 	}
 	return aw;
 }
@@ -401,6 +508,252 @@ xic::AnswerPtr BigServant::markProxyMethods(const xic::QuestPtr& quest, const xi
 	return aw;
 }
 
+xic::AnswerPtr BigServant::clearCache(const xic::QuestPtr& quest, const xic::Current& current)
+{
+	xic::VDict args = quest->args();
+	xstr_t service = args.getXstr("service");
+	xstr_t type = args.getXstr("type");
+
+	if (type.len)
+	{
+		RDataType t;
+		if (xstr_equal_cstr(&type, "answer"))
+			t = RD_ANSWER;
+		else if (xstr_equal_cstr(&type, "mcache"))
+			t = RD_MCACHE;
+		else if (xstr_equal_cstr(&type, "lcache"))
+			t = RD_LCACHE;
+		else if (xstr_equal_cstr(&type, "redis"))
+			t = RD_REDIS;
+		else
+			throw XERROR_MSG(XError, "Unknown cache type: " + make_string(type));
+		_rcache->clearType(t);
+	}
+
+	if (service.len)
+	{
+		if (!_rcache->clearOwner(make_string(service)))
+			throw XERROR_MSG(XError, "No cached data for service: " + make_string(service));
+	}
+
+	if (!type.len && !service.len)
+		_rcache->clear();
+
+	return xic::AnswerWriter();
+}
+
+static void write_usages(xic::VListWriter& lw, const std::vector<RCacheUsage>& usages)
+{
+	for (size_t i = 0; i < usages.size(); ++i)
+	{
+		const RCacheUsage& u = usages[i];
+		if (u.name.empty() || (!u.inserts && !u.num && !u.events[RC_HIT] && !u.events[RC_MISS]))
+			continue;
+
+		xic::VDictWriter dw = lw.vdict();
+		dw.kv("name", u.name);
+		dw.kv("hits", (intmax_t)u.events[RC_HIT]);
+		dw.kv("misses", (intmax_t)u.events[RC_MISS]);
+		dw.kv("stale_hits", (intmax_t)u.events[RC_STALE]);
+		dw.kv("inserts", (intmax_t)u.inserts);
+		dw.kv("evictions", (intmax_t)u.evictions);
+		dw.kv("expirations", (intmax_t)u.expirations);
+		dw.kv("purges", (intmax_t)u.purges);
+		dw.kv("num", (intmax_t)u.num);
+		dw.kv("bytes", (intmax_t)u.bytes);
+	}
+}
+
+xic::AnswerPtr BigServant::getCacheStats(const xic::QuestPtr& quest, const xic::Current& current)
+{
+	std::vector<RCacheUsage> types, owners;
+	_rcache->usages(types, owners);
+
+	xic::AnswerWriter aw;
+	xic::VListWriter lw = aw.paramVList("types");
+	write_usages(lw, types);
+	lw = aw.paramVList("services");
+	write_usages(lw, owners);
+	return aw;
+}
+
+#define CACHE_SAMPLE_DEFAULT	100
+#define CACHE_SAMPLE_MAX	10000
+#define CACHE_TOP_DEFAULT	20
+#define CACHE_TOP_MAX		32	/* the size of the top-K sketch of each shard */
+
+static void write_entries(xic::VListWriter& lw, const std::vector<RCacheEntry>& entries, bool top)
+{
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const RCacheEntry& ent = entries[i];
+		xic::VDictWriter dw = lw.vdict();
+		dw.kv("key", ent.key);
+		if (top)
+		{
+			dw.kv("count", (intmax_t)ent.count);
+			dw.kv("error", (intmax_t)ent.error);
+			dw.kv("resident", ent.resident);
+			if (!ent.resident)
+				continue;
+		}
+		dw.kv("type", ent.type);
+		dw.kv("service", ent.service);
+		dw.kv("age", (intmax_t)ent.age);
+		dw.kv("length", (intmax_t)ent.length);
+		dw.kv("bytes", (intmax_t)ent.bytes);
+		dw.kv("hits", (intmax_t)ent.hits);
+	}
+}
+
+xic::AnswerPtr BigServant::getCacheSample(const xic::QuestPtr& quest, const xic::Current& current)
+{
+	xic::VDict args = quest->args();
+	intmax_t num = args.getInt("num", CACHE_SAMPLE_DEFAULT);
+	if (num <= 0)
+		num = CACHE_SAMPLE_DEFAULT;
+	else if (num > CACHE_SAMPLE_MAX)
+		num = CACHE_SAMPLE_MAX;
+
+	std::vector<RCacheEntry> entries;
+	_rcache->sample(num, entries);
+
+	xic::AnswerWriter aw;
+	xic::VListWriter lw = aw.paramVList("entries");
+	write_entries(lw, entries, false);
+	return aw;
+}
+
+xic::AnswerPtr BigServant::getCacheTop(const xic::QuestPtr& quest, const xic::Current& current)
+{
+	xic::VDict args = quest->args();
+	intmax_t num = args.getInt("num", CACHE_TOP_DEFAULT);
+	if (num <= 0)
+		num = CACHE_TOP_DEFAULT;
+	else if (num > CACHE_TOP_MAX)
+		num = CACHE_TOP_MAX;
+
+	std::vector<RCacheEntry> hot, heavy;
+	_rcache->topKeys(num, hot, heavy);
+
+	xic::AnswerWriter aw;
+	xic::VListWriter lw = aw.paramVList("hot");
+	write_entries(lw, hot, true);
+	lw = aw.paramVList("heavy");
+	write_entries(lw, heavy, true);
+	return aw;
+}
+
+xic::AnswerPtr BigServant::getCacheInfo(const xic::QuestPtr& quest, const xic::Current& current)
+{
+	RCacheStats st;
+	_rcache->stats(st);
+
+	xic::AnswerWriter aw;
+	aw.param("policy", st.policy);
+	aw.param("shards", (intmax_t)st.shards);
+	aw.param("num", (intmax_t)st.num);
+	aw.param("num_max", (intmax_t)st.num_max);
+	aw.param("bytes", (intmax_t)st.bytes);
+	aw.param("bytes_max", (intmax_t)(st.bytes_max == SIZE_MAX ? 0 : st.bytes_max));
+	aw.param("evictions", (intmax_t)st.evictions);
+	aw.param("expirations", (intmax_t)st.expirations);
+	aw.param("rejections", (intmax_t)st.rejections);
+	aw.param("purges", (intmax_t)st.purges);
+	aw.param("index_lists", (intmax_t)st.index_lists);
+	aw.param("index_keys", (intmax_t)st.index_keys);
+	aw.param("index_overflows", (intmax_t)st.index_overflows);
+	aw.param("zip_num", (intmax_t)st.zip_num);
+	aw.param("zip_in_bytes", (intmax_t)st.zip_in_bytes);
+	aw.param("zip_out_bytes", (intmax_t)st.zip_out_bytes);
+	aw.param("zip_ratio", st.zip_in_bytes ? (double)st.zip_out_bytes / st.zip_in_bytes : 1.0);
+	aw.param("zip_usec", (intmax_t)st.zip_usec);
+	aw.param("unzip_num", (intmax_t)st.unzip_num);
+	aw.param("unzip_usec", (intmax_t)st.unzip_usec);
+
+	std::vector<RCachePartStats> pst;
+	_rcache->partStats(pst);
+	xic::VListWriter lw = aw.paramVList("partitions");
+	for (size_t i = 0; i < pst.size(); ++i)
+	{
+		const RCachePartStats& ps = pst[i];
+		xic::VDictWriter dw = lw.vdict();
+		dw.kv("name", ps.name);
+		dw.kv("share", ps.share);
+		dw.kv("num", (intmax_t)ps.num);
+		dw.kv("bytes", (intmax_t)ps.bytes);
+		dw.kv("hits", (intmax_t)ps.hits);
+		dw.kv("inserts", (intmax_t)ps.inserts);
+		dw.kv("evictions", (intmax_t)ps.evictions);
+	}
+
+	SlabClassStats slabs[SLAB_CLASS_NUM + 1];
+	slab_stats(slabs);
+	lw = aw.paramVList("slabs");
+	for (size_t i = 0; i <= SLAB_CLASS_NUM; ++i)
+	{
+		const SlabClassStats& sc = slabs[i];
+		if (!sc.reserved && !sc.used)
+			continue;
+
+		size_t used_bytes = sc.used * sc.size;
+		xic::VDictWriter dw = lw.vdict();
+		dw.kv("size", (intmax_t)sc.size);
+		dw.kv("reserved", (intmax_t)sc.reserved);
+		dw.kv("used", (intmax_t)sc.used);
+		dw.kv("cached", (intmax_t)sc.cached);
+		dw.kv("idle", (intmax_t)sc.idle);
+		dw.kv("unused_bytes", (intmax_t)(sc.reserved > used_bytes ? sc.reserved - used_bytes : 0));
+	}
+	return aw;
+}
+
+xic::AnswerPtr BigServant::getHotKeys(const xic::QuestPtr& quest, const xic::Current& current)
+{
+	xic::VDict args = quest->args();
+	xstr_t service = args.getXstr("service");
+
+	std::vector<RevServantPtr> srvs;
+	if (service.len)
+	{
+		RevServantPtr srv = _registry.find(service);
+		if (srv)
+			srvs.push_back(srv);
+	}
+	else
+	{
+		_registry.snapshot()->servants(srvs);
+	}
+
+	xic::AnswerWriter aw;
+	xic::VListWriter lw = aw.paramVList("services");
+	for (size_t i = 0; i < srvs.size(); ++i)
+	{
+		HotKeys *hk = NULL;
+		MCache *mc = dynamic_cast<MCache *>(srvs[i].get());
+		Redis *rd = dynamic_cast<Redis *>(srvs[i].get());
+		if (mc)
+			hk = &mc->hotKeys();
+		else if (rd)
+			hk = &rd->hotKeys();
+
+		if (hk)
+		{
+			xic::VDictWriter dw = lw.vdict();
+			dw.kv("service", srvs[i]->service());
+			hk->getInfo(dw);
+		}
+	}
+	return aw;
+}
+
+xic::AnswerPtr BigServant::getPeerStats(const xic::QuestPtr& quest, const xic::Current& current)
+{
+	xic::AnswerWriter aw;
+	_peerbus->getStats(aw);
+	return aw;
+}
+
 void BigServant::shutdown()
 {
 	_engine->shutdown();
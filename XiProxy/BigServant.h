@@ -4,19 +4,26 @@
 #include "RevServant.h"
 #include "ProxyConfig.h"
 #include "RCache.h"
+#include "PeerBus.h"
+#include "ServantRegistry.h"
 #include "xic/ServantI.h"
 #include "xslib/XTimer.h"
 
 class BigServant: public xic::Servant, private XMutex
 {
-	typedef std::map<std::string, RevServantPtr> ServantMap;
+	class Loading;
+	typedef XPtr<Loading> LoadingPtr;
+
 	xic::EnginePtr _engine;
-	ServantMap _map;
-	ServantMap::iterator _hint;
+	ServantRegistry _registry;
+	std::map<std::string, LoadingPtr> _loading;
+	std::map<std::string, time_t> _unknown;
+	int _unknown_ttl;
+	int _reloads;
 	ProxyConfig _proxyConfig;
 	RCachePtr _rcache;
 	XTimerPtr _timer;
-	int _rcache_expire_max;
+	PeerBusPtr _peerbus;
 public:
 	BigServant(const xic::EnginePtr& engine, const SettingPtr& setting);
 	virtual ~BigServant();
@@ -24,22 +31,36 @@ public:
 	virtual xic::AnswerPtr process(const xic::QuestPtr& quest, const xic::Current& current);
 	virtual xic::AnswerPtr salvo(const xic::QuestPtr& quest, const xic::Current& current);
 
-	RevServantPtr find(const std::string& service, bool load);
+	RevServantPtr find(const xstr_t& service, bool load);
+	RevServantPtr find(const std::string& service, bool load)
+	{
+		xstr_t xs = XSTR_CXX(service);
+		return find(xs, load);
+	}
 	void remove(const std::string& service);
 
 	RCachePtr rcache() const 	{ return _rcache; }
 	XTimerPtr timer() const 	{ return _timer; }
+	PeerBusPtr peerbus() const 	{ return _peerbus; }
 
 	xic::AnswerPtr stats(const xic::QuestPtr& quest, const xic::Current& current);
 	xic::AnswerPtr getProxyInfo(const xic::QuestPtr& quest, const xic::Current& current);
 	xic::AnswerPtr markProxyMethods(const xic::QuestPtr& quest, const xic::Current& current);
-	void clearCache()		{ _rcache->clear(); }
+	xic::AnswerPtr getCacheInfo(const xic::QuestPtr& quest, const xic::Current& current);
+	xic::AnswerPtr getCacheStats(const xic::QuestPtr& quest, const xic::Current& current);
+	xic::AnswerPtr getCacheSample(const xic::QuestPtr& quest, const xic::Current& current);
+	xic::AnswerPtr getCacheTop(const xic::QuestPtr& quest, const xic::Current& current);
+	xic::AnswerPtr getHotKeys(const xic::QuestPtr& quest, const xic::Current& current);
+	xic::AnswerPtr getPeerStats(const xic::QuestPtr& quest, const xic::Current& current);
+	xic::AnswerPtr clearCache(const xic::QuestPtr& quest, const xic::Current& current);
 	void shutdown();
 
 private:
 	RevServantPtr _load(const std::string& service);
+	void _loaded(const std::string& name, int reloads, const RevServantPtr& srv, const char *error);
 	void reload_thread();
 	void reap_thread();
+	void prewarm_thread();
 };
 typedef XPtr<BigServant> BigServantPtr;
 
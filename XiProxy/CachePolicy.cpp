@@ -0,0 +1,120 @@
+#include "CachePolicy.h"
+#include "dlog/dlog.h"
+#include "xslib/cxxstr.h"
+#include <algorithm>
+
+CachePolicy::CachePolicy(const std::string& service, const std::string& rules)
+	: _service(service), _default(false)
+{
+	xstr_t xs = XSTR_CXX(rules);
+	xstr_t line;
+	while (xstr_delimit_char(&xs, '\n', &line))
+	{
+		xstr_trim(&line);
+		if (line.len == 0)
+			continue;
+
+		std::string method;
+		CacheRule rule;
+		std::vector<std::string> excludes;
+		if (!parse(line, method, rule, excludes))
+		{
+			dlog("WARNING", "Invalid cache rule (%.*s) for service (%s)", XSTR_P(&line), _service.c_str());
+			continue;
+		}
+
+		if (!excludes.empty())
+		{
+			std::sort(excludes.begin(), excludes.end());
+			std::vector<std::string>& v = _excludes[method];
+			v.swap(excludes);
+			rule.excludes = &v;
+		}
+
+		if (method == "*")
+		{
+			_default_rule = rule;
+			_default = true;
+		}
+		else
+		{
+			_rules[method] = rule;
+		}
+	}
+}
+
+bool CachePolicy::parse(const xstr_t& line, std::string& method, CacheRule& rule, std::vector<std::string>& excludes)
+{
+	xstr_t xs = line;
+	xstr_t token;
+	if (!xstr_token_space(&xs, &token))
+		return false;
+	method = make_string(token);
+
+	while (xstr_token_space(&xs, &token))
+	{
+		xstr_t key, value;
+		if (xstr_key_value(&token, '=', &key, &value) < 0)
+		{
+			if (xstr_equal_cstr(&token, "force"))
+				rule.force = true;
+			else if (xstr_equal_cstr(&token, "canonical"))
+				rule.canonical = true;
+			else if (xstr_equal_cstr(&token, "retry"))
+				rule.retry = true;
+			else
+				return false;
+			continue;
+		}
+
+		if (xstr_equal_cstr(&key, "hedge") && xstr_equal_cstr(&value, "p95"))
+		{
+			rule.hedge = HEDGE_P95;
+			continue;
+		}
+
+		if (xstr_equal_cstr(&key, "exclude"))
+		{
+			xstr_t arg;
+			while (xstr_delimit_char(&value, ',', &arg))
+			{
+				if (arg.len)
+					excludes.push_back(make_string(arg));
+			}
+			rule.canonical = true;
+			continue;
+		}
+
+		xstr_t end;
+		long n = xstr_to_long(&value, &end, 10);
+		if (end.len || n < 0)
+			return false;
+
+		if (xstr_equal_cstr(&key, "ttl"))
+			rule.ttl = n;
+		else if (xstr_equal_cstr(&key, "stale"))
+			rule.stale = n;
+		else if (xstr_equal_cstr(&key, "negative"))
+			rule.negative = n;
+		else if (xstr_equal_cstr(&key, "size"))
+			rule.size_max = n;
+		else if (xstr_equal_cstr(&key, "hedge"))
+			rule.hedge = n;
+		else
+			return false;
+	}
+	if (rule.hedge)
+		rule.retry = true;
+	return rule.ttl > 0 || rule.hedge || rule.retry;
+}
+
+const CacheRule* CachePolicy::find(const xstr_t& method) const
+{
+	if (!_rules.empty())
+	{
+		std::map<std::string, CacheRule>::const_iterator iter = _rules.find(make_string(method));
+		if (iter != _rules.end())
+			return &iter->second;
+	}
+	return _default ? &_default_rule : NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef CachePolicy_h_
+#define CachePolicy_h_
+
+#include "xslib/xstr.h"
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#define HEDGE_P95	(-1)
+
+/* How the answers of a method are cached, and whether its calls are hedged.
+ */
+struct CacheRule
+{
+	int ttl;		// seconds to cache the normal answer, 0 for no caching
+	int stale;		// seconds to serve the stale answer while refreshing it
+	int negative;		// seconds to cache the exception answer, 0 for no caching
+	size_t size_max;	// the answer larger than this is not cached, 0 for no limit
+	bool force;		// ignore the CACHE context of the client
+	bool canonical;		// the cache key is from the canonical form of the args
+	int hedge;		// msec before a duplicate call to another endpoint, HEDGE_P95 for the
+				// observed p95 latency of the method, 0 for no hedging
+	bool retry;		// the call failed on the connection is retried on another endpoint
+	const std::vector<std::string> *excludes;	// args not in the canonical form, sorted,
+				// owned by the CachePolicy
+
+	CacheRule() : ttl(0), stale(0), negative(1), size_max(0), force(false), canonical(false), hedge(0), retry(false), excludes(NULL)
+	{
+	}
+};
+
+/* The cache rules of a service, compiled from the ':' lines in the
+ * list file, each of which is:
+ *	: method|* ttl=n [stale=n] [negative=n] [size=n] [force] [canonical] [exclude=arg1,arg2...] [hedge=n|p95] [retry]
+ * The rule of '*' applies to the methods not listed.
+ * The exclude implies canonical. The hedge implies retry.
+ * The ttl can be 0 if the method is hedged or retried only, which
+ * should be idempotent.
+ */
+class CachePolicy
+{
+public:
+	CachePolicy(const std::string& service, const std::string& rules);
+
+	/* Return NULL if no rule for the method */
+	const CacheRule* find(const xstr_t& method) const;
+
+private:
+	/* Not copyable, the excludes of the rules point into _excludes */
+	CachePolicy(const CachePolicy&);
+	CachePolicy& operator=(const CachePolicy&);
+
+	bool parse(const xstr_t& line, std::string& method, CacheRule& rule, std::vector<std::string>& excludes);
+
+private:
+	std::string _service;
+	std::map<std::string, CacheRule> _rules;
+	CacheRule _default_rule;
+	bool _default;
+	std::map<std::string, std::vector<std::string> > _excludes;
+};
+
+#endif
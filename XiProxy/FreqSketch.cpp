@@ -0,0 +1,69 @@
+#include "FreqSketch.h"
+#include "xslib/xsdef.h"
+#include <stdlib.h>
+
+#define COUNT_MAX	0xffff
+
+
+FreqSketch::FreqSketch(size_t width, unsigned int count_max, size_t sample_size)
+{
+	size_t n = 16;
+	while (n < width)
+		n <<= 1;
+
+	_tab = XS_CALLOC(uint16_t, ROWS * n);
+	_mask = n - 1;
+	_count_max = count_max < COUNT_MAX ? count_max : COUNT_MAX;
+	_additions = 0;
+	_sample_size = sample_size > 0 ? sample_size : 10 * n;
+}
+
+FreqSketch::~FreqSketch()
+{
+	free(_tab);
+}
+
+unsigned int FreqSketch::increment(uint32_t h1, uint32_t h2)
+{
+	unsigned int min = COUNT_MAX;
+	bool added = false;
+	for (int row = 0; row < ROWS; ++row)
+	{
+		uint16_t *p = &_tab[index(row, h1, h2)];
+		if (*p < _count_max)
+		{
+			++*p;
+			added = true;
+		}
+		if (*p < min)
+			min = *p;
+	}
+
+	if (added && ++_additions >= _sample_size)
+		halve();
+
+	return min;
+}
+
+unsigned int FreqSketch::estimate(uint32_t h1, uint32_t h2) const
+{
+	unsigned int min = COUNT_MAX;
+	for (int row = 0; row < ROWS; ++row)
+	{
+		unsigned int count = _tab[index(row, h1, h2)];
+		if (count < min)
+			min = count;
+	}
+	return min;
+}
+
+void FreqSketch::halve()
+{
+	size_t size = ROWS * (_mask + 1);
+	for (size_t i = 0; i < size; ++i)
+	{
+		_tab[i] >>= 1;
+	}
+	_additions /= 2;
+}
+
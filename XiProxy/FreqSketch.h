@@ -0,0 +1,40 @@
+#ifndef FreqSketch_h_
+#define FreqSketch_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Count-min sketch with ROWS rows of saturating counters.
+ * All the counters are halved after every sample_size increments,
+ * so old popularity fades away.
+ */
+class FreqSketch
+{
+public:
+	enum { ROWS = 4 };
+
+	FreqSketch(size_t width, unsigned int count_max, size_t sample_size);
+	~FreqSketch();
+
+	/* Return the estimated count after the increment */
+	unsigned int increment(uint32_t h1, uint32_t h2);
+
+	unsigned int estimate(uint32_t h1, uint32_t h2) const;
+
+	void halve();
+
+private:
+	size_t index(int row, uint32_t h1, uint32_t h2) const
+	{
+		return row * (_mask + 1) + ((h1 + row * (h2 | 1)) & _mask);
+	}
+
+private:
+	uint16_t *_tab;
+	uint32_t _mask;
+	unsigned int _count_max;
+	size_t _additions;
+	size_t _sample_size;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "HotKeys.h"
+#include "XiProxy.h"
+#include "xslib/cxxstr.h"
+#include "xslib/rdtsc.h"
+#include <stdint.h>
+
+#define SKETCH_WIDTH	4096
+#define COUNT_MAX	0xffff
+
+
+// The counters are halved only by time, not by the number of increments.
+HotKeys::HotKeys()
+	: _sketch(SKETCH_WIDTH, COUNT_MAX, SIZE_MAX), _decay_time(0), _promotions(0)
+{
+	for (int i = 0; i < HOTKEY_FILTER_SIZE; ++i)
+		xatomic_set(&_filter[i], 0);
+}
+
+static inline uint32_t filter_hash(const RKey& rkey)
+{
+	return rkey.hash() | 1;
+}
+
+// The top bits of the scrambled TSC, without any write shared by threads.
+static inline bool sampled()
+{
+	return ((rdtsc() * 0x9E3779B97F4A7C15ULL) >> 32) % HOTKEY_SAMPLE == 0;
+}
+
+void HotKeys::unfilter(uint32_t hash)
+{
+	xatomic_t *slot = &_filter[hash % HOTKEY_FILTER_SIZE];
+	if ((uint32_t)xatomic_get(slot) == hash)
+		xatomic_set(slot, 0);
+}
+
+void HotKeys::decay(time_t now)
+{
+	// Halved once for each period passed, at most 16 times.
+	int period = xp_hotkey_decay > 0 ? xp_hotkey_decay : 1;
+	int times = _decay_time ? 1 + (now - _decay_time) / period : 1;
+	if (times > 16)
+		times = 16;
+	for (int i = 0; i < times; ++i)
+		_sketch.halve();
+	_decay_time = now + period;
+
+	for (std::map<std::string, Hot>::iterator iter = _hots.begin(); iter != _hots.end(); )
+	{
+		iter->second.count >>= times;
+		if (iter->second.count < (unsigned int)xp_hotkey_threshold)
+		{
+			unfilter(iter->second.hash);
+			_hots.erase(iter++);
+		}
+		else
+			++iter;
+	}
+}
+
+bool HotKeys::touch(const RKey& rkey, const xstr_t& key, time_t now)
+{
+	if (xp_hotkey_threshold <= 0)
+		return false;
+
+	uint32_t hash = filter_hash(rkey);
+	xatomic_t *slot = &_filter[hash % HOTKEY_FILTER_SIZE];
+	if (!sampled())
+		return (uint32_t)xatomic_get(slot) == hash;
+
+	Lock lock(*this);
+	if (now >= _decay_time)
+		decay(now);
+
+	unsigned int count = _sketch.increment(rkey.hash(), rkey.hash2()) * HOTKEY_SAMPLE;
+	if (count < (unsigned int)xp_hotkey_threshold)
+		return false;
+
+	std::string k = make_string(key);
+	std::map<std::string, Hot>::iterator iter = _hots.find(k);
+	if (iter != _hots.end())
+	{
+		iter->second.count = count;
+		xatomic_set(slot, hash);
+		return true;
+	}
+
+	// The key replaces the coldest one if the list is full.
+	if (_hots.size() >= (size_t)xp_hotkey_max)
+	{
+		std::map<std::string, Hot>::iterator coldest = _hots.begin();
+		for (iter = _hots.begin(); iter != _hots.end(); ++iter)
+		{
+			if (iter->second.count < coldest->second.count)
+				coldest = iter;
+		}
+
+		if (coldest == _hots.end() || coldest->second.count >= count)
+			return false;
+		unfilter(coldest->second.hash);
+		_hots.erase(coldest);
+	}
+
+	Hot& hot = _hots[k];
+	hot.count = count;
+	hot.hash = hash;
+	hot.since = now;
+	xatomic_set(slot, hash);
+	++_promotions;
+	return true;
+}
+
+void HotKeys::getInfo(xic::VDictWriter& dw)
+{
+	Lock lock(*this);
+	dw.kv("promotions", (intmax_t)_promotions);
+	xic::VListWriter lw = dw.kvlist("keys");
+	for (std::map<std::string, Hot>::iterator iter = _hots.begin(); iter != _hots.end(); ++iter)
+	{
+		xic::VDictWriter d = lw.vdict();
+		d.kv("key", iter->first);
+		d.kv("count", (intmax_t)iter->second.count);
+		d.kv("since", (intmax_t)iter->second.since);
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef HotKeys_h_
+#define HotKeys_h_
+
+#include "RCache.h"
+#include "FreqSketch.h"
+#include "xic/Engine.h"
+#include "xslib/XLock.h"
+#include "xslib/xatomic.h"
+#include <string>
+#include <map>
+
+/* The access frequency of the keys of a service, counted in a count-min
+ * sketch whose counters are halved every xp_hotkey_decay seconds.
+ * The keys counted not less than xp_hotkey_threshold are hot, and are
+ * kept in RCache for xp_hotkey_ttl seconds even if the client doesn't
+ * ask for it. The hottest xp_hotkey_max keys are listed.
+ *
+ * Only one in HOTKEY_SAMPLE accesses is counted under the lock. The
+ * others only check, without the lock, whether the hash of the key is
+ * in the filter of the hot keys.
+ */
+#define HOTKEY_SAMPLE		16
+#define HOTKEY_FILTER_SIZE	1024
+
+class HotKeys: private XMutex
+{
+	struct Hot
+	{
+		unsigned int count;
+		uint32_t hash;
+		time_t since;
+	};
+
+	xatomic_t _filter[HOTKEY_FILTER_SIZE];
+	FreqSketch _sketch;
+	time_t _decay_time;
+	std::map<std::string, Hot> _hots;
+	uint64_t _promotions;
+
+	void decay(time_t now);
+	void unfilter(uint32_t hash);
+public:
+	HotKeys();
+
+	/* Count the access of the key, return true if it is hot */
+	bool touch(const RKey& rkey, const xstr_t& key, time_t now);
+
+	void getInfo(xic::VDictWriter& dw);
+};
+
+#endif
@@ -280,6 +280,21 @@ static void build_ctx(xic::ContextBuilder& ctxBuilder, struct MHD_Connection *co
 			ctxBuilder("CACHE", n);
 	}
 
+	const char *stale = MHD_lookup_connection_value(con, MHD_HEADER_KIND, "XiProxy-Cache-Stale");
+	if (stale)
+	{
+		char *end;
+		long n = strtoul(stale, &end, 10);
+		if (n > 0 && *end == 0)
+			ctxBuilder("CACHE_STALE", n);
+	}
+
+	const char *tags = MHD_lookup_connection_value(con, MHD_HEADER_KIND, "XiProxy-Cache-Tags");
+	if (tags)
+	{
+		ctxBuilder("CACHE_TAGS", tags);
+	}
+
 	const char *xic_hint = MHD_lookup_connection_value(con, MHD_HEADER_KIND, "Xic-Hint");
 	if (xic_hint)
 	{
@@ -1,4 +1,6 @@
 #include "LCache.h"
+#include "XiServant.h"
+#include "xslib/cxxstr.h"
 #include "xslib/rdtsc.h"
 
 xic::MethodTab::PairType LCache::_funpairs[] = {
@@ -10,8 +12,8 @@ xic::MethodTab::PairType LCache::_funpairs[] = {
 xic::MethodTab LCache::_funtab(_funpairs, XS_ARRCOUNT(_funpairs));
 
 
-LCache::LCache(const RCachePtr& rcache)
-	: ServantI(&_funtab), _rcache(rcache)
+LCache::LCache(const BigServantPtr& bigsrv)
+	: ServantI(&_funtab), _bigsrv(bigsrv), _rcache(bigsrv->rcache()), _peerbus(bigsrv->peerbus())
 {
 }
 
@@ -19,6 +21,16 @@ LCache::~LCache()
 {
 }
 
+RKey LCache::answer_key(const xstr_t& service, const xstr_t& method, const vbs_dict_t *args)
+{
+	// The key depends on the cache rule of the service if it is loaded.
+	RevServantPtr srv = _bigsrv->find(service, false);
+	XiServant *xsrv = dynamic_cast<XiServant *>(srv.get());
+	if (xsrv)
+		return xsrv->answerKey(method, args);
+	return RKey(service, method, args->_raw);
+}
+
 XIC_METHOD(LCache, get)
 {
 	xic::QuestReader qr(quest);
@@ -29,8 +41,11 @@ XIC_METHOD(LCache, get)
 	RData d = _rcache->use(rkey);
 	long age = d ? (rdtsc() - d.ctime()) / cpu_frequency() : LONG_MAX;
 
+	bool hit = (d && (!maxage || age < maxage) && d.type() == RD_LCACHE && (d = _rcache->unzip(d)));
+	_rcache->count(RD_LCACHE, 0, hit ? RC_HIT : RC_MISS);
+
 	xic::AnswerWriter aw;
-	if (d && (!maxage || age < maxage) && d.type() == RD_LCACHE)
+	if (hit)
 	{
 		aw.paramStanza("value", d.data(), d.length());
 		aw.param("age", age);
@@ -70,8 +85,11 @@ XIC_METHOD(LCache, get_or_set)
 	RData d = _rcache->use(rkey);
 	long age = d ? (rdtsc() - d.ctime()) / cpu_frequency() : LONG_MAX;
 
+	bool hit = (d && (!maxage || age < maxage) && d.type() == RD_LCACHE && (d = _rcache->unzip(d)));
+	_rcache->count(RD_LCACHE, 0, hit ? RC_HIT : RC_MISS);
+
 	xic::AnswerWriter aw;
-	if (d && (!maxage || age < maxage) && d.type() == RD_LCACHE)
+	if (hit)
 	{
 		aw.paramStanza("value", d.data(), d.length());
 		aw.param("age", age);
@@ -103,9 +121,12 @@ XIC_METHOD(LCache, get_and_set)
 	RData d = _rcache->use(rkey);
 	long age = d ? (rdtsc() - d.ctime()) / cpu_frequency() : LONG_MAX;
 
+	bool hit = (d && (!maxage || age < maxage) && d.type() == RD_LCACHE && (d = _rcache->unzip(d)));
+	_rcache->count(RD_LCACHE, 0, hit ? RC_HIT : RC_MISS);
+
 	// get
 	xic::AnswerWriter aw;
-	if (d && (!maxage || age < maxage) && d.type() == RD_LCACHE)
+	if (hit)
 	{
 		aw.paramStanza("value", d.data(), d.length());
 		aw.param("age", age);
@@ -153,15 +174,23 @@ XIC_METHOD(LCache, getAll)
 			after = 0;
 	}
 
+	size_t size = keys.size();
+	std::vector<RKey> rkeys(size);
+	for (size_t i = 0; i < size; ++i)
+		rkeys[i] = RKey(keys[i]);
+
+	std::vector<RData> datas;
+	_rcache->useMany(rkeys, datas);
+
 	xic::AnswerWriter aw;
 	xic::VDictWriter dw = aw.paramVDict("items");
-	size_t size = keys.size();
 	for (size_t i = 0; i < size; ++i)
 	{
 		const xstr_t& key = keys[i];
-		RKey rkey(key);
-		RData d = _rcache->use(rkey);
-		if (d && d.ctime() > after && d.type() == RD_LCACHE)
+		RData& d = datas[i];
+		bool hit = (d && d.ctime() > after && d.type() == RD_LCACHE && (d = _rcache->unzip(d)));
+		_rcache->count(RD_LCACHE, 0, hit ? RC_HIT : RC_MISS);
+		if (hit)
 		{
 			dw.kvstanza(key, d.data(), d.length());
 		}
@@ -196,8 +225,9 @@ XIC_METHOD(LCache, remove_answer)
 	const xstr_t& s = qr.wantXstr("s");
 	const xstr_t& m = qr.wantXstr("m");
 	const vbs_dict_t *p = qr.want_dict("a");
-	RKey rkey(s, m, p->_raw);
+	RKey rkey = answer_key(s, m, p);
 	bool ok = _rcache->remove(rkey);
+	_peerbus->invalidate(rkey);
 	return xic::AnswerWriter()("ok", ok);
 }
 
@@ -207,12 +237,12 @@ XIC_METHOD(LCache, get_answer)
 	const xstr_t& s = qr.wantXstr("s");
 	const xstr_t& m = qr.wantXstr("m");
 	const vbs_dict_t *p = qr.want_dict("a");
-	RKey rkey(s, m, p->_raw);
+	RKey rkey = answer_key(s, m, p);
 	RData d = _rcache->find(rkey);
 	long age = d ? (rdtsc() - d.ctime()) / cpu_frequency() : LONG_MAX;
 
 	xic::AnswerWriter aw;
-	if (d && d.type() == RD_ANSWER)
+	if (d && d.type() == RD_ANSWER && (d = _rcache->unzip(d)))
 	{
 		aw.paramStanza("value", d.data(), d.length());
 		aw.param("age", age);
@@ -229,6 +259,7 @@ XIC_METHOD(LCache, remove_mcache)
 	const xstr_t& k = qr.wantXstr("k");
 	RKey rkey(s, k);
 	bool ok = _rcache->remove(rkey);
+	_peerbus->invalidate(rkey);
 	return xic::AnswerWriter()("ok", ok);
 }
 
@@ -237,16 +268,49 @@ XIC_METHOD(LCache, get_mcache)
 	xic::QuestReader qr(quest);
 	const xstr_t& s = qr.wantXstr("s");
 	const xstr_t& k = qr.wantXstr("k");
+	bool zip = qr.getBool("zip");
 	RKey rkey(s, k);
 	RData d = _rcache->find(rkey);
 	long age = d ? (rdtsc() - d.ctime()) / cpu_frequency() : LONG_MAX;
 
 	xic::AnswerWriter aw;
-	if (d && d.type() == RD_MCACHE)
+	if (d && d.type() == RD_MCACHE && (zip || (d = _rcache->unzip(d))))
 	{
+		// The zipped value is in the same format as the one stored in memcached.
 		aw.paramBlob("value", d.data(), d.length());
 		aw.param("age", age);
+		if (d.zipped())
+			aw.param("_zip", true);
 	}
 	return aw;
 }
 
+XIC_METHOD(LCache, remove_by_method)
+{
+	xic::QuestReader qr(quest);
+	const xstr_t& s = qr.wantXstr("s");
+	const xstr_t& m = qr.wantXstr("m");
+	RKey index = RCache::methodIndex(s, m);
+	size_t num = _rcache->removeIndexed(index);
+	_peerbus->invalidateIndex(index);
+	return xic::AnswerWriter()("num", (intmax_t)num);
+}
+
+XIC_METHOD(LCache, remove_by_tag)
+{
+	xic::QuestReader qr(quest);
+	const xstr_t& s = qr.wantXstr("s");
+	const xstr_t& tag = qr.wantXstr("tag");
+	RKey index = RCache::tagIndex(s, tag);
+	size_t num = _rcache->removeIndexed(index);
+	_peerbus->invalidateIndex(index);
+	return xic::AnswerWriter()("num", (intmax_t)num);
+}
+
+XIC_METHOD(LCache, remove_by_service)
+{
+	xic::QuestReader qr(quest);
+	const xstr_t& s = qr.wantXstr("s");
+	bool ok = _rcache->clearOwner(make_string(s));
+	return xic::AnswerWriter()("ok", ok);
+}
@@ -3,6 +3,7 @@
 
 #include "xic/ServantI.h"
 #include "RCache.h"
+#include "BigServant.h"
 
 #define LCACHE_CMDS		\
 	CMD(set)		\
@@ -16,6 +17,9 @@
 	CMD(get_answer)		\
 	CMD(remove_mcache)	\
 	CMD(get_mcache)		\
+	CMD(remove_by_method)	\
+	CMD(remove_by_tag)	\
+	CMD(remove_by_service)	\
 	/* END OF CMDS */
 
 class LCache: public xic::ServantI
@@ -23,9 +27,13 @@ class LCache: public xic::ServantI
 	static xic::MethodTab::PairType _funpairs[];
 	static xic::MethodTab _funtab;
 
+	BigServantPtr _bigsrv;
 	RCachePtr _rcache;
+	PeerBusPtr _peerbus;
+
+	RKey answer_key(const xstr_t& service, const xstr_t& method, const vbs_dict_t *args);
 public:
-	LCache(const RCachePtr& rcache);
+	LCache(const BigServantPtr& bigsrv);
 	virtual ~LCache();
 
 private:
@@ -1,5 +1,6 @@
 #include "MCache.h"
 #include "lz4codec.h"
+#include "XiProxy.h"
 #include "xic/Engine.h"
 #include "dlog/dlog.h"
 #include "xslib/vbs.h"
@@ -26,9 +27,12 @@ static void start_dispatcher()
 	the_dispatcher->start();
 }
 
-MCache::MCache(const xic::EnginePtr& engine, const std::string& service, int revision, const std::string& servers, const RCachePtr& rcache)
-	: RevServant(engine, service, revision), _servers(servers), _rcache(rcache)
+MCache::MCache(const xic::EnginePtr& engine, const std::string& service, int revision, const std::string& servers,
+		const RCachePtr& rcache, const PeerBusPtr& peerbus)
+	: RevServant(engine, service, revision), _servers(servers), _rcache(rcache), _peerbus(peerbus)
 {
+	_rcache_part = _rcache->partition(_service);
+	_rcache_owner = _rcache->owner(_service);
 	pthread_once(&dispatcher_once, start_dispatcher);
 
 	_memcache.reset(new Memcache(the_dispatcher, _service, servers));
@@ -61,23 +65,33 @@ void MCache::getInfo(xic::VDictWriter& dw)
 	dw.kv("servers", _servers);
 }
 
+void MCache::invalidate(const RKey& rkey)
+{
+	_rcache->remove(rkey);
+	_peerbus->invalidate(rkey);
+}
+
 class MCacheCallback: public MCallback
 {
 	xic::WaiterPtr _waiter;
 	RCachePtr _rcache;
 	std::string _service;
+	int _ttl;
+	int _part;
+	int _owner;
 	xic::AnswerWriter _aw;
 	int64_t _ivalue;
 	std::vector<MValue> _mvalues;
 public:
 	MCacheCallback(MOCategory category, const xic::WaiterPtr& waiter)
-		: MCallback(category), _waiter(waiter)
+		: MCallback(category), _waiter(waiter), _ttl(0), _part(0), _owner(0)
 	{
 		_ivalue = 0;
 	}
 
-	MCacheCallback(MOCategory category, const xic::WaiterPtr& waiter, const RCachePtr& rcache, const std::string& service)
-		: MCallback(category), _waiter(waiter), _rcache(rcache), _service(service)
+	MCacheCallback(MOCategory category, const xic::WaiterPtr& waiter, const RCachePtr& rcache, const std::string& service, int ttl,
+			int part, int owner)
+		: MCallback(category), _waiter(waiter), _rcache(rcache), _service(service), _ttl(ttl), _part(part), _owner(owner)
 	{
 		_ivalue = 0;
 	}
@@ -108,11 +122,15 @@ void MCacheCallback::received(const MValue vals[], size_t num, bool cache, void
 	{
 		xstr_t service = XSTR_CXX(_service);
 		ostk_t *ostk = _aw.ostk();
+		std::vector<RKey> rkeys;
+		std::vector<RData> rdatas;
 		for (size_t i = 0; i < num; ++i)
 		{
 			MValue mv = vals[i];
+			xstr_t zipped = xstr_null;
 			if (mv.flags & FLAG_LZ4_ZIP)
 			{
+				zipped = mv.value;
 				int rc = attempt_lz4_unzip(ostk, mv.value, mv.value);
 				if (rc < 0)
 				{
@@ -135,11 +153,22 @@ void MCacheCallback::received(const MValue vals[], size_t num, bool cache, void
 
 			if (cache && _rcache)
 			{
+				uint64_t now = rdtsc();
 				RKey rkey(service, mv.key);
-				RData rdata(rdtsc(), RD_MCACHE, mv.value);
-				_rcache->replace(rkey, rdata);
+				// Keep the value zipped as it is in memcached if the cache wants it zipped.
+				bool keep_zipped = zipped.len && _rcache->zipThreshold() && (size_t)mv.value.len >= _rcache->zipThreshold();
+				RData rdata(now, RD_MCACHE, keep_zipped ? zipped : mv.value);
+				rdata.setZipped(keep_zipped);
+				rdata.setPartition(_part);
+				rdata.setOwner(_owner);
+				rdata.setExpire(now + _ttl * cpu_frequency());
+				rkeys.push_back(rkey);
+				rdatas.push_back(rdata);
 			}
 		}
+
+		if (!rkeys.empty())
+			_rcache->replaceMany(rkeys, rdatas);
 	}
 }
 
@@ -238,12 +267,17 @@ XIC_METHOD(MCache, set)
 	RKey rkey(quest->service(), key);
 	if (cache)
 	{
-		RData rdata(rdtsc(), RD_MCACHE, value);
+		uint64_t now = rdtsc();
+		RData rdata(now, RD_MCACHE, value);
+		rdata.setExpire(now + (cache > 0 ? cache : -cache) * cpu_frequency());
+		rdata.setPartition(_rcache_part);
+		rdata.setOwner(_rcache_owner);
 		_rcache->replace(rkey, rdata);
+		_peerbus->invalidate(rkey);
 	}
 	else
 	{
-		_rcache->remove(rkey);
+		invalidate(rkey);
 	}
 
 	MCallbackPtr cb(new MCacheCallback(MOC_STORE, current.asynchronous()));
@@ -262,7 +296,7 @@ XIC_METHOD(MCache, replace)
 	uint32_t flags = (!nozip && value.len > ZIP_THRESHOLD) ? FLAG_LZ4_ZIP : 0;
 
 	RKey rkey(quest->service(), key);
-	_rcache->remove(rkey);
+	invalidate(rkey);
 
 	MCallbackPtr cb(new MCacheCallback(MOC_STORE, current.asynchronous()));
 	_memcache->replace(cb, key, value, expire, flags);
@@ -280,7 +314,7 @@ XIC_METHOD(MCache, add)
 	uint32_t flags = (!nozip && value.len > ZIP_THRESHOLD) ? FLAG_LZ4_ZIP : 0;
 
 	RKey rkey(quest->service(), key);
-	_rcache->remove(rkey);
+	invalidate(rkey);
 
 	MCallbackPtr cb(new MCacheCallback(MOC_STORE, current.asynchronous()));
 	_memcache->add(cb, key, value, expire, flags);
@@ -295,7 +329,7 @@ XIC_METHOD(MCache, append)
 	prepare_key(quest, key, value);
 
 	RKey rkey(quest->service(), key);
-	_rcache->remove(rkey);
+	invalidate(rkey);
 
 	MCallbackPtr cb(new MCacheCallback(MOC_STORE, current.asynchronous()));
 	_memcache->append(cb, key, value);
@@ -310,7 +344,7 @@ XIC_METHOD(MCache, prepend)
 	prepare_key(quest, key, value);
 
 	RKey rkey(quest->service(), key);
-	_rcache->remove(rkey);
+	invalidate(rkey);
 
 	MCallbackPtr cb(new MCacheCallback(MOC_STORE, current.asynchronous()));
 	_memcache->prepend(cb, key, value);
@@ -329,7 +363,7 @@ XIC_METHOD(MCache, cas)
 	uint32_t flags = (!nozip && value.len > ZIP_THRESHOLD) ? FLAG_LZ4_ZIP : 0;
 
 	RKey rkey(quest->service(), key);
-	_rcache->remove(rkey);
+	invalidate(rkey);
 
 	MCallbackPtr cb(new MCacheCallback(MOC_CAS, current.asynchronous()));
 	_memcache->cas(cb, key, value, revision, expire, flags);
@@ -343,7 +377,7 @@ XIC_METHOD(MCache, delete)
 	prepare_key(quest, key);
 
 	RKey rkey(quest->service(), key);
-	_rcache->remove(rkey);
+	invalidate(rkey);
 
 	MCallbackPtr cb(new MCacheCallback(MOC_DELETE, current.asynchronous()));
 	_memcache->remove(cb, key);
@@ -358,7 +392,7 @@ XIC_METHOD(MCache, increment)
 	int64_t value = args.wantInt("value");
 
 	RKey rkey(quest->service(), key);
-	_rcache->remove(rkey);
+	invalidate(rkey);
 
 	MCallbackPtr cb(new MCacheCallback(MOC_COUNT, current.asynchronous()));
 	_memcache->increment(cb, key, value);
@@ -373,7 +407,7 @@ XIC_METHOD(MCache, decrement)
 	int64_t value = args.wantInt("value");
 
 	RKey rkey(quest->service(), key);
-	_rcache->remove(rkey);
+	invalidate(rkey);
 
 	MCallbackPtr cb(new MCacheCallback(MOC_COUNT, current.asynchronous()));
 	_memcache->decrement(cb, key, value);
@@ -389,10 +423,16 @@ XIC_METHOD(MCache, get)
 	
 	xic::VDict ctx = quest->context();
 	int cache = ctx.getInt("CACHE");
-	MCallbackPtr cb(new MCacheCallback(MOC_GET, current.asynchronous(), cache ? _rcache : RCachePtr(), make_string(quest->service())));
+	RKey rkey(quest->service(), key);
+
+	// The hot key is cached even if the client doesn't ask for it.
+	if (_hotkeys.touch(rkey, key, _engine->time()) && !cache)
+		cache = xp_hotkey_ttl;
+
+	MCallbackPtr cb(new MCacheCallback(MOC_GET, current.asynchronous(), cache ? _rcache : RCachePtr(), make_string(quest->service()), cache > 0 ? cache : -cache,
+				_rcache_part, _rcache_owner));
 	if (cache > 0)
 	{
-		RKey rkey(quest->service(), key);
 		RData rdata = _rcache->find(rkey);
 		if (rdata && rdata.type() == RD_MCACHE)
 		{
@@ -400,8 +440,9 @@ XIC_METHOD(MCache, get)
 			// exception answer only cache 1 second.
 			uint64_t expire = (status ? 1 : cache) * cpu_frequency();
 
-			if ((rdtsc() - rdata.ctime()) < expire)
+			if ((rdtsc() - rdata.ctime()) < expire && (rdata = _rcache->unzip(rdata)))
 			{
+				_rcache->count(RD_MCACHE, _rcache_owner, RC_HIT);
 				if (status)
 				{
 					cb->completed(false);
@@ -419,6 +460,7 @@ XIC_METHOD(MCache, get)
 				return xic::ASYNC_ANSWER;
 			}
 		}
+		_rcache->count(RD_MCACHE, _rcache_owner, RC_MISS);
 	}
 
 	_memcache->get(cb, key);
@@ -438,25 +480,33 @@ XIC_METHOD(MCache, getMulti)
 
 	xic::VDict ctx = quest->context();
 	int cache = ctx.getInt("CACHE");
-	MCallbackPtr cb(new MCacheCallback(MOC_GETMULTI, current.asynchronous(), cache ? _rcache : RCachePtr(), make_string(quest->service())));
+	MCallbackPtr cb(new MCacheCallback(MOC_GETMULTI, current.asynchronous(), cache ? _rcache : RCachePtr(), make_string(quest->service()), cache > 0 ? cache : -cache,
+				_rcache_part, _rcache_owner));
 	if (cache > 0)
 	{
+		std::vector<RKey> rkeys(keys.size());
+		for (size_t i = 0; i < keys.size(); ++i)
+			rkeys[i] = RKey(quest->service(), keys[i]);
+
+		std::vector<RData> datas;
+		_rcache->findMany(rkeys, datas);
+
 		std::vector<xstr_t> notfoundkeys;
 		for (size_t i = 0; i < keys.size(); ++i)
 		{
 			xstr_t key = keys[i];
-			RKey rkey(quest->service(), key);
-			RData rdata = _rcache->find(rkey);
+			RData& rdata = datas[i];
 			if (rdata && rdata.type() == RD_MCACHE)
 			{
 				int status = rdata.status();
 				// exception answer only cache 1 second.
 				uint64_t expire = (status ? 1 : cache) * cpu_frequency();
 
-				if ((rdtsc() - rdata.ctime()) < expire)
+				if ((rdtsc() - rdata.ctime()) < expire && (rdata = _rcache->unzip(rdata)))
 				{
 					if (status == 0)
 					{
+						_rcache->count(RD_MCACHE, _rcache_owner, RC_HIT);
 						MValue mv;
 						mv.key = key;
 						mv.value = rdata.xstr();
@@ -468,6 +518,7 @@ XIC_METHOD(MCache, getMulti)
 				}
 			}
 
+			_rcache->count(RD_MCACHE, _rcache_owner, RC_MISS);
 			notfoundkeys.push_back(key);
 		}
 
@@ -2,6 +2,8 @@
 #define MCache_h_
 
 #include "RCache.h"
+#include "PeerBus.h"
+#include "HotKeys.h"
 #include "Memcache.h"
 #include "RevServant.h"
 #include "xic/ServantI.h"
@@ -30,14 +32,24 @@ class MCache: public RevServant, private XMutex
 
 	std::string _servers;
 	RCachePtr _rcache;
+	int _rcache_part;
+	int _rcache_owner;
+	PeerBusPtr _peerbus;
 	MemcachePtr _memcache;
+	HotKeys _hotkeys;
+
+	/* Remove the item from the local cache and from those of the peers */
+	void invalidate(const RKey& rkey);
 public:
-	MCache(const xic::EnginePtr& engine, const std::string& service, int revision, const std::string& servers, const RCachePtr& rcache);
+	MCache(const xic::EnginePtr& engine, const std::string& service, int revision, const std::string& servers,
+		const RCachePtr& rcache, const PeerBusPtr& peerbus);
 	virtual ~MCache();
 
 	virtual xic::AnswerPtr process(const xic::QuestPtr& quest, const xic::Current& current);
 	virtual void getInfo(xic::VDictWriter& dw);
 
+	HotKeys& hotKeys()			{ return _hotkeys; }
+
 private:
 #define CMD(X) XIC_METHOD_DECLARE(X);
 	MCACHE_CMDS
@@ -0,0 +1,308 @@
+#include "P2cBalancer.h"
+#include "XiProxy.h"
+#include "xslib/cxxstr.h"
+#include "dlog/dlog.h"
+#include "xslib/XError.h"
+#include <stdlib.h>
+#include <string.h>
+#include <alloca.h>
+#include <sstream>
+
+#define EWMA_SHIFT		3	// weight of a new sample is 1/8
+#define IDLE_HALVE_SECONDS	10
+#define WINDOW_CALLS_MIN	20
+#define OUTLIER_CALLS_MIN	20
+#define OUTLIER_USEC_MIN	10000
+#define OUTLIER_FACTOR		5
+#define OPEN_DOUBLE_MAX		5
+#define RETRY_CREDIT_MAX	(100 * 10)
+
+
+P2cBalancer::P2cBalancer(const xic::EnginePtr& engine, const std::string& identity, const std::string& option,
+		const std::string& endpoints)
+	: _engine(engine), _num_open(0), _retry_credit(0)
+{
+	xstr_t xs = XSTR_CXX(endpoints);
+	xstr_t endpoint;
+	while (xstr_delimit_char(&xs, '@', &endpoint))
+	{
+		xstr_trim(&endpoint);
+		if (endpoint.len == 0)
+			continue;
+
+		Endpoint ep;
+		ep.endpoint = make_string(endpoint);
+		ep.prx = engine->stringToProxy(identity + ' ' + option + '@' + ep.endpoint);
+		ep.ewma_usec = 0;
+		ep.error_permille = 0;
+		ep.underway = 0;
+		ep.last_time = 0;
+		ep.calls = 0;
+		ep.errors = 0;
+		ep.state = BREAKER_CLOSED;
+		ep.probing = false;
+		ep.consecutive = 0;
+		ep.ejected_in_row = 0;
+		ep.open_until = 0;
+		ep.ejections = 0;
+		memset(ep.slot_time, 0, sizeof(ep.slot_time));
+		memset(ep.slot_calls, 0, sizeof(ep.slot_calls));
+		memset(ep.slot_failures, 0, sizeof(ep.slot_failures));
+		_endpoints.push_back(ep);
+	}
+
+	if (_endpoints.empty())
+		throw XERROR_FMT(XError, "No endpoint for service %s", identity.c_str());
+}
+
+P2cBalancer::~P2cBalancer()
+{
+}
+
+bool P2cBalancer::takeOption(std::string& option)
+{
+	bool found = false;
+	std::ostringstream os;
+	xstr_t xs = XSTR_CXX(option);
+	xstr_t token;
+	while (xstr_token_space(&xs, &token))
+	{
+		if (xstr_equal_cstr(&token, "-lb:p2c"))
+			found = true;
+		else
+			os << make_string(token) << ' ';
+	}
+
+	if (found)
+		option = os.str();
+	return found;
+}
+
+int64_t P2cBalancer::score(Endpoint& ep, time_t now)
+{
+	if (ep.underway == 0 && ep.last_time && now - ep.last_time >= IDLE_HALVE_SECONDS)
+	{
+		int times = (now - ep.last_time) / IDLE_HALVE_SECONDS;
+		ep.ewma_usec = times < 63 ? ep.ewma_usec >> times : 0;
+		ep.error_permille = times < 31 ? ep.error_permille >> times : 0;
+		ep.last_time = now;
+	}
+	return (ep.ewma_usec + 1) * (ep.underway + 1) * (250 + ep.error_permille) / 250;
+}
+
+bool P2cBalancer::available(Endpoint& ep, time_t now, bool track)
+{
+	if (ep.state == BREAKER_OPEN && now >= ep.open_until)
+	{
+		ep.state = BREAKER_HALF_OPEN;
+		ep.probing = false;
+	}
+
+	// The probe of a half open endpoint must be a tracked call,
+	// whose outcome is known.
+	return ep.state == BREAKER_CLOSED || (ep.state == BREAKER_HALF_OPEN && track && !ep.probing);
+}
+
+size_t P2cBalancer::pick(xic::ProxyPtr& prx, bool track, ssize_t exclude, uint64_t *probe)
+{
+	size_t n = _endpoints.size();
+	size_t *candidates = (size_t *)alloca(n * sizeof(size_t));
+	time_t now = _engine->time();
+
+	Lock lock(*this);
+	_retry_credit += xp_retry_budget;
+	if (_retry_credit > RETRY_CREDIT_MAX)
+		_retry_credit = RETRY_CREDIT_MAX;
+
+	size_t m = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if ((ssize_t)i != exclude && available(_endpoints[i], now, track))
+			candidates[m++] = i;
+	}
+
+	// All are ejected, the breakers are ignored.
+	if (m == 0)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			if ((ssize_t)i != exclude || n == 1)
+				candidates[m++] = i;
+		}
+	}
+
+	size_t idx = candidates[0];
+	if (m > 1)
+	{
+		size_t a = random() % m;
+		size_t b = random() % (m - 1);
+		if (b >= a)
+			++b;
+
+		a = candidates[a];
+		b = candidates[b];
+		int64_t sa = score(_endpoints[a], now);
+		int64_t sb = score(_endpoints[b], now);
+		idx = (sa < sb || (sa == sb && (random() & 1))) ? a : b;
+	}
+
+	Endpoint& ep = _endpoints[idx];
+	bool probing = (ep.state == BREAKER_HALF_OPEN && track && !ep.probing);
+	if (probing)
+		ep.probing = true;
+	if (probe)
+		*probe = probing ? ep.ejections : 0;
+	if (track)
+		++ep.underway;
+
+	prx = ep.prx;
+	return idx;
+}
+
+bool P2cBalancer::outlier(size_t idx, int64_t usec)
+{
+	if (usec < OUTLIER_USEC_MIN)
+		return false;
+
+	int64_t sum = 0;
+	int num = 0;
+	for (size_t i = 0; i < _endpoints.size(); ++i)
+	{
+		const Endpoint& ep = _endpoints[i];
+		if (i != idx && ep.state == BREAKER_CLOSED && ep.calls >= OUTLIER_CALLS_MIN)
+		{
+			sum += ep.ewma_usec;
+			++num;
+		}
+	}
+	return num > 0 && usec > OUTLIER_FACTOR * (sum / num);
+}
+
+bool P2cBalancer::tripped(Endpoint& ep, time_t now)
+{
+	if (xp_breaker_failures > 0 && ep.consecutive >= xp_breaker_failures)
+		return true;
+
+	uint32_t calls = 0, failures = 0;
+	for (int i = 0; i < BREAKER_WINDOW; ++i)
+	{
+		if (ep.slot_time[i] > now - BREAKER_WINDOW)
+		{
+			calls += ep.slot_calls[i];
+			failures += ep.slot_failures[i];
+		}
+	}
+	return calls >= WINDOW_CALLS_MIN && failures * 100 >= calls * (uint32_t)xp_breaker_error_percent;
+}
+
+void P2cBalancer::open(Endpoint& ep, time_t now)
+{
+	if (ep.state != BREAKER_HALF_OPEN)
+		++_num_open;
+
+	int times = ep.ejected_in_row < OPEN_DOUBLE_MAX ? ep.ejected_in_row : OPEN_DOUBLE_MAX;
+	ep.state = BREAKER_OPEN;
+	ep.probing = false;
+	ep.open_until = now + ((time_t)xp_breaker_open_time << times);
+	++ep.ejected_in_row;
+	++ep.ejections;
+	dlog("XP_EJECT", "endpoint=%s consecutive=%d ewma_usec=%jd open=%ld",
+		ep.endpoint.c_str(), ep.consecutive, (intmax_t)ep.ewma_usec, (long)(ep.open_until - now));
+}
+
+void P2cBalancer::done(size_t idx, int64_t usec, Outcome outcome, uint64_t probe)
+{
+	if (idx >= _endpoints.size())
+		return;
+
+	time_t now = _engine->time();
+	Lock lock(*this);
+	Endpoint& ep = _endpoints[idx];
+	if (ep.underway > 0)
+		--ep.underway;
+
+	bool failed = (outcome == CALL_FAILED);
+	if (ep.calls == 0)
+		ep.ewma_usec = usec;
+	else
+		ep.ewma_usec += (usec - ep.ewma_usec) >> EWMA_SHIFT;
+	ep.error_permille += ((outcome != CALL_OK ? 1000 : 0) - ep.error_permille) >> EWMA_SHIFT;
+	ep.last_time = now;
+	++ep.calls;
+	if (outcome != CALL_OK)
+		++ep.errors;
+
+	int slot = now % BREAKER_WINDOW;
+	if (ep.slot_time[slot] != now)
+	{
+		ep.slot_time[slot] = now;
+		ep.slot_calls[slot] = 0;
+		ep.slot_failures[slot] = 0;
+	}
+	++ep.slot_calls[slot];
+	if (failed)
+	{
+		++ep.slot_failures[slot];
+		++ep.consecutive;
+	}
+	else
+	{
+		ep.consecutive = 0;
+	}
+
+	if (ep.state == BREAKER_HALF_OPEN)
+	{
+		// Only the probe decides, not the calls sent before the ejection.
+		if (!ep.probing || probe != ep.ejections)
+			return;
+
+		// The probe decides. The latency is started over from it.
+		ep.ewma_usec = usec;
+		if (failed || outlier(idx, usec))
+		{
+			open(ep, now);
+		}
+		else
+		{
+			ep.state = BREAKER_CLOSED;
+			ep.probing = false;
+			ep.ejected_in_row = 0;
+			memset(ep.slot_time, 0, sizeof(ep.slot_time));
+			--_num_open;
+		}
+	}
+	else if (ep.state == BREAKER_CLOSED && (_num_open + 1) * 2 <= _endpoints.size())
+	{
+		if (tripped(ep, now) || (ep.calls >= OUTLIER_CALLS_MIN && outlier(idx, ep.ewma_usec)))
+			open(ep, now);
+	}
+}
+
+bool P2cBalancer::takeRetry()
+{
+	Lock lock(*this);
+	if (_retry_credit < 100)
+		return false;
+	_retry_credit -= 100;
+	return true;
+}
+
+void P2cBalancer::getInfo(xic::VDictWriter& dw)
+{
+	Lock lock(*this);
+	xic::VListWriter lw = dw.kvlist("p2c");
+	for (size_t i = 0; i < _endpoints.size(); ++i)
+	{
+		const Endpoint& ep = _endpoints[i];
+		xic::VDictWriter d = lw.vdict();
+		d.kv("endpoint", ep.endpoint);
+		d.kv("ewma_usec", (intmax_t)ep.ewma_usec);
+		d.kv("error_permille", ep.error_permille);
+		d.kv("underway", ep.underway);
+		d.kv("calls", (intmax_t)ep.calls);
+		d.kv("errors", (intmax_t)ep.errors);
+		d.kv("breaker", ep.state == BREAKER_CLOSED ? "closed" : ep.state == BREAKER_OPEN ? "open" : "half_open");
+		d.kv("consecutive_failures", ep.consecutive);
+		d.kv("ejections", (intmax_t)ep.ejections);
+	}
+}
@@ -0,0 +1,106 @@
+#ifndef P2cBalancer_h_
+#define P2cBalancer_h_
+
+#include "xic/Engine.h"
+#include "xslib/XLock.h"
+#include <string>
+#include <vector>
+
+#define BREAKER_WINDOW		10	// seconds of the sliding window of the error rate
+
+/* The balancer of an external service with the option -lb:p2c.
+ * Each endpoint has its own proxy. A call goes to the better of two
+ * endpoints chosen at random. The score of an endpoint is its EWMA
+ * latency times the number of its calls underway, raised by its
+ * recent error rate. The EWMA of an endpoint not used for a while
+ * is halved every 10 seconds, so that it will be tried again.
+ *
+ * Each endpoint has a circuit breaker. It opens (the endpoint is
+ * ejected) after xp_breaker_failures consecutive failures, or when
+ * xp_breaker_error_percent of the calls in the last BREAKER_WINDOW
+ * seconds failed, or when its latency is an outlier among the others.
+ * After xp_breaker_open_time seconds (doubled for each ejection in a
+ * row) it is half open, and a single probe call decides whether it
+ * is closed or opened again. At most half of the endpoints are ejected.
+ * A failure is an exception of xic on the connection or a timeout,
+ * not an exception of the servant or of xic for a bad quest.
+ */
+class P2cBalancer: public XRefCount, private XMutex
+{
+public:
+	enum Outcome
+	{
+		CALL_OK,
+		CALL_ERROR,	// the exception of the servant or of a bad quest
+		CALL_FAILED,	// the connection failed or timed out, the endpoint is unhealthy
+	};
+
+	enum BreakerState
+	{
+		BREAKER_CLOSED,
+		BREAKER_OPEN,
+		BREAKER_HALF_OPEN,
+	};
+
+private:
+	struct Endpoint
+	{
+		std::string endpoint;
+		xic::ProxyPtr prx;
+		int64_t ewma_usec;
+		int error_permille;
+		int underway;
+		time_t last_time;
+		uint64_t calls;
+		uint64_t errors;
+
+		BreakerState state;
+		bool probing;
+		int consecutive;
+		int ejected_in_row;
+		time_t open_until;
+		uint64_t ejections;
+		time_t slot_time[BREAKER_WINDOW];
+		uint32_t slot_calls[BREAKER_WINDOW];
+		uint32_t slot_failures[BREAKER_WINDOW];
+	};
+
+	xic::EnginePtr _engine;
+	std::vector<Endpoint> _endpoints;
+	size_t _num_open;
+	int _retry_credit;
+
+	int64_t score(Endpoint& ep, time_t now);
+	bool available(Endpoint& ep, time_t now, bool track);
+	bool outlier(size_t idx, int64_t usec);
+	bool tripped(Endpoint& ep, time_t now);
+	void open(Endpoint& ep, time_t now);
+public:
+	/* endpoints are in the form of "@endpoint1@endpoint2..." */
+	P2cBalancer(const xic::EnginePtr& engine, const std::string& identity, const std::string& option,
+		const std::string& endpoints);
+	virtual ~P2cBalancer();
+
+	/* Remove -lb:p2c from the option, return true if it is there */
+	static bool takeOption(std::string& option);
+
+	size_t size() const			{ return _endpoints.size(); }
+
+	/* Choose an endpoint other than the excluded one for the call,
+	 * and return its index. If the call is tracked, done() must be
+	 * called when it is completed, with the probe set by pick(),
+	 * which is non-zero if the call is the probe of a half open endpoint.
+	 */
+	size_t pick(xic::ProxyPtr& prx, bool track, ssize_t exclude = -1, uint64_t *probe = NULL);
+	void done(size_t idx, int64_t usec, Outcome outcome, uint64_t probe);
+
+	/* Return true if a failed call may be retried on another endpoint,
+	 * at most xp_retry_budget percent of the calls.
+	 */
+	bool takeRetry();
+
+	void getInfo(xic::VDictWriter& dw);
+};
+typedef XPtr<P2cBalancer> P2cBalancerPtr;
+
+#endif
@@ -0,0 +1,207 @@
+#include "PeerBus.h"
+#include "dlog/dlog.h"
+#include "xslib/cxxstr.h"
+#include "xslib/XError.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+
+#define QUEUE_MAX_DEFAULT	(64*1024)
+#define BATCH_MAX_DEFAULT	1024
+#define FLUSH_MSEC_DEFAULT	50
+
+class PeerFlush: public XTimerTask
+{
+	PeerBusPtr _bus;
+public:
+	PeerFlush(PeerBus *bus)
+		: _bus(bus)
+	{
+	}
+
+	virtual void runTimerTask(const XTimerPtr& timer)
+	{
+		_bus->flush();
+	}
+};
+
+PeerBus::PeerBus(const xic::EnginePtr& engine, const SettingPtr& setting, const RCachePtr& rcache, const XTimerPtr& timer)
+	: _rcache(rcache), _timer(timer), _scheduled(false),
+	_queued(0), _coalesced(0), _dropped(0), _sent(0), _received(0), _removed(0)
+{
+	// To recognize our own messages when the peer list includes ourself.
+	_origin = (((int64_t)random() << 31) ^ random() ^ getpid()) | 1;
+
+	_queue_max = setting->getInt("XiProxy.Peer.QueueMax", QUEUE_MAX_DEFAULT);
+	_batch_max = setting->getInt("XiProxy.Peer.BatchMax", BATCH_MAX_DEFAULT);
+	_flush_msec = setting->getInt("XiProxy.Peer.FlushMsec", FLUSH_MSEC_DEFAULT);
+	if (_batch_max < 1)
+		_batch_max = 1;
+	if (_flush_msec < 1)
+		_flush_msec = 1;
+
+	std::string list = setting->getString("XiProxy.Peer.List");
+	xstr_t xs = XSTR_CXX(list);
+	xstr_t item;
+	while (xstr_token_space(&xs, &item))
+	{
+		Peer peer;
+		peer.endpoint = make_string(item);
+		if (peer.endpoint[0] != '@')
+			peer.endpoint.insert(0, "@");
+		peer.prx = engine->stringToProxy("XiProxyPeer " + peer.endpoint);
+		peer.batches = 0;
+		peer.failures = 0;
+		_peers.push_back(peer);
+	}
+}
+
+PeerBus::~PeerBus()
+{
+}
+
+void PeerBus::enqueue(std::set<RKey>& pending, const RKey& rkey)
+{
+	if (_peers.empty())
+		return;
+
+	bool schedule = false;
+	{
+		Lock lock(*this);
+		++_queued;
+		if (_pending.size() + _pending_indexes.size() >= _queue_max)
+		{
+			++_dropped;
+			return;
+		}
+
+		if (!pending.insert(rkey).second)
+		{
+			++_coalesced;
+			return;
+		}
+
+		if (!_scheduled)
+		{
+			_scheduled = true;
+			schedule = true;
+		}
+	}
+
+	if (schedule)
+		_timer->addTask(new PeerFlush(this), _flush_msec);
+}
+
+void PeerBus::flush()
+{
+	std::vector<RKey> keys, indexes;
+	{
+		Lock lock(*this);
+		_scheduled = false;
+		keys.assign(_pending.begin(), _pending.end());
+		indexes.assign(_pending_indexes.begin(), _pending_indexes.end());
+		_pending.clear();
+		_pending_indexes.clear();
+	}
+
+	size_t total = keys.size() + indexes.size();
+	for (size_t start = 0; start < total; start += _batch_max)
+	{
+		size_t end = std::min(start + _batch_max, total);
+		std::string blob, iblob;
+		for (size_t i = start; i < end; ++i)
+		{
+			if (i < keys.size())
+				blob.append((const char *)keys[i].digest(), RKey::DIGEST_SIZE);
+			else
+				iblob.append((const char *)indexes[i - keys.size()].digest(), RKey::DIGEST_SIZE);
+		}
+
+		for (size_t i = 0; i < _peers.size(); ++i)
+		{
+			Peer& peer = _peers[i];
+			bool ok = false;
+			try
+			{
+				xic::QuestWriter qw("invalidate", false);
+				qw.param("origin", _origin);
+				qw.paramBlob("keys", blob.data(), blob.size());
+				if (iblob.size())
+					qw.paramBlob("indexes", iblob.data(), iblob.size());
+				peer.prx->emitQuest(qw.take(), xic::CompletionPtr());
+				ok = true;
+			}
+			catch (std::exception& ex)
+			{
+				dlog("PEER_ERROR", "peer=%s ex=%s", peer.endpoint.c_str(), ex.what());
+			}
+
+			Lock lock(*this);
+			if (ok)
+				++peer.batches;
+			else
+				++peer.failures;
+		}
+	}
+
+	Lock lock(*this);
+	_sent += total;
+}
+
+xic::AnswerPtr PeerBus::process(const xic::QuestPtr& quest, const xic::Current& current)
+{
+	if (!xstr_equal_cstr(&quest->method(), "invalidate"))
+		throw XERROR_MSG(xic::MethodNotFoundException, make_string(quest->method()));
+
+	xic::QuestReader qr(quest);
+	int64_t origin = qr.getInt("origin");
+	xstr_t keys = qr.getBlob("keys");
+	xstr_t indexes = qr.getBlob("indexes");
+
+	// The invalidations from the peers are applied locally only,
+	// never passed on.
+	size_t num = 0, removed = 0;
+	if (origin != _origin)
+	{
+		for (ssize_t pos = 0; pos + RKey::DIGEST_SIZE <= keys.len; pos += RKey::DIGEST_SIZE)
+		{
+			++num;
+			if (_rcache->remove(RKey::fromDigest(keys.data + pos)))
+				++removed;
+		}
+
+		for (ssize_t pos = 0; pos + RKey::DIGEST_SIZE <= indexes.len; pos += RKey::DIGEST_SIZE)
+		{
+			++num;
+			removed += _rcache->removeIndexed(RKey::fromDigest(indexes.data + pos));
+		}
+
+		Lock lock(*this);
+		_received += num;
+		_removed += removed;
+	}
+
+	return xic::AnswerWriter()("removed", (intmax_t)removed);
+}
+
+void PeerBus::getStats(xic::AnswerWriter& aw)
+{
+	Lock lock(*this);
+	aw.param("queued", (intmax_t)_queued);
+	aw.param("coalesced", (intmax_t)_coalesced);
+	aw.param("dropped", (intmax_t)_dropped);
+	aw.param("pending", (intmax_t)_pending.size());
+	aw.param("sent", (intmax_t)_sent);
+	aw.param("received", (intmax_t)_received);
+	aw.param("removed", (intmax_t)_removed);
+
+	xic::VListWriter lw = aw.paramVList("peers");
+	for (size_t i = 0; i < _peers.size(); ++i)
+	{
+		const Peer& peer = _peers[i];
+		xic::VDictWriter dw = lw.vdict();
+		dw.kv("endpoint", peer.endpoint);
+		dw.kv("batches", (intmax_t)peer.batches);
+		dw.kv("failures", (intmax_t)peer.failures);
+	}
+}
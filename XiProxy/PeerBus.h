@@ -0,0 +1,73 @@
+#ifndef PeerBus_h_
+#define PeerBus_h_
+
+#include "RCache.h"
+#include "xic/Engine.h"
+#include "xslib/XLock.h"
+#include "xslib/XTimer.h"
+#include "xslib/Setting.h"
+#include <vector>
+#include <set>
+
+/*
+ * Tells the other XiProxy instances (XiProxy.Peer.List) to drop the
+ * items that have been changed through this one, so that they don't
+ * serve the stale copies till expired.
+ *
+ * The keys are coalesced for XiProxy.Peer.FlushMsec, and then sent in
+ * oneway invalidate messages of at most XiProxy.Peer.BatchMax keys
+ * to the servant XiProxyPeer of each peer. At most XiProxy.Peer.QueueMax
+ * keys wait for sending, the others are dropped and counted.
+ * The keys of the secondary indexes of RCache are passed the same way.
+ */
+class PeerBus: public xic::Servant, private XMutex
+{
+	struct Peer
+	{
+		std::string endpoint;
+		xic::ProxyPtr prx;
+		uint64_t batches;
+		uint64_t failures;
+	};
+
+	RCachePtr _rcache;
+	XTimerPtr _timer;
+	std::vector<Peer> _peers;
+	int64_t _origin;
+	size_t _queue_max;
+	size_t _batch_max;
+	int _flush_msec;
+
+	std::set<RKey> _pending;
+	std::set<RKey> _pending_indexes;
+	bool _scheduled;
+	uint64_t _queued;
+	uint64_t _coalesced;
+	uint64_t _dropped;
+	uint64_t _sent;
+	uint64_t _received;
+	uint64_t _removed;
+
+	void enqueue(std::set<RKey>& pending, const RKey& rkey);
+public:
+	PeerBus(const xic::EnginePtr& engine, const SettingPtr& setting, const RCachePtr& rcache, const XTimerPtr& timer);
+	virtual ~PeerBus();
+
+	virtual xic::AnswerPtr process(const xic::QuestPtr& quest, const xic::Current& current);
+
+	bool enabled() const			{ return !_peers.empty(); }
+
+	/* Queue the key to be invalidated in the peers */
+	void invalidate(const RKey& rkey)	{ enqueue(_pending, rkey); }
+
+	/* Queue the index whose items are to be removed in the peers */
+	void invalidateIndex(const RKey& index)	{ enqueue(_pending_indexes, index); }
+
+	/* Send the queued keys, called by the timer */
+	void flush();
+
+	void getStats(xic::AnswerWriter& aw);
+};
+typedef XPtr<PeerBus> PeerBusPtr;
+
+#endif
@@ -32,6 +32,15 @@ bool ProxyConfig::find(const std::string& id, ProxyDetail& res)
 	return false;
 }
 
+void ProxyConfig::identities(std::vector<std::string>& ids)
+{
+	Lock lock(*this);
+	for (ProxyMap::iterator iter = _proxy_map.begin(); iter != _proxy_map.end(); ++iter)
+	{
+		ids.push_back(iter->first);
+	}
+}
+
 void ProxyConfig::_add_item(ProxyMap& proxy_map, const std::string& key, ProxyDetail& pd)
 {
 	if (key.empty())
@@ -78,7 +87,8 @@ void ProxyConfig::_add_item(ProxyMap& proxy_map, const std::string& key, ProxyDe
 	}
 
 	ProxyMap::iterator iter = _proxy_map.find(key);
-	if (iter != _proxy_map.end() && iter->second.value == pd.value && iter->second.option == pd.option)
+	if (iter != _proxy_map.end() && iter->second.value == pd.value && iter->second.option == pd.option
+		&& iter->second.cache == pd.cache)
 		pd.revision = iter->second.revision;
 	else
 		pd.revision = ++_last_revision;
@@ -147,6 +157,18 @@ bool ProxyConfig::reload()
 				xs.data[0] = ' ';
 				pd.value += make_string(xs);
 			}
+			else if (xs.data[0] == ':')
+			{
+				if (!item_started || pd.type != ExternalProxy)
+				{
+					dlog("WARNING", "Cache rule without external proxy at line %d in file %s", lineno, _listfile.c_str());
+					continue;
+				}
+
+				xstr_advance(&xs, 1);
+				xstr_trim(&xs);
+				pd.cache += make_string(xs) + '\n';
+			}
 			else if (xs.data[0] == '!')
 			{
 				_add_item(proxies, key, pd);
@@ -161,6 +183,7 @@ bool ProxyConfig::reload()
 
 				key = make_string(k);
 				pd.value = make_string(v);
+				pd.cache.clear();
 				pd.type = InternalProxy;
 				item_started = true;
 			}
@@ -180,6 +203,7 @@ bool ProxyConfig::reload()
 				key = make_string(identity);
 				pd.value = v.len ? "@" + make_string(v) : "";
 				pd.option = make_string(k);
+				pd.cache.clear();
 				pd.type = ExternalProxy;
 				item_started = true;
 			}
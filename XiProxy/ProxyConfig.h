@@ -4,6 +4,7 @@
 #include "xslib/XLock.h"
 #include <string>
 #include <map>
+#include <vector>
 
 enum ProxyType
 {
@@ -18,6 +19,7 @@ struct ProxyDetail
 	int revision;
 	std::string option;
 	std::string value;
+	std::string cache;	// cache rules, one per line, see CachePolicy
 public:
 	ProxyDetail() : type(ExternalProxy), revision(0)
 	{
@@ -31,6 +33,9 @@ public:
 	bool reload();
 	bool find(const std::string& identity, ProxyDetail& res);
 
+	/* The identities of all the proxies */
+	void identities(std::vector<std::string>& ids);
+
 private:
 	typedef std::map<std::string, ProxyDetail> ProxyMap;
 
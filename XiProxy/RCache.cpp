@@ -3,19 +3,51 @@
 #include "xslib/xbuf.h"
 #include "xslib/rdtsc.h"
 #include "xslib/vbs.h"
+#include "xslib/cxxstr.h"
+#include "FreqSketch.h"
+#include "lz4codec.h"
+#include "dlog/dlog.h"
+#include <algorithm>
+#include <set>
+#include <limits.h>
+#include <math.h>
+#include <assert.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #define MIN_LENGTH	16	// must be greater than vbs_integer_size(INTMAX_MAX)
 
+#define RCACHE_NUM_ITEM		(1024*64)
+#define RCACHE_MAX_TIME		(3600*24)
+#define RCACHE_NUM_SHARD	16
+
+#define SNAPSHOT_INTERVAL	300
+#define INDEX_MAX		(256*1024)
+
+#define WINDOW_PERCENT		1
+#define PROTECTED_PERCENT	80
+
 
 RData::RData(uint64_t ctime, RDataType type, const xstr_t& xs)
 {
 	uint32_t size = sizeof(rdata_t) + (xs.len > MIN_LENGTH ? xs.len : MIN_LENGTH);
-	_dat = (rdata_t *)malloc(size);
+	uint8_t slab;
+	_dat = (rdata_t *)slab_alloc(size, &slab);
 	if (_dat)
 	{
 		OREF_INIT(_dat);
+		_dat->slab = slab;
 		_dat->revision = 0;
 		_dat->ctime = ctime;
+		_dat->etime = 0;
+		_dat->zipped = 0;
+		_dat->part = 0;
+		_dat->owner = 0;
 		_dat->type = type;
 		_dat->status = 0;
 		_dat->length = xs.len;
@@ -27,12 +59,18 @@ RData::RData(uint64_t ctime, RDataType type, const vbs_data_t& dat)
 {
 	size_t len = vbs_size_of_data(&dat);
 	uint32_t size = sizeof(rdata_t) + (len > MIN_LENGTH ? len : MIN_LENGTH);
-	_dat = (rdata_t *)malloc(size);
+	uint8_t slab;
+	_dat = (rdata_t *)slab_alloc(size, &slab);
 	if (_dat)
 	{
 		OREF_INIT(_dat);
+		_dat->slab = slab;
 		_dat->revision = 0;
 		_dat->ctime = ctime;
+		_dat->etime = 0;
+		_dat->zipped = 0;
+		_dat->part = 0;
+		_dat->owner = 0;
 		_dat->type = type;
 		_dat->status = 0;
 		_dat->length = len;
@@ -40,38 +78,1956 @@ RData::RData(uint64_t ctime, RDataType type, const vbs_data_t& dat)
 		vbs_packer_t pk = VBS_PACKER_INIT(xbuf_xio.write, &xb, -1);
 		if (vbs_pack_data(&pk, &dat) != 0 || xb.len != xb.capacity)
 		{
-			free(_dat);
+			slab_free(_dat, slab);
 			throw XERROR(XError);
 		}
 	}
 }
 
-intmax_t RCache::plus(const RKey& key, intmax_t val, uint64_t now, uint64_t after)
+size_t RData::footprint() const
+{
+	if (!_dat)
+		return 0;
+	return slab_block_size(sizeof(rdata_t) + (_dat->length > MIN_LENGTH ? _dat->length : MIN_LENGTH));
+}
+
+
+enum {
+	WHEEL_BITS0 = 8,
+	WHEEL_BITS = 6,
+	WHEEL_SIZE0 = 1 << WHEEL_BITS0,
+	WHEEL_SIZE = 1 << WHEEL_BITS,
+	WHEEL_LEVELS = 4,
+	WHEEL_SLOTS = WHEEL_SIZE0 + WHEEL_SIZE * (WHEEL_LEVELS - 1),
+	EXPIRE_BATCH = 256,
+	SWEEP_SLICE = 1024,
+	INDEX_STRIPES = 16,
+	PRUNE_SLICE = 1024,
+	PREFETCH_AHEAD = 4,
+	TOPK_SIZE = 32,
+	TOPK_SAMPLE = 16,
+};
+
+/* With the LRU policy all the nodes are in SEG_PROBATION.
+ * With the TinyLFU policy new nodes enter SEG_WINDOW, the nodes pushed
+ * out of the window must win against the victim of SEG_PROBATION to
+ * stay in the cache, and the nodes hit in SEG_PROBATION are promoted
+ * to SEG_PROTECTED.
+ */
+enum {
+	SEG_WINDOW,
+	SEG_PROBATION,
+	SEG_PROTECTED,
+	SEG_NUM,
+};
+
+struct WheelLink
+{
+	WheelLink *wheel_prev;
+	WheelLink *wheel_next;
+};
+
+struct LruLink
+{
+	LruLink *lru_prev;
+	LruLink *lru_next;
+};
+
+struct RCache::Node: public WheelLink, public LruLink
+{
+	Node *hash_next;
+	RKey key;
+	RData data;
+	size_t bytes;
+	uint32_t expire_tick;
+	uint32_t hits;
+	uint8_t segment;
+	uint8_t part;
+};
+
+/* Space-saving sketch of the top-K keys.
+ * A new key takes the place of the one with the least count, whose count
+ * becomes the error of the new key.
+ */
+struct RCache::TopK
 {
-	Lock lock(*this);
-	HashMap::node_type* node = _hashmap.use(key);
-	if (node && node->data.revision() == _revision && node->data.ctime() > after && node->data.type() == RD_LCACHE)
+	struct Counter
 	{
-		intmax_t oldval;
-		vbs_unpacker_t uk = VBS_UNPACKER_INIT(node->data.data(), (ssize_t)node->data.length(), -1);
-		if (vbs_unpack_integer(&uk, &oldval) == 0)
+		RKey key;
+		uint64_t count;
+		uint64_t error;
+	};
+	std::vector<Counter> counters;
+	size_t k;
+
+	TopK(size_t k_) : k(k_)
+	{
+		counters.reserve(k);
+	}
+
+	void add(const RKey& key, uint64_t weight)
+	{
+		size_t min = 0;
+		for (size_t i = 0; i < counters.size(); ++i)
 		{
-			val += oldval;
-			if (val != oldval)
+			if (counters[i].key == key)
 			{
-				node->data._dat->ctime = now;
-				node->data._dat->length = vbs_buffer_of_integer(node->data._dat->data, val);
+				counters[i].count += weight;
+				return;
 			}
-			return val;
+			if (counters[i].count < counters[min].count)
+				min = i;
+		}
+
+		if (counters.size() < k)
+		{
+			Counter c;
+			c.key = key;
+			c.count = weight;
+			c.error = 0;
+			counters.push_back(c);
+		}
+		else
+		{
+			Counter& c = counters[min];
+			c.key = key;
+			c.error = c.count;
+			c.count += weight;
 		}
 	}
+};
 
-	unsigned char buf[MIN_LENGTH];
-	int len = vbs_buffer_of_integer(buf, val);
-	xstr_t xs = XSTR_INIT(buf, len);
-	RData dat(now, RD_LCACHE, xs);
-	dat.setRevision(_revision);
-	_hashmap.replace(key, dat);
-	return val;
+/* The usage by a type of data or by a service within a shard */
+struct RCache::Usage
+{
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t expirations;
+	uint64_t purges;
+	int64_t num;
+	int64_t bytes;
+
+	Usage()
+	{
+		inserts = 0;
+		evictions = 0;
+		expirations = 0;
+		purges = 0;
+		num = 0;
+		bytes = 0;
+	}
+
+	void addTo(RCacheUsage& u) const
+	{
+		u.inserts += inserts;
+		u.evictions += evictions;
+		u.expirations += expirations;
+		u.purges += purges;
+		u.num += num;
+		u.bytes += bytes;
+	}
+};
+
+/* The items of a partition within a shard.
+ * A partition may use more than its quota as long as the shard isn't full.
+ */
+struct RCache::Part
+{
+	LruLink lru[SEG_NUM];		// lru[x].lru_next is the most fresh, lru[x].lru_prev the most stale
+	size_t seg_num[SEG_NUM];
+	size_t window_max;
+	size_t protected_max;
+	size_t num;
+	size_t bytes;
+	size_t num_quota;
+	size_t bytes_quota;
+	uint64_t hits;
+	uint64_t inserts;
+	uint64_t evictions;
+
+	Part()
+	{
+		for (int i = 0; i < SEG_NUM; ++i)
+		{
+			lru[i].lru_prev = &lru[i];
+			lru[i].lru_next = &lru[i];
+			seg_num[i] = 0;
+		}
+		window_max = 0;
+		protected_max = 0;
+		num = 0;
+		bytes = 0;
+		num_quota = 0;
+		bytes_quota = 0;
+		hits = 0;
+		inserts = 0;
+		evictions = 0;
+	}
+
+	void lru_push(Node *node, int seg)
+	{
+		LruLink *head = &lru[seg];
+		node->lru_prev = head;
+		node->lru_next = head->lru_next;
+		head->lru_next->lru_prev = node;
+		head->lru_next = node;
+		node->segment = seg;
+		++seg_num[seg];
+	}
+
+	void lru_del(Node *node)
+	{
+		node->lru_prev->lru_next = node->lru_next;
+		node->lru_next->lru_prev = node->lru_prev;
+		--seg_num[node->segment];
+	}
+
+	Node* lru_head(int seg)
+	{
+		return lru[seg].lru_next != &lru[seg] ? static_cast<Node*>(lru[seg].lru_next) : NULL;
+	}
+
+	Node* lru_tail(int seg)
+	{
+		return lru[seg].lru_prev != &lru[seg] ? static_cast<Node*>(lru[seg].lru_prev) : NULL;
+	}
+
+	Node* victim()
+	{
+		Node *node = lru_tail(SEG_PROBATION);
+		if (!node)
+			node = lru_tail(SEG_PROTECTED);
+		if (!node)
+			node = lru_tail(SEG_WINDOW);
+		return node;
+	}
+
+	/* How much the partition is over its quota, negative if empty */
+	double pressure() const
+	{
+		if (!num)
+			return -1.0;
+		double x = num_quota ? (double)num / num_quota : HUGE_VAL;
+		double y = bytes_quota ? (double)bytes / bytes_quota : HUGE_VAL;
+		return x > y ? x : y;
+	}
+};
+
+struct RCache::Shard: public XMutex
+{
+	Node **tab;
+	unsigned int mask;
+	Part *parts;
+	size_t part_num;
+	FreqSketch *sketch;
+	size_t num;
+	size_t num_max;
+	size_t bytes;
+	size_t bytes_max;
+	uint64_t evictions;
+	uint64_t expirations;
+	uint64_t rejections;
+	uint64_t purges;
+	TopK hot;
+	TopK heavy;
+	uint32_t topk_hits;		// only one in TOPK_SAMPLE hits is added to the TopK
+	Usage type_usages[RD_TYPE_NUM];
+	std::vector<Usage> owner_usages;
+	uint32_t wheel_tick;
+	WheelLink wheel[WHEEL_SLOTS];
+
+	Shard(size_t num_max, size_t bytes_max, RCachePolicy policy, uint32_t tick, const std::vector<int>& shares);
+	~Shard();
+
+	Node* find(const RKey& key);
+	Node* use(const RKey& key);
+	Node* insert(const RKey& key, const RData& val, size_t bytes, uint32_t expire_tick, int part);
+	void remove_node(Node *node);
+	void evict(const Node *keep);
+
+	/* Count the node in the usages of its type and its service */
+	void tally(const Node *node, uint64_t Usage::*field)
+	{
+		++(type_usages[node->data.type()].*field);
+		++(owner_usage(node->data.owner()).*field);
+	}
+
+	Usage& owner_usage(int owner)
+	{
+		if ((size_t)owner >= owner_usages.size())
+			owner_usages.resize(owner + 1);
+		return owner_usages[owner];
+	}
+
+	/* The bucket of the key, and the first node in it */
+	void prefetch(const RKey& key, bool node) const
+	{
+		Node * const *slot = &tab[key.hash() & mask];
+		if (node)
+			__builtin_prefetch(*slot);
+		else
+			__builtin_prefetch(slot);
+	}
+
+	void record(const RKey& key)
+	{
+		if (sketch)
+			sketch->increment(key.hash(), key.hash2());
+	}
+
+	unsigned int frequency(const Node *node) const
+	{
+		return sketch->estimate(node->key.hash(), node->key.hash2());
+	}
+
+	/* The partition most over its quota */
+	Part& pressed()
+	{
+		size_t k = 0;
+		double max = parts[0].pressure();
+		for (size_t i = 1; i < part_num; ++i)
+		{
+			double x = parts[i].pressure();
+			if (x > max)
+			{
+				max = x;
+				k = i;
+			}
+		}
+		return parts[k];
+	}
+
+	Node* victim()
+	{
+		return pressed().victim();
+	}
+
+	void wheel_add(Node *node);
+	void wheel_del(Node *node)
+	{
+		node->wheel_prev->wheel_next = node->wheel_next;
+		node->wheel_next->wheel_prev = node->wheel_prev;
+	}
+	void wheel_cascade(int level, unsigned int idx);
+	size_t expire(uint32_t now_tick, size_t num);
+};
+
+
+RCache::Shard::Shard(size_t num_max_, size_t bytes_max_, RCachePolicy policy, uint32_t tick, const std::vector<int>& shares)
+	: hot(TOPK_SIZE), heavy(TOPK_SIZE), topk_hits(0)
+{
+	size_t slot_num = 16;
+	while (slot_num < num_max_)
+		slot_num <<= 1;
+
+	tab = XS_CALLOC(Node*, slot_num);
+	mask = slot_num - 1;
+
+	part_num = shares.size();
+	parts = new Part[part_num];
+	for (size_t i = 0; i < part_num; ++i)
+	{
+		Part& pt = parts[i];
+		pt.num_quota = num_max_ * shares[i] / 100;
+		pt.bytes_quota = (bytes_max_ == SIZE_MAX) ? SIZE_MAX : bytes_max_ / 100 * shares[i];
+		if (policy == RCACHE_TINYLFU)
+		{
+			pt.window_max = pt.num_quota * WINDOW_PERCENT / 100;
+			if (pt.window_max < 1)
+				pt.window_max = 1;
+			pt.protected_max = (pt.num_quota - std::min(pt.window_max, pt.num_quota)) * PROTECTED_PERCENT / 100;
+		}
+	}
+
+	sketch = (policy == RCACHE_TINYLFU) ? new FreqSketch(num_max_, 15, 0) : NULL;
+	num = 0;
+	num_max = num_max_;
+	bytes = 0;
+	bytes_max = bytes_max_;
+	evictions = 0;
+	expirations = 0;
+	rejections = 0;
+	purges = 0;
+	wheel_tick = tick;
+	for (size_t i = 0; i < WHEEL_SLOTS; ++i)
+	{
+		wheel[i].wheel_prev = &wheel[i];
+		wheel[i].wheel_next = &wheel[i];
+	}
+}
+
+RCache::Shard::~Shard()
+{
+	for (size_t k = 0; k < part_num; ++k)
+	{
+		for (int i = 0; i < SEG_NUM; ++i)
+		{
+			Node *node;
+			while ((node = parts[k].lru_head(i)) != NULL)
+			{
+				parts[k].lru_del(node);
+				delete node;
+			}
+		}
+	}
+	delete[] parts;
+	delete sketch;
+	free(tab);
+}
+
+RCache::Node* RCache::Shard::find(const RKey& key)
+{
+	Node *node;
+	for (node = tab[key.hash() & mask]; node; node = node->hash_next)
+	{
+		if (node->key == key)
+			return node;
+	}
+	return NULL;
+}
+
+RCache::Node* RCache::Shard::use(const RKey& key)
+{
+	Node *node = find(key);
+	if (node)
+	{
+		Part& pt = parts[node->part];
+		int seg = node->segment;
+		if (seg == SEG_PROBATION && sketch)
+			seg = SEG_PROTECTED;
+
+		pt.lru_del(node);
+		pt.lru_push(node, seg);
+
+		while (pt.seg_num[SEG_PROTECTED] > pt.protected_max)
+		{
+			Node *demoted = pt.lru_tail(SEG_PROTECTED);
+			pt.lru_del(demoted);
+			pt.lru_push(demoted, SEG_PROBATION);
+		}
+	}
+	return node;
+}
+
+RCache::Node* RCache::Shard::insert(const RKey& key, const RData& val, size_t size, uint32_t expire_tick, int part)
+{
+	Part& pt = parts[part];
+	Node *node = new Node;
+	Node **slot = &tab[key.hash() & mask];
+	node->hash_next = *slot;
+	*slot = node;
+	node->part = part;
+	pt.lru_push(node, sketch ? SEG_WINDOW : SEG_PROBATION);
+	node->key = key;
+	node->data = val;
+	node->bytes = size;
+	node->expire_tick = expire_tick;
+	node->hits = 0;
+	wheel_add(node);
+	++num;
+	bytes += size;
+	++pt.num;
+	pt.bytes += size;
+	++pt.inserts;
+	tally(node, &Usage::inserts);
+	Usage& tu = type_usages[val.type()];
+	Usage& ou = owner_usage(val.owner());
+	++tu.num;
+	tu.bytes += size;
+	++ou.num;
+	ou.bytes += size;
+	return node;
+}
+
+void RCache::Shard::remove_node(Node *the_node)
+{
+	Node **pnode;
+	for (pnode = &tab[the_node->key.hash() & mask]; *pnode; pnode = &(*pnode)->hash_next)
+	{
+		if (*pnode == the_node)
+		{
+			Part& pt = parts[the_node->part];
+			*pnode = the_node->hash_next;
+			pt.lru_del(the_node);
+			wheel_del(the_node);
+			--num;
+			bytes -= the_node->bytes;
+			--pt.num;
+			pt.bytes -= the_node->bytes;
+			Usage& tu = type_usages[the_node->data.type()];
+			Usage& ou = owner_usage(the_node->data.owner());
+			--tu.num;
+			tu.bytes -= the_node->bytes;
+			--ou.num;
+			ou.bytes -= the_node->bytes;
+			delete the_node;
+			return;
+		}
+	}
+	assert(!"can't reach here");
+}
+
+void RCache::Shard::evict(const Node *keep)
+{
+	// The nodes pushed out of the window become the candidates at the
+	// head of SEG_PROBATION, cand is the oldest of them.
+	Part& kp = parts[keep->part];
+	Node *cand = NULL;
+	while (kp.seg_num[SEG_WINDOW] > kp.window_max)
+	{
+		Node *node = kp.lru_tail(SEG_WINDOW);
+		kp.lru_del(node);
+		kp.lru_push(node, SEG_PROBATION);
+		if (!cand)
+			cand = node;
+	}
+
+	while (num > num_max || bytes > bytes_max)
+	{
+		// Take back the space from the partition most over its quota.
+		Part& pt = pressed();
+		Node *node = pt.victim();
+		if (!node)
+			break;
+
+		if (&pt == &kp && cand && node->segment == SEG_PROBATION)
+		{
+			Node *next = cand->lru_prev != &kp.lru[SEG_PROBATION] ? static_cast<Node*>(cand->lru_prev) : NULL;
+			if (node != cand && frequency(cand) <= frequency(node))
+			{
+				node = cand;
+				++rejections;
+			}
+			cand = next;
+		}
+
+		if (node == keep)
+			break;
+		tally(node, &Usage::evictions);
+		remove_node(node);
+		++evictions;
+		++pt.evictions;
+	}
+}
+
+/* The timing wheel works like the classic kernel timer wheel.
+ * Level 0 has a slot for each of the next WHEEL_SIZE0 ticks, each upper
+ * level covers WHEEL_SIZE times the span of the level below it, and
+ * its slots are cascaded down when the lower level wraps around.
+ */
+void RCache::Shard::wheel_add(Node *node)
+{
+	uint32_t expires = node->expire_tick;
+	int32_t delta = (int32_t)(expires - wheel_tick);
+	WheelLink *head;
+	if (delta < 0)
+	{
+		head = &wheel[wheel_tick & (WHEEL_SIZE0 - 1)];
+	}
+	else if (delta < WHEEL_SIZE0)
+	{
+		head = &wheel[expires & (WHEEL_SIZE0 - 1)];
+	}
+	else
+	{
+		int level = 1;
+		int shift = WHEEL_BITS0;
+		while (level < WHEEL_LEVELS - 1 && delta >= (1 << (shift + WHEEL_BITS)))
+		{
+			++level;
+			shift += WHEEL_BITS;
+		}
+
+		if (delta >= (1 << (shift + WHEEL_BITS)))
+			expires = wheel_tick + (1 << (shift + WHEEL_BITS)) - 1;
+
+		head = &wheel[WHEEL_SIZE0 + (level - 1) * WHEEL_SIZE + ((expires >> shift) & (WHEEL_SIZE - 1))];
+	}
+
+	node->wheel_prev = head->wheel_prev;
+	node->wheel_next = head;
+	head->wheel_prev->wheel_next = node;
+	head->wheel_prev = node;
+}
+
+void RCache::Shard::wheel_cascade(int level, unsigned int idx)
+{
+	WheelLink *head = &wheel[WHEEL_SIZE0 + (level - 1) * WHEEL_SIZE + idx];
+	WheelLink *link = head->wheel_next;
+	head->wheel_prev = head;
+	head->wheel_next = head;
+
+	while (link != head)
+	{
+		Node *node = static_cast<Node*>(link);
+		link = link->wheel_next;
+		wheel_add(node);
+	}
+}
+
+size_t RCache::Shard::expire(uint32_t now_tick, size_t num)
+{
+	size_t n = 0;
+	while (n < num)
+	{
+		WheelLink *head = &wheel[wheel_tick & (WHEEL_SIZE0 - 1)];
+		if (head->wheel_next != head)
+		{
+			Node *node = static_cast<Node*>(head->wheel_next);
+			tally(node, &Usage::expirations);
+			remove_node(node);
+			++expirations;
+			++n;
+			continue;
+		}
+
+		if ((int32_t)(now_tick - wheel_tick) <= 0)
+			break;
+
+		++wheel_tick;
+		unsigned int idx = wheel_tick & (WHEEL_SIZE0 - 1);
+		int shift = WHEEL_BITS0;
+		for (int level = 1; idx == 0 && level < WHEEL_LEVELS; ++level, shift += WHEEL_BITS)
+		{
+			idx = (wheel_tick >> shift) & (WHEEL_SIZE - 1);
+			wheel_cascade(level, idx);
+		}
+	}
+	return n;
+}
+
+/* The keys in the lists aren't removed with the items, they are pruned
+ * by pruneIndex() later.
+ */
+struct RCache::Index: public XMutex
+{
+	typedef std::map<RKey, std::set<RKey> > ListMap;
+	ListMap lists;
+	size_t num;
+	size_t num_max;
+	uint64_t overflows;
+	RKey cursor;		// where pruneIndex() goes on, the list
+	RKey cursor_key;	// and the key in it
+
+	Index(size_t num_max)
+		: num(0), num_max(num_max), overflows(0)
+	{
+	}
+};
+
+
+RCache::RCache(const SettingPtr& setting)
+{
+	int expire_max = setting->getInt("XiProxy.Cache.ExpireMax");
+	if (expire_max <= 0)
+		expire_max = RCACHE_MAX_TIME;
+	else if (expire_max > 3600*24*365)
+		expire_max = 3600*24*365;
+
+	intmax_t num_max = setting->getInt("XiProxy.Cache.NumberMax");
+	if (num_max <= 0 || num_max > INT_MAX)
+		num_max = RCACHE_NUM_ITEM;
+
+	intmax_t shards = setting->getInt("XiProxy.Cache.Shards", RCACHE_NUM_SHARD);
+	if (shards <= 0)
+		shards = 1;
+
+	intmax_t bytes_max = setting->getInt("XiProxy.Cache.MemoryMax");
+	if (bytes_max < 0)
+		bytes_max = 0;
+
+	intmax_t index_max = setting->getInt("XiProxy.Cache.IndexMax", INDEX_MAX);
+	if (index_max < 0)
+		index_max = 0;
+
+	intmax_t zip_threshold = setting->getInt("XiProxy.Cache.ZipThreshold");
+	if (zip_threshold < 0)
+		zip_threshold = 0;
+
+	std::string policy = setting->getString("XiProxy.Cache.Policy", "lru");
+	if (policy == "tinylfu")
+		_policy = RCACHE_TINYLFU;
+	else if (policy == "lru")
+		_policy = RCACHE_LRU;
+	else
+		throw XERROR_MSG(XError, "Unknown XiProxy.Cache.Policy " + policy);
+
+	// XiProxy.Cache.Partitions = name:percent ...
+	// The items of the services not listed go to the default partition,
+	// which gets the rest of the capacity.
+	std::vector<int> shares(1, 100);
+	_part_names.push_back(RCACHE_DEFAULT_PART);
+	std::string partitions = setting->getString("XiProxy.Cache.Partitions");
+	xstr_t xs = XSTR_CXX(partitions);
+	xstr_t item;
+	while (xstr_token_space(&xs, &item))
+	{
+		xstr_t name, share;
+		if (xstr_key_value(&item, ':', &name, &share) < 0 || name.len == 0)
+			throw XERROR_MSG(XError, "Invalid XiProxy.Cache.Partitions item " + make_string(item));
+
+		int percent = xstr_atoi(&share);
+		if (percent <= 0 || percent > shares[0] || shares.size() >= RCACHE_PART_MAX)
+			throw XERROR_MSG(XError, "Invalid XiProxy.Cache.Partitions item " + make_string(item));
+
+		if (!_part_map.insert(std::make_pair(make_string(name), (int)shares.size())).second)
+			throw XERROR_MSG(XError, "Duplicated XiProxy.Cache.Partitions item " + make_string(item));
+
+		shares[0] -= percent;
+		shares.push_back(percent);
+		_part_names.push_back(make_string(name));
+	}
+	_part_shares = shares;
+	_lcache_part = partition(RCACHE_LCACHE_PART);
+
+	xatomic_set(&_revision, 1);
+	xatomic_set(&_clear_all, 0);
+	for (int i = 0; i < RD_TYPE_NUM; ++i)
+		xatomic_set(&_clear_type[i], 0);
+	for (int i = 0; i < RCACHE_OWNER_MAX; ++i)
+		xatomic_set(&_clear_owner[i], 0);
+	_swept_revision = 1;
+	_owner_names.push_back("");
+
+	for (int i = 0; i < STRIPES; ++i)
+	{
+		for (int t = 0; t < RD_TYPE_NUM; ++t)
+		{
+			for (int e = 0; e < RC_EVENT_NUM; ++e)
+				xatomiclong_set(&_type_events[i][t][e], 0);
+		}
+	}
+
+	// The ids not assigned yet share the counters of id 0.
+	_owner_events[0] = new_owner_events();
+	for (int i = 1; i < RCACHE_OWNER_MAX; ++i)
+		_owner_events[i] = _owner_events[0];
+
+	_expire_max = expire_max;
+	_snapshot_file = setting->getPathname("XiProxy.Cache.SnapshotFile");
+	_snapshot_interval = setting->getInt("XiProxy.Cache.SnapshotInterval", SNAPSHOT_INTERVAL);
+	if (_snapshot_interval < 0)
+		_snapshot_interval = 0;
+	_snapshot_closed = false;
+
+	_base_tsc = rdtsc();
+	_tick_tsc = cpu_frequency();
+	_expire_max_tsc = (uint64_t)expire_max * cpu_frequency();
+	_zip_threshold = zip_threshold;
+	_zst.zip_num = 0;
+	_zst.zip_in_bytes = 0;
+	_zst.zip_out_bytes = 0;
+	_zst.zip_tsc = 0;
+	_zst.unzip_num = 0;
+	_zst.unzip_tsc = 0;
+
+	size_t n = 1;
+	while (n < (size_t)shards && n < RCACHE_SHARD_MAX)
+		n <<= 1;
+
+	size_t shard_num_max = num_max / n;
+	if (shard_num_max < 1)
+		shard_num_max = 1;
+
+	size_t shard_bytes_max = bytes_max ? bytes_max / n : SIZE_MAX;
+	if (shard_bytes_max < 1)
+		shard_bytes_max = 1;
+
+	_shards.reserve(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		_shards.push_back(new Shard(shard_num_max, shard_bytes_max, _policy, 0, shares));
+	}
+	_shard_mask = n - 1;
+
+	_index_max = index_max;
+	for (size_t i = 0; i < INDEX_STRIPES; ++i)
+	{
+		_indexes.push_back(new Index((index_max + INDEX_STRIPES - 1) / INDEX_STRIPES));
+	}
+}
+
+RCache::~RCache()
+{
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		delete _shards[i];
+	}
+
+	for (size_t i = 0; i < _owner_names.size(); ++i)
+	{
+		delete _owner_events[i];
+	}
+
+	for (size_t i = 0; i < _indexes.size(); ++i)
+	{
+		delete _indexes[i];
+	}
+}
+
+RCache::OwnerEvents* RCache::new_owner_events()
+{
+	OwnerEvents *oe = new OwnerEvents;
+	for (int i = 0; i < STRIPES; ++i)
+	{
+		for (int e = 0; e < RC_EVENT_NUM; ++e)
+			xatomiclong_set(&oe->n[i][e], 0);
+	}
+	return oe;
 }
 
+static const char *type_name(int type)
+{
+	switch (type)
+	{
+	case RD_ANSWER:	return "answer";
+	case RD_MCACHE:	return "mcache";
+	case RD_LCACHE:	return "lcache";
+	case RD_REDIS:	return "redis";
+	}
+	return "none";
+}
+
+void RCache::usages(std::vector<RCacheUsage>& types, std::vector<RCacheUsage>& owners)
+{
+	std::vector<std::string> names;
+	{
+		XMutex::Lock lock(_owner_mutex);
+		names = _owner_names;
+	}
+
+	types.assign(RD_TYPE_NUM, RCacheUsage());
+	for (int t = 0; t < RD_TYPE_NUM; ++t)
+	{
+		RCacheUsage& u = types[t];
+		u.name = type_name(t);
+		for (int e = 0; e < RC_EVENT_NUM; ++e)
+		{
+			for (int i = 0; i < STRIPES; ++i)
+				u.events[e] += xatomiclong_get(&_type_events[i][t][e]);
+		}
+	}
+
+	owners.assign(names.size(), RCacheUsage());
+	for (size_t k = 0; k < names.size(); ++k)
+	{
+		RCacheUsage& u = owners[k];
+		u.name = names[k];
+		for (int e = 0; e < RC_EVENT_NUM; ++e)
+		{
+			for (int i = 0; i < STRIPES; ++i)
+				u.events[e] += xatomiclong_get(&_owner_events[k]->n[i][e]);
+		}
+	}
+
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		Shard& s = *_shards[i];
+		XMutex::Lock lock(s);
+		for (int t = 0; t < RD_TYPE_NUM; ++t)
+			s.type_usages[t].addTo(types[t]);
+
+		size_t n = std::min(s.owner_usages.size(), owners.size());
+		for (size_t k = 0; k < n; ++k)
+			s.owner_usages[k].addTo(owners[k]);
+	}
+	types.erase(types.begin());
+}
+
+uint32_t RCache::expire_tick(const RData& val) const
+{
+	uint64_t max = val.ctime() + _expire_max_tsc;
+	uint64_t etime = val.etime();
+	if (!etime || etime > max)
+		etime = max;
+
+	if (etime <= _base_tsc)
+		return 0;
+	return (etime - _base_tsc + _tick_tsc - 1) / _tick_tsc;
+}
+
+RData RCache::zip(const RData& val)
+{
+	if (!_zip_threshold || val.length() < _zip_threshold || val.zipped())
+		return val;
+
+	uint64_t start_tsc = rdtsc();
+	ostk_t *ostk = ostk_create(0);
+	RData z;
+	xstr_t out;
+	if (attempt_lz4_zip(ostk, val.xstr(), out) == 0)
+	{
+		z = RData(val.ctime(), val.type(), out);
+		z.setStatus(val.status());
+		z.setExpire(val.etime());
+		z.setPartition(val.partition());
+		z.setOwner(val.owner());
+		z.setZipped(true);
+	}
+	ostk_destroy(ostk);
+	uint64_t used_tsc = rdtsc() - start_tsc;
+
+	XMutex::Lock lock(_zst);
+	_zst.zip_tsc += used_tsc;
+	if (!z)
+		return val;
+
+	++_zst.zip_num;
+	_zst.zip_in_bytes += val.length();
+	_zst.zip_out_bytes += z.length();
+	return z;
+}
+
+RData RCache::unzip(const RData& val)
+{
+	if (!val.zipped())
+		return val;
+
+	uint64_t start_tsc = rdtsc();
+	ostk_t *ostk = ostk_create(0);
+	RData u;
+	xstr_t out;
+	int rc = attempt_lz4_unzip(ostk, val.xstr(), out);
+	if (rc == 0)
+	{
+		u = RData(val.ctime(), val.type(), out);
+		u.setStatus(val.status());
+		u.setExpire(val.etime());
+		u.setPartition(val.partition());
+		u.setOwner(val.owner());
+	}
+	else
+	{
+		dlog("RCACHE_UNZIP", "attempt_lz4_unzip()=%d length=%zd", rc, val.length());
+	}
+	ostk_destroy(ostk);
+	uint64_t used_tsc = rdtsc() - start_tsc;
+
+	XMutex::Lock lock(_zst);
+	++_zst.unzip_num;
+	_zst.unzip_tsc += used_tsc;
+	return u;
+}
+
+RData RCache::lookup(Shard& s, const RKey& key, bool use)
+{
+	s.record(key);
+	Node* node = use ? s.use(key) : s.find(key);
+	if (node && !stale(node->data))
+	{
+		++s.parts[node->part].hits;
+		++node->hits;
+		if (++s.topk_hits % TOPK_SAMPLE == 0)
+		{
+			s.hot.add(key, TOPK_SAMPLE);
+			s.heavy.add(key, node->data.length() * TOPK_SAMPLE);
+		}
+		return node->data;
+	}
+	return RData();
+}
+
+RData RCache::find(const RKey& key)
+{
+	Shard& s = shard(key);
+	XMutex::Lock lock(s);
+	return lookup(s, key, false);
+}
+
+RData RCache::use(const RKey& key)
+{
+	Shard& s = shard(key);
+	XMutex::Lock lock(s);
+	return lookup(s, key, true);
+}
+
+void RCache::by_shard(const std::vector<RKey>& keys, std::vector<std::pair<unsigned int, size_t> >& order)
+{
+	// Counting sort, the keys of a shard keep their order.
+	std::vector<size_t> start(_shards.size() + 1, 0);
+	std::vector<unsigned int> idx(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		idx[i] = shard_index(keys[i]);
+		++start[idx[i] + 1];
+	}
+
+	for (size_t i = 1; i < start.size(); ++i)
+		start[i] += start[i - 1];
+
+	order.resize(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		size_t k = start[idx[i]]++;
+		order[k].first = idx[i];
+		order[k].second = i;
+	}
+}
+
+void RCache::lookup_many(const std::vector<RKey>& keys, std::vector<RData>& datas, bool use)
+{
+	std::vector<std::pair<unsigned int, size_t> > order;
+	by_shard(keys, order);
+	datas.clear();
+	datas.resize(keys.size());
+
+	size_t n = order.size();
+	for (size_t i = 0; i < n; )
+	{
+		unsigned int idx = order[i].first;
+		size_t end = i;
+		while (end < n && order[end].first == idx)
+			++end;
+
+		Shard& s = *_shards[idx];
+		XMutex::Lock lock(s);
+		for (size_t k = i; k < end; ++k)
+		{
+			// The bucket of a key ahead, and the node of a key
+			// nearer, are fetched while looking up this one.
+			if (k + PREFETCH_AHEAD < end)
+				s.prefetch(keys[order[k + PREFETCH_AHEAD].second], false);
+			if (k + PREFETCH_AHEAD / 2 < end)
+				s.prefetch(keys[order[k + PREFETCH_AHEAD / 2].second], true);
+
+			size_t pos = order[k].second;
+			datas[pos] = lookup(s, keys[pos], use);
+		}
+		i = end;
+	}
+}
+
+void RCache::findMany(const std::vector<RKey>& keys, std::vector<RData>& datas)
+{
+	lookup_many(keys, datas, false);
+}
+
+void RCache::useMany(const std::vector<RKey>& keys, std::vector<RData>& datas)
+{
+	lookup_many(keys, datas, true);
+}
+
+RCache::Entry RCache::prepare(const RData& data)
+{
+	Entry ent;
+	ent.val = zip(data);
+	ent.part = (ent.val.type() == RD_LCACHE) ? _lcache_part : ent.val.partition();
+	if (ent.part >= (int)_part_names.size())
+		ent.part = 0;
+	ent.size = sizeof(Node) + ent.val.footprint();
+	ent.etick = expire_tick(ent.val);
+	return ent;
+}
+
+bool RCache::store(Shard& s, const RKey& key, Entry& ent)
+{
+	Node *node = s.find(key);
+	if (node)
+		s.remove_node(node);
+
+	if (!ent.val || ent.size > s.bytes_max)
+		return false;
+
+	ent.val.setRevision(revision());
+	node = s.insert(key, ent.val, ent.size, ent.etick, ent.part);
+	s.evict(node);
+	return true;
+}
+
+bool RCache::replace(const RKey& key, const RData& data)
+{
+	Entry ent = prepare(data);
+	Shard& s = shard(key);
+	XMutex::Lock lock(s);
+	return store(s, key, ent);
+}
+
+size_t RCache::replaceMany(const std::vector<RKey>& keys, const std::vector<RData>& datas)
+{
+	// The compression is done before taking the locks.
+	std::vector<Entry> ents(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i)
+		ents[i] = prepare(datas[i]);
+
+	std::vector<std::pair<unsigned int, size_t> > order;
+	by_shard(keys, order);
+
+	size_t total = 0;
+	size_t n = order.size();
+	for (size_t i = 0; i < n; )
+	{
+		unsigned int idx = order[i].first;
+		size_t end = i;
+		while (end < n && order[end].first == idx)
+			++end;
+
+		Shard& s = *_shards[idx];
+		XMutex::Lock lock(s);
+		for (size_t k = i; k < end; ++k)
+		{
+			if (k + PREFETCH_AHEAD < end)
+				s.prefetch(keys[order[k + PREFETCH_AHEAD].second], false);
+
+			size_t pos = order[k].second;
+			if (store(s, keys[pos], ents[pos]))
+				++total;
+		}
+		i = end;
+	}
+	return total;
+}
+
+bool RCache::remove(const RKey& key)
+{
+	Shard& s = shard(key);
+	XMutex::Lock lock(s);
+	Node *node = s.find(key);
+	if (node)
+	{
+		s.remove_node(node);
+		return true;
+	}
+	return false;
+}
+
+intmax_t RCache::plus(const RKey& key, intmax_t val, uint64_t now, uint64_t after)
+{
+	Shard& s = shard(key);
+	XMutex::Lock lock(s);
+	s.record(key);
+	Node* node = s.use(key);
+	if (node && !stale(node->data) && node->data.ctime() > after && node->data.type() == RD_LCACHE && !node->data.zipped())
+	{
+		intmax_t oldval;
+		vbs_unpacker_t uk = VBS_UNPACKER_INIT(node->data.data(), (ssize_t)node->data.length(), -1);
+		if (vbs_unpack_integer(&uk, &oldval) == 0)
+		{
+			val += oldval;
+			if (val != oldval)
+			{
+				// NB: The integer always fits in MIN_LENGTH, the footprint is unchanged.
+				node->data._dat->ctime = now;
+				node->data._dat->etime = 0;
+				node->data._dat->length = vbs_buffer_of_integer(node->data._dat->data, val);
+				node->expire_tick = expire_tick(node->data);
+				s.wheel_del(node);
+				s.wheel_add(node);
+			}
+			return val;
+		}
+	}
+
+	if (node)
+		s.remove_node(node);
+
+	unsigned char buf[MIN_LENGTH];
+	int len = vbs_buffer_of_integer(buf, val);
+	xstr_t xs = XSTR_INIT(buf, len);
+	RData dat(now, RD_LCACHE, xs);
+	if (dat)
+	{
+		dat.setRevision(revision());
+		node = s.insert(key, dat, sizeof(Node) + dat.footprint(), expire_tick(dat), _lcache_part);
+		s.evict(node);
+	}
+	return val;
+}
+
+size_t RCache::drain(size_t num)
+{
+	size_t n = 0;
+	size_t each = (num + _shards.size() - 1) / _shards.size();
+	for (size_t i = 0; i < _shards.size() && n < num; ++i)
+	{
+		Shard& s = *_shards[i];
+		XMutex::Lock lock(s);
+		size_t k;
+		size_t want = std::min(each, num - n);
+		for (k = 0; k < want; ++k)
+		{
+			Node *node = s.victim();
+			if (!node)
+				break;
+			s.remove_node(node);
+		}
+		n += k;
+	}
+	return n;
+}
+
+size_t RCache::expire(uint64_t now)
+{
+	uint32_t now_tick = tick(now);
+	size_t total = 0;
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		Shard& s = *_shards[i];
+		size_t n;
+		do {
+			// Release the lock between batches.
+			XMutex::Lock lock(s);
+			n = s.expire(now_tick, EXPIRE_BATCH);
+			total += n;
+		} while (n >= EXPIRE_BATCH);
+	}
+	return total;
+}
+
+void RCache::bump_revision(xatomic_t *clear_revision)
+{
+	XMutex::Lock lock(_owner_mutex);
+	int rev = xatomic_get(&_revision);
+	xatomic_set(clear_revision, rev);
+	xatomic_set(&_revision, rev + 1);
+}
+
+void RCache::clear()
+{
+	bump_revision(&_clear_all);
+}
+
+bool RCache::clearOwner(const std::string& service)
+{
+	std::string name = service.substr(0, service.find('#'));
+	int id;
+	{
+		XMutex::Lock lock(_owner_mutex);
+		std::map<std::string, int>::iterator iter = _owner_map.find(name);
+		if (iter == _owner_map.end())
+			return false;
+		id = iter->second;
+	}
+	bump_revision(&_clear_owner[id]);
+	return true;
+}
+
+void RCache::clearType(RDataType type)
+{
+	if (type > RD_NONE && type < RD_TYPE_NUM)
+		bump_revision(&_clear_type[type]);
+}
+
+size_t RCache::sweep()
+{
+	int rev = revision();
+	if (rev == _swept_revision)
+		return 0;
+	_swept_revision = rev;
+
+	size_t total = 0;
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		Shard& s = *_shards[i];
+		size_t k = 0;
+		while (k <= s.mask)
+		{
+			// Release the lock between slices.
+			XMutex::Lock lock(s);
+			size_t end = std::min(k + SWEEP_SLICE, (size_t)s.mask + 1);
+			for (; k < end; ++k)
+			{
+				Node *next;
+				for (Node *node = s.tab[k]; node; node = next)
+				{
+					next = node->hash_next;
+					if (stale(node->data))
+					{
+						s.tally(node, &Usage::purges);
+						s.remove_node(node);
+						++s.purges;
+						++total;
+					}
+				}
+			}
+		}
+	}
+	return total;
+}
+
+static RKey index_key(char kind, const xstr_t& service, const xstr_t& name)
+{
+	// Ignore the #suffix of the service identity.
+	xstr_t id = service;
+	ssize_t pound = xstr_find_char(&id, 0, '#');
+	if (pound >= 0)
+		id.len = pound;
+
+	std::string s(1, kind);
+	s.append((const char *)id.data, id.len);
+	s += '\0';
+	s.append((const char *)name.data, name.len);
+	return RKey(RD_NONE, s.data(), s.length());
+}
+
+RKey RCache::methodIndex(const xstr_t& service, const xstr_t& method)
+{
+	return index_key('m', service, method);
+}
+
+RKey RCache::tagIndex(const xstr_t& service, const xstr_t& tag)
+{
+	return index_key('t', service, tag);
+}
+
+void RCache::index(const RKey& key, const std::vector<RKey>& indexes)
+{
+	if (!_index_max)
+		return;
+
+	for (size_t i = 0; i < indexes.size(); ++i)
+	{
+		Index& x = index_stripe(indexes[i]);
+		XMutex::Lock lock(x);
+		if (x.num >= x.num_max)
+		{
+			++x.overflows;
+			continue;
+		}
+
+		if (x.lists[indexes[i]].insert(key).second)
+			++x.num;
+	}
+}
+
+size_t RCache::removeIndexed(const RKey& index)
+{
+	std::set<RKey> keys;
+	{
+		Index& x = index_stripe(index);
+		XMutex::Lock lock(x);
+		Index::ListMap::iterator iter = x.lists.find(index);
+		if (iter == x.lists.end())
+			return 0;
+		keys.swap(iter->second);
+		x.lists.erase(iter);
+		x.num -= keys.size();
+	}
+
+	// Each item is removed with its own shard locked briefly,
+	// not blocking the others for the whole list.
+	size_t total = 0;
+	for (std::set<RKey>::iterator iter = keys.begin(); iter != keys.end(); ++iter)
+	{
+		if (remove(*iter))
+			++total;
+	}
+	return total;
+}
+
+bool RCache::resident(const RKey& key)
+{
+	Shard& s = shard(key);
+	XMutex::Lock lock(s);
+	Node *node = s.find(key);
+	return node && !stale(node->data);
+}
+
+size_t RCache::pruneIndex()
+{
+	size_t total = 0;
+	for (size_t i = 0; i < _indexes.size(); ++i)
+	{
+		Index& x = *_indexes[i];
+		XMutex::Lock lock(x);
+		Index::ListMap::iterator iter = x.lists.lower_bound(x.cursor);
+		bool within = (iter != x.lists.end() && iter->first == x.cursor);
+		size_t k = 0;
+		while (iter != x.lists.end() && k < PRUNE_SLICE)
+		{
+			std::set<RKey>& keys = iter->second;
+			std::set<RKey>::iterator kit = within ? keys.lower_bound(x.cursor_key) : keys.begin();
+			for (; kit != keys.end() && k < PRUNE_SLICE; ++k)
+			{
+				if (resident(*kit))
+				{
+					++kit;
+				}
+				else
+				{
+					keys.erase(kit++);
+					--x.num;
+					++total;
+				}
+			}
+
+			if (kit != keys.end())
+			{
+				// Go on from the middle of the list next time.
+				x.cursor = iter->first;
+				x.cursor_key = *kit;
+				within = true;
+				break;
+			}
+
+			within = false;
+			if (keys.empty())
+				x.lists.erase(iter++);
+			else
+				++iter;
+		}
+
+		if (!within)
+		{
+			x.cursor = (iter != x.lists.end()) ? iter->first : RKey();
+			x.cursor_key = RKey();
+		}
+	}
+	return total;
+}
+
+void RCache::stats(RCacheStats& st)
+{
+	memset(&st, 0, sizeof(st));
+	st.policy = (_policy == RCACHE_TINYLFU) ? "tinylfu" : "lru";
+	st.shards = _shards.size();
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		Shard& s = *_shards[i];
+		XMutex::Lock lock(s);
+		st.num += s.num;
+		st.num_max += s.num_max;
+		st.bytes += s.bytes;
+		st.bytes_max = (s.bytes_max == SIZE_MAX) ? SIZE_MAX : st.bytes_max + s.bytes_max;
+		st.evictions += s.evictions;
+		st.expirations += s.expirations;
+		st.rejections += s.rejections;
+		st.purges += s.purges;
+	}
+
+	for (size_t i = 0; i < _indexes.size(); ++i)
+	{
+		Index& x = *_indexes[i];
+		XMutex::Lock lock(x);
+		st.index_lists += x.lists.size();
+		st.index_keys += x.num;
+		st.index_overflows += x.overflows;
+	}
+
+	XMutex::Lock lock(_zst);
+	uint64_t freq = cpu_frequency();
+	st.zip_num = _zst.zip_num;
+	st.zip_in_bytes = _zst.zip_in_bytes;
+	st.zip_out_bytes = _zst.zip_out_bytes;
+	st.zip_usec = (uint64_t)(_zst.zip_tsc * 1e6 / freq);
+	st.unzip_num = _zst.unzip_num;
+	st.unzip_usec = (uint64_t)(_zst.unzip_tsc * 1e6 / freq);
+}
+
+int RCache::partition(const std::string& service) const
+{
+	// Ignore the #suffix of the service identity.
+	std::string name = service.substr(0, service.find('#'));
+	std::map<std::string, int>::const_iterator iter = _part_map.find(name);
+	return iter != _part_map.end() ? iter->second : 0;
+}
+
+void RCache::partStats(std::vector<RCachePartStats>& pst)
+{
+	pst.resize(_part_names.size());
+	for (size_t k = 0; k < pst.size(); ++k)
+	{
+		RCachePartStats& ps = pst[k];
+		ps.name = _part_names[k];
+		ps.share = _part_shares[k];
+		ps.num = 0;
+		ps.bytes = 0;
+		ps.hits = 0;
+		ps.inserts = 0;
+		ps.evictions = 0;
+	}
+
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		Shard& s = *_shards[i];
+		XMutex::Lock lock(s);
+		for (size_t k = 0; k < pst.size(); ++k)
+		{
+			const Part& pt = s.parts[k];
+			RCachePartStats& ps = pst[k];
+			ps.num += pt.num;
+			ps.bytes += pt.bytes;
+			ps.hits += pt.hits;
+			ps.inserts += pt.inserts;
+			ps.evictions += pt.evictions;
+		}
+	}
+}
+
+
+/* The snapshot file is native endian, it's meant to be read back by
+ * XiProxy on the same host. Bump SNAPSHOT_VERSION whenever the layout
+ * or the RKey derivation changes.
+ *
+ *	snapshot_header
+ *	partition names, each is a uint16_t length and the name, padded to 8 bytes
+ *	owner (service) names, in the same format as the partition names
+ *	items, each is a snapshot_item and the data, padded to 8 bytes
+ */
+#define SNAPSHOT_MAGIC		0x43525058	// "XPRC"
+#define SNAPSHOT_VERSION	2
+
+#define ALIGN8(n)		(((n) + 7) & ~(size_t)7)
+
+/* The items of MCache and Redis are copies of the remote stores. The
+ * deletions done since the last save are not in the snapshot, so they
+ * would be served again after a crash. Only the answers, which live no
+ * longer than their TTL, and the LCache items, which are this cache's
+ * own, are saved and restored.
+ */
+static inline bool snapshot_type(int type)
+{
+	return type == RD_ANSWER || type == RD_LCACHE;
+}
+
+struct snapshot_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t item_size;
+	uint32_t key_size;
+	uint32_t part_num;
+	uint32_t owner_num;
+	uint32_t reserved;
+	uint64_t item_num;
+	uint64_t body_size;		// bytes after the header
+	uint64_t save_usec;		// wall clock time of saving
+	unsigned char digest[16];	// hash128 of the body
+};
+
+struct snapshot_item
+{
+	unsigned char key[16];
+	uint64_t age_usec;		// age at the time of saving
+	uint64_t ttl_usec;		// time to live at the time of saving, 0 for the cache default
+	int32_t status;
+	uint32_t length;
+	uint8_t type;
+	uint8_t zipped;
+	uint8_t part;
+	uint8_t reserved1;
+	uint16_t owner;
+	uint32_t reserved2;
+};
+
+static uint64_t realtime_usec()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * (uint64_t)1000000 + tv.tv_usec;
+}
+
+static bool write_padded(FILE *fp, hash128_context *ctx, const void *data, size_t len)
+{
+	static const char zeros[8] = {0};
+	size_t pad = ALIGN8(len) - len;
+	if (fwrite(data, 1, len, fp) != len || fwrite(zeros, 1, pad, fp) != pad)
+		return false;
+	hash128_update(ctx, data, len);
+	hash128_update(ctx, zeros, pad);
+	return true;
+}
+
+static bool write_names(FILE *fp, hash128_context *ctx, const std::vector<std::string>& names, uint64_t *body_size)
+{
+	for (size_t k = 0; k < names.size(); ++k)
+	{
+		char buf[sizeof(uint16_t) + 256];
+		uint16_t n = std::min(names[k].length(), (size_t)255);
+		memcpy(buf, &n, sizeof(n));
+		memcpy(buf + sizeof(n), names[k].data(), n);
+		size_t len = sizeof(n) + n;
+		if (!write_padded(fp, ctx, buf, len))
+			return false;
+		*body_size += ALIGN8(len);
+	}
+	return true;
+}
+
+static const unsigned char *read_names(const unsigned char *p, const unsigned char *end,
+				size_t num, std::vector<std::string>& names)
+{
+	for (size_t k = 0; k < num && p + sizeof(uint16_t) <= end; ++k)
+	{
+		uint16_t n;
+		memcpy(&n, p, sizeof(n));
+		names.push_back(std::string((const char *)p + sizeof(n), std::min((size_t)n, (size_t)(end - p - sizeof(n)))));
+		p += ALIGN8(sizeof(n) + n);
+	}
+	return p;
+}
+
+ssize_t RCache::save(bool last)
+{
+	if (_snapshot_file.empty())
+		return 0;
+
+	// The periodic save and the one at exit write the same file.
+	XMutex::Lock snapshot_lock(_snapshot_mutex);
+	if (_snapshot_closed)
+		return 0;
+	_snapshot_closed = last;
+
+	uint64_t start_tsc = rdtsc();
+	std::string tmpfile = _snapshot_file + ".tmp";
+	FILE *fp = fopen(tmpfile.c_str(), "wb");
+	if (!fp)
+	{
+		dlog("RCACHE_SNAPSHOT", "fopen() failed, file=%s errno=%d", tmpfile.c_str(), errno);
+		return -1;
+	}
+
+	snapshot_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.header_size = sizeof(snapshot_header);
+	hdr.item_size = sizeof(snapshot_item);
+	hdr.key_size = sizeof(RKey);
+	hdr.part_num = _part_names.size();
+
+	std::vector<std::string> owners;
+	{
+		XMutex::Lock lock(_owner_mutex);
+		owners = _owner_names;
+	}
+	hdr.owner_num = owners.size();
+
+	hash128_context ctx;
+	hash128_start(&ctx, 0);
+	bool ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1)
+		&& write_names(fp, &ctx, _part_names, &hdr.body_size)
+		&& write_names(fp, &ctx, owners, &hdr.body_size);
+
+	uint64_t freq = cpu_frequency();
+	std::vector<std::pair<RKey, RData> > items;
+	for (size_t i = 0; ok && i < _shards.size(); ++i)
+	{
+		// Copy the references out of the lock, from the most stale to the
+		// most fresh, so the recency order is kept when restored.
+		items.clear();
+		Shard& s = *_shards[i];
+		{
+			XMutex::Lock lock(s);
+			items.reserve(s.num);
+			for (size_t k = 0; k < s.part_num; ++k)
+			{
+				static const int segs[] = { SEG_PROBATION, SEG_PROTECTED, SEG_WINDOW };
+				for (int j = 0; j < SEG_NUM; ++j)
+				{
+					LruLink *head = &s.parts[k].lru[segs[j]];
+					for (LruLink *link = head->lru_prev; link != head; link = link->lru_prev)
+					{
+						Node *node = static_cast<Node*>(link);
+						if (snapshot_type(node->data.type()) && !stale(node->data))
+							items.push_back(std::make_pair(node->key, node->data));
+					}
+				}
+			}
+		}
+
+		uint64_t now = rdtsc();
+		for (size_t k = 0; ok && k < items.size(); ++k)
+		{
+			const RData& d = items[k].second;
+			snapshot_item it;
+			memset(&it, 0, sizeof(it));
+			memcpy(it.key, items[k].first._d.digest, sizeof(it.key));
+			it.age_usec = (uint64_t)((now - d.ctime()) * 1e6 / freq);
+			it.ttl_usec = d.etime() ? (uint64_t)((d.etime() > now ? d.etime() - now : 1) * 1e6 / freq) : 0;
+			it.status = d.status();
+			it.length = d.length();
+			it.type = d.type();
+			it.zipped = d.zipped();
+			it.part = d.partition();
+			it.owner = d.owner() < (int)owners.size() ? d.owner() : 0;
+
+			ok = write_padded(fp, &ctx, &it, sizeof(it))
+				&& write_padded(fp, &ctx, d.data(), d.length());
+			hdr.body_size += sizeof(it) + ALIGN8(d.length());
+			++hdr.item_num;
+		}
+	}
+	items.clear();
+
+	hdr.save_usec = realtime_usec();
+	hash128_finish(&ctx, hdr.digest);
+	if (ok)
+		ok = (fseek(fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+	if (fclose(fp) != 0)
+		ok = false;
+
+	if (!ok || rename(tmpfile.c_str(), _snapshot_file.c_str()) != 0)
+	{
+		dlog("RCACHE_SNAPSHOT", "failed to write file=%s errno=%d", tmpfile.c_str(), errno);
+		unlink(tmpfile.c_str());
+		return -1;
+	}
+
+	int64_t used_ms = (rdtsc() - start_tsc) * 1000 / freq;
+	dlog("RCACHE_SAVE", "file=%s num=%jd bytes=%jd T=%jd",
+		_snapshot_file.c_str(), (intmax_t)hdr.item_num, (intmax_t)(sizeof(hdr) + hdr.body_size), (intmax_t)used_ms);
+	return hdr.item_num;
+}
+
+ssize_t RCache::restore()
+{
+	if (_snapshot_file.empty())
+		return 0;
+
+	uint64_t start_tsc = rdtsc();
+	int fd = open(_snapshot_file.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return 0;
+		dlog("RCACHE_SNAPSHOT", "open() failed, file=%s errno=%d", _snapshot_file.c_str(), errno);
+		return -1;
+	}
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(snapshot_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		dlog("RCACHE_SNAPSHOT", "can't map file=%s", _snapshot_file.c_str());
+		return -1;
+	}
+
+	const unsigned char *base = (const unsigned char *)map;
+	const unsigned char *end = base + st.st_size;
+	snapshot_header hdr;
+	memcpy(&hdr, base, sizeof(hdr));
+	const char *error = NULL;
+	if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION
+		|| hdr.header_size != sizeof(snapshot_header) || hdr.item_size != sizeof(snapshot_item)
+		|| hdr.key_size != sizeof(RKey))
+	{
+		error = "incompatible";
+	}
+	else if (hdr.body_size != (uint64_t)(st.st_size - sizeof(hdr)))
+	{
+		error = "truncated";
+	}
+	else
+	{
+		unsigned char digest[16];
+		hash128_context ctx;
+		hash128_start(&ctx, 0);
+		hash128_update(&ctx, base + sizeof(hdr), hdr.body_size);
+		hash128_finish(&ctx, digest);
+		if (memcmp(digest, hdr.digest, sizeof(digest)) != 0)
+			error = "corrupted";
+	}
+
+	if (error)
+	{
+		munmap(map, st.st_size);
+		dlog("RCACHE_SNAPSHOT", "%s file=%s", error, _snapshot_file.c_str());
+		return -1;
+	}
+
+	// The partitions may have been changed, map them by name.
+	// So are the owners, whose ids are assigned in the order of use.
+	std::vector<std::string> names;
+	const unsigned char *p = read_names(base + sizeof(hdr), end, hdr.part_num, names);
+	std::vector<int> parts;
+	for (size_t k = 0; k < names.size(); ++k)
+		parts.push_back(names[k] == RCACHE_DEFAULT_PART ? 0 : partition(names[k]));
+
+	names.clear();
+	p = read_names(p, end, hdr.owner_num, names);
+	std::vector<int> owners;
+	for (size_t k = 0; k < names.size(); ++k)
+		owners.push_back(names[k].empty() ? 0 : owner(names[k]));
+
+	uint64_t freq = cpu_frequency();
+	uint64_t now = rdtsc();
+	uint64_t elapsed_usec = realtime_usec() - hdr.save_usec;
+	uint64_t expire_max_usec = (uint64_t)_expire_max * 1000000;
+	size_t num = 0;
+	for (uint64_t i = 0; i < hdr.item_num && p + sizeof(snapshot_item) <= end; ++i)
+	{
+		snapshot_item it;
+		memcpy(&it, p, sizeof(it));
+		p += sizeof(it);
+		if (it.length > (size_t)(end - p))
+			break;
+
+		xstr_t xs = XSTR_INIT((unsigned char *)p, (ssize_t)it.length);
+		p += ALIGN8(it.length);
+
+		if (!snapshot_type(it.type))
+			continue;
+
+		uint64_t age_usec = it.age_usec + elapsed_usec;
+		if (age_usec >= expire_max_usec || (it.ttl_usec && it.ttl_usec <= elapsed_usec))
+			continue;
+
+		uint64_t age_tsc = (uint64_t)(age_usec * 1e-6 * freq);
+		if (age_tsc >= now)
+			continue;
+
+		RData d(now - age_tsc, (RDataType)it.type, xs);
+		if (!d)
+			break;
+
+		d.setStatus(it.status);
+		if (it.ttl_usec)
+			d.setExpire(now + (uint64_t)((it.ttl_usec - elapsed_usec) * 1e-6 * freq));
+		d.setZipped(it.zipped);
+		d.setPartition(it.part < parts.size() ? parts[it.part] : 0);
+		d.setOwner(it.owner < owners.size() ? owners[it.owner] : 0);
+
+		RKey key;
+		memcpy(key._d.digest, it.key, sizeof(key._d.digest));
+		if (replace(key, d))
+			++num;
+	}
+	munmap(map, st.st_size);
+
+	int64_t used_ms = (rdtsc() - start_tsc) * 1000 / freq;
+	dlog("RCACHE_RESTORE", "file=%s num=%zd/%jd T=%jd",
+		_snapshot_file.c_str(), num, (intmax_t)hdr.item_num, (intmax_t)used_ms);
+	return num;
+}
+
+int RCache::owner(const std::string& service)
+{
+	std::string name = service.substr(0, service.find('#'));
+	XMutex::Lock lock(_owner_mutex);
+	std::map<std::string, int>::iterator iter = _owner_map.find(name);
+	if (iter != _owner_map.end())
+		return iter->second;
+
+	if (_owner_names.size() >= RCACHE_OWNER_MAX)
+		return 0;
+
+	int id = _owner_names.size();
+	_owner_events[id] = new_owner_events();
+	_owner_map[name] = id;
+	_owner_names.push_back(name);
+	return id;
+}
+
+void RCache::describe(const Node *node, uint64_t now, const std::vector<std::string>& owners, RCacheEntry& ent)
+{
+	const RData& d = node->data;
+	ent.type = type_name(d.type());
+	ent.service = d.owner() < (int)owners.size() ? owners[d.owner()] : "";
+	ent.resident = true;
+	ent.age = now > d.ctime() ? (now - d.ctime()) / cpu_frequency() : 0;
+	ent.length = d.length();
+	ent.bytes = node->bytes;
+	ent.hits = node->hits;
+}
+
+static std::string hex_key(const unsigned char *digest, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	std::string s(len * 2, '0');
+	for (size_t i = 0; i < len; ++i)
+	{
+		s[i*2] = hex[digest[i] >> 4];
+		s[i*2+1] = hex[digest[i] & 0x0f];
+	}
+	return s;
+}
+
+void RCache::sample(size_t num, std::vector<RCacheEntry>& entries)
+{
+	std::vector<std::string> owners;
+	{
+		XMutex::Lock lock(_owner_mutex);
+		owners = _owner_names;
+	}
+
+	entries.clear();
+	size_t each = (num + _shards.size() - 1) / _shards.size();
+	uint64_t now = rdtsc();
+	for (size_t i = 0; i < _shards.size() && entries.size() < num; ++i)
+	{
+		Shard& s = *_shards[i];
+		XMutex::Lock lock(s);
+		size_t want = std::min(each, num - entries.size());
+		size_t start = random();
+		for (size_t k = 0, n = 0; k <= s.mask && n < want; ++k)
+		{
+			for (Node *node = s.tab[(start + k) & s.mask]; node && n < want; node = node->hash_next)
+			{
+				RCacheEntry ent;
+				ent.key = hex_key(node->key._d.digest, sizeof(node->key._d.digest));
+				describe(node, now, owners, ent);
+				entries.push_back(ent);
+				++n;
+			}
+		}
+	}
+}
+
+static bool count_greater(const std::pair<RKey, RCacheEntry>& a, const std::pair<RKey, RCacheEntry>& b)
+{
+	return a.second.count > b.second.count;
+}
+
+void RCache::top_entries(std::vector<std::pair<RKey, RCacheEntry> >& tops, size_t num, const std::vector<std::string>& owners)
+{
+	std::sort(tops.begin(), tops.end(), count_greater);
+	if (tops.size() > num)
+		tops.resize(num);
+
+	uint64_t now = rdtsc();
+	for (size_t i = 0; i < tops.size(); ++i)
+	{
+		const RKey& key = tops[i].first;
+		RCacheEntry& ent = tops[i].second;
+		ent.key = hex_key(key._d.digest, sizeof(key._d.digest));
+		Shard& s = shard(key);
+		XMutex::Lock lock(s);
+		Node *node = s.find(key);
+		if (node && !stale(node->data))
+			describe(node, now, owners, ent);
+	}
+}
+
+void RCache::topKeys(size_t num, std::vector<RCacheEntry>& hot, std::vector<RCacheEntry>& heavy)
+{
+	std::vector<std::string> owners;
+	{
+		XMutex::Lock lock(_owner_mutex);
+		owners = _owner_names;
+	}
+
+	// A key is always in the same shard, so the sketches of the shards
+	// are merged by simply putting them together.
+	std::vector<std::pair<RKey, RCacheEntry> > hots, heavies;
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		Shard& s = *_shards[i];
+		XMutex::Lock lock(s);
+		for (int j = 0; j < 2; ++j)
+		{
+			const TopK& topk = j ? s.heavy : s.hot;
+			std::vector<std::pair<RKey, RCacheEntry> >& tops = j ? heavies : hots;
+			for (size_t k = 0; k < topk.counters.size(); ++k)
+			{
+				const TopK::Counter& c = topk.counters[k];
+				tops.push_back(std::make_pair(c.key, RCacheEntry()));
+				tops.back().second.count = c.count;
+				tops.back().second.error = c.error;
+			}
+		}
+	}
+
+	top_entries(hots, num, owners);
+	top_entries(heavies, num, owners);
+
+	hot.clear();
+	for (size_t i = 0; i < hots.size(); ++i)
+		hot.push_back(hots[i].second);
+	heavy.clear();
+	for (size_t i = 0; i < heavies.size(); ++i)
+		heavy.push_back(heavies[i].second);
+}
@@ -2,16 +2,28 @@
 #define RCache_h_
 
 #include "xslib/xsdef.h"
-#include "xslib/LruHashMap.h"
 #include "xslib/vbs.h"
 #include "xslib/xstr.h"
 #include "xslib/oref.h"
-#include "xslib/sha1.h"
 #include "xslib/XLock.h"
 #include "xslib/XRefCount.h"
+#include "xslib/xatomic.h"
+#include "xslib/Setting.h"
+#include "hash128.h"
+#include "SlabAlloc.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include <string>
+
+#define RCACHE_SHARD_MAX	256
+#define RCACHE_PART_MAX		64
+#define RCACHE_OWNER_MAX	4096
+#define RCACHE_DEFAULT_PART	"*"
+#define RCACHE_LCACHE_PART	"LCache"	// partition of the RD_LCACHE items
 
 
 enum RDataType
@@ -20,49 +32,78 @@ enum RDataType
 	RD_ANSWER,
 	RD_MCACHE,
 	RD_LCACHE,
+	RD_REDIS,
+	RD_TYPE_NUM,
 };
 
 
+/* The key is a 128-bit hash of the type and the data identifying the item.
+ * The type is hashed first, so different kinds of items never share a key.
+ */
 class RKey
 {
+	friend class RCache;
 	union {
-		unsigned char sha1[20];
-		uint32_t u32[5];
+		unsigned char digest[16];
+		uint32_t u32[4];
 	} _d;
 
+	/* The integers are hashed in little endian, the same on any host */
+	static void update_u32(hash128_context *ctx, uint32_t v)
+	{
+		unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+		hash128_update(ctx, b, sizeof(b));
+	}
+
+	static void start(hash128_context *ctx, RDataType type)
+	{
+		hash128_start(ctx, 0);
+		update_u32(ctx, type);
+	}
+
+	static void update_field(hash128_context *ctx, const xstr_t& xs)
+	{
+		update_u32(ctx, xs.len);
+		hash128_update(ctx, xs.data, xs.len);
+	}
+
 public:
 	RKey()
 	{
-		memset(this->_d.sha1, 0, sizeof(this->_d.sha1));
+		memset(this->_d.digest, 0, sizeof(this->_d.digest));
 	}
 
 	RKey(RDataType type, const char *data, size_t len)
 	{
-		sha1_context ctx;
-		sha1_start(&ctx);
-		sha1_update(&ctx, &type, sizeof(type));
-		sha1_update(&ctx, data, len);
-		sha1_finish(&ctx, _d.sha1);
+		hash128_context ctx;
+		start(&ctx, type);
+		hash128_update(&ctx, data, len);
+		hash128_finish(&ctx, _d.digest);
 	}
 
 	RKey(const xstr_t& lcache_key)
 	{
-		RDataType type = RD_LCACHE;
-		sha1_context ctx;
-		sha1_start(&ctx);
-		sha1_update(&ctx, &type, sizeof(type));
-		sha1_update(&ctx, lcache_key.data, lcache_key.len);
-		sha1_finish(&ctx, _d.sha1);
+		hash128_context ctx;
+		start(&ctx, RD_LCACHE);
+		hash128_update(&ctx, lcache_key.data, lcache_key.len);
+		hash128_finish(&ctx, _d.digest);
 	}
 
 	RKey(const xstr_t& mcache, const xstr_t& key)
 	{
-		RDataType type = RD_MCACHE;
-		sha1_context ctx;
-		sha1_start(&ctx);
-		sha1_update(&ctx, &type, sizeof(type));
-		sha1_update(&ctx, key.data, key.len);
-		sha1_finish(&ctx, _d.sha1);
+		hash128_context ctx;
+		start(&ctx, RD_MCACHE);
+		hash128_update(&ctx, key.data, key.len);
+		hash128_finish(&ctx, _d.digest);
+	}
+
+	RKey(RDataType type, const xstr_t& service, const xstr_t& key)
+	{
+		hash128_context ctx;
+		start(&ctx, type);
+		update_field(&ctx, service);
+		update_field(&ctx, key);
+		hash128_finish(&ctx, _d.digest);
 	}
 
 	RKey(const xstr_t& service, const xstr_t& method, const xstr_t& params)
@@ -72,14 +113,26 @@ public:
 
 	void set(const xstr_t& service, const xstr_t& method, const xstr_t& params)
 	{
-		RDataType type = RD_ANSWER;
-		sha1_context ctx;
-		sha1_start(&ctx);
-		sha1_update(&ctx, &type, sizeof(type));
-		sha1_update(&ctx, service.data, service.len);
-		sha1_update(&ctx, method.data, method.len);
-		sha1_update(&ctx, params.data, params.len);
-		sha1_finish(&ctx, _d.sha1);
+		hash128_context ctx;
+		start(&ctx, RD_ANSWER);
+		update_field(&ctx, service);
+		update_field(&ctx, method);
+		hash128_update(&ctx, params.data, params.len);
+		hash128_finish(&ctx, _d.digest);
+	}
+
+	/* The raw digest, of DIGEST_SIZE bytes, to pass the key between proxies */
+	enum { DIGEST_SIZE = 16 };
+	const unsigned char *digest() const
+	{
+		return _d.digest;
+	}
+
+	static RKey fromDigest(const void *digest)
+	{
+		RKey k;
+		memcpy(k._d.digest, digest, sizeof(k._d.digest));
+		return k;
 	}
 
 	unsigned int hash() const
@@ -87,14 +140,20 @@ public:
 		return _d.u32[2];
 	}
 
+	/* Independent of hash(), for double hashing */
+	unsigned int hash2() const
+	{
+		return _d.u32[0];
+	}
+
 	bool operator==(const RKey& r) const
 	{
-		return (memcmp(_d.sha1, r._d.sha1, sizeof(_d.sha1)) == 0);
+		return (memcmp(_d.digest, r._d.digest, sizeof(_d.digest)) == 0);
 	}
 
 	bool operator<(const RKey& r) const
 	{
-		return (memcmp(_d.sha1, r._d.sha1, sizeof(_d.sha1)) < 0);
+		return (memcmp(_d.digest, r._d.digest, sizeof(_d.digest)) < 0);
 	}
 };
 
@@ -106,15 +165,22 @@ class RData
 		OREF_DECLARE();
 		int revision;
 		uint64_t ctime;
+		uint64_t etime;		// expiry deadline, 0 for the cache default
 		RDataType type;
 		int32_t status;
 		uint32_t length;
+		uint8_t slab;		// size class of the SlabAlloc block
+		uint8_t zipped;		// data is in lz4codec format
+		uint8_t part;		// cache partition, see RCache::partition()
+		uint16_t owner;		// service of the data, see RCache::owner()
 		unsigned char data[];
 	};
 	mutable rdata_t *_dat;
 
 	static void *operator new(size_t size);
 
+	static void free_rdata(rdata_t *d)	{ slab_free(d, d->slab); }
+
 public:
 	static void *ref_rdata(const RData& r)
 	{
@@ -130,7 +196,7 @@ public:
 		if (data)
 		{
 			rdata_t *d = (rdata_t*)data;
-			OREF_DEC(d, ::free);
+			OREF_DEC(d, free_rdata);
 		}
 	}
 
@@ -148,26 +214,37 @@ public:
 		if (_dat != r._dat)
 		{
 			if (r._dat) OREF_INC(r._dat);
-			if (_dat) OREF_DEC(_dat, free);
+			if (_dat) OREF_DEC(_dat, free_rdata);
 			_dat = r._dat;
 		}
 		return *this;
 	}
 
-	~RData() 				{ if (_dat) OREF_DEC(_dat, free); }
+	~RData() 				{ if (_dat) OREF_DEC(_dat, free_rdata); }
 
 	typedef rdata_t* RData::*my_pointer_bool;
         operator my_pointer_bool() const        { return _dat ? &RData::_dat : 0; }
 
 	void setRevision(int revision) const	{ if (_dat) _dat->revision = revision; }
 	void setStatus(uint32_t status) 	{ if (_dat) _dat->status = status; }
+	void setExpire(uint64_t etime) const	{ if (_dat) _dat->etime = etime; }
+	void setZipped(bool zipped) const	{ if (_dat) _dat->zipped = zipped; }
+	void setPartition(int part) const	{ if (_dat) _dat->part = part; }
+	void setOwner(int owner) const		{ if (_dat) _dat->owner = owner; }
 
 	int revision() const 			{ return _dat ? _dat->revision : 0; }
 	uint64_t ctime() const 			{ return _dat ? _dat->ctime : 0; }
+	uint64_t etime() const 			{ return _dat ? _dat->etime : 0; }
 	RDataType type() const			{ return _dat ? _dat->type : RD_NONE; }
 	int status() const			{ return _dat ? _dat->status : 0; }
 	unsigned char *data() const 		{ return _dat ? _dat->data : NULL; }
 	size_t length() const 			{ return _dat ? _dat->length : 0; }
+	bool zipped() const			{ return _dat ? _dat->zipped : false; }
+	int partition() const			{ return _dat ? _dat->part : 0; }
+	int owner() const			{ return _dat ? _dat->owner : 0; }
+
+	/* Number of bytes allocated for the data */
+	size_t footprint() const;
 
 	xstr_t xstr() const
 	{
@@ -178,74 +255,342 @@ public:
 	}
 };
 
-class RCache: public XRefCount, private XMutex
+enum RCachePolicy
 {
-public:
-	RCache(size_t maxsize): _hashmap(maxsize), _revision(1) {}
+	RCACHE_LRU,
+	RCACHE_TINYLFU,
+};
+
+struct RCacheStats
+{
+	const char *policy;
+	size_t shards;
+	size_t num;
+	size_t num_max;
+	size_t bytes;
+	size_t bytes_max;
+	uint64_t evictions;
+	uint64_t expirations;
+	uint64_t rejections;
+	uint64_t purges;
+	size_t index_lists;
+	size_t index_keys;
+	uint64_t index_overflows;
+	uint64_t zip_num;
+	uint64_t zip_in_bytes;
+	uint64_t zip_out_bytes;
+	uint64_t zip_usec;
+	uint64_t unzip_num;
+	uint64_t unzip_usec;
+};
+
+struct RCachePartStats
+{
+	std::string name;
+	int share;		// percent of the capacity
+	size_t num;
+	size_t bytes;
+	uint64_t hits;
+	uint64_t inserts;
+	uint64_t evictions;
+};
 
-	RData find(const RKey& key)
+/* The lookup results counted by the users of the cache,
+ * who know whether the data found is fresh enough.
+ */
+enum RCacheEvent
+{
+	RC_HIT,
+	RC_MISS,
+	RC_STALE,		// served stale while being refreshed
+	RC_EVENT_NUM,
+};
+
+/* The usage of the cache by a type of data or by a service */
+struct RCacheUsage
+{
+	std::string name;
+	uint64_t events[RC_EVENT_NUM];
+	uint64_t inserts;
+	uint64_t evictions;	// removed by the replacement policy
+	uint64_t expirations;	// removed by the reaper
+	uint64_t purges;	// removed after cleared
+	int64_t num;
+	int64_t bytes;
+
+	RCacheUsage()
+		: inserts(0), evictions(0), expirations(0), purges(0), num(0), bytes(0)
 	{
-		Lock lock(*this);
-		HashMap::node_type* node = _hashmap.find(key);
-		if (node && node->data.revision() == _revision)
-			return node->data;
-		return RData();
+		for (int i = 0; i < RC_EVENT_NUM; ++i)
+			events[i] = 0;
 	}
+};
 
-	RData use(const RKey& key)
+/* An item in the cache, for introspection */
+struct RCacheEntry
+{
+	std::string key;	// hex of the RKey digest, the original key isn't kept
+	std::string type;
+	std::string service;	// empty if unknown
+	bool resident;		// false if the top key has gone from the cache
+	int64_t age;		// seconds since the data was inserted
+	size_t length;		// of the data, zipped if it is
+	size_t bytes;		// memory used
+	uint64_t hits;		// since the data was inserted
+	uint64_t count;		// estimated by the top-K sketch
+	uint64_t error;		// of the count, which is over-estimated at most by this
+
+	RCacheEntry()
+		: resident(false), age(0), length(0), bytes(0), hits(0), count(0), error(0)
 	{
-		Lock lock(*this);
-		HashMap::node_type* node = _hashmap.use(key);
-		if (node && node->data.revision() == _revision)
-			return node->data;
-		return RData();
 	}
+};
+
+class RCache: public XRefCount
+{
+public:
+	/* The cache is configured by XiProxy.Cache.* settings.
+	 * The bytes of an item are the slab block of the data plus the node overhead.
+	 */
+	RCache(const SettingPtr& setting);
+	virtual ~RCache();
+
+	size_t shards() const			{ return _shards.size(); }
+	RCachePolicy policy() const		{ return _policy; }
+	size_t zipThreshold() const		{ return _zip_threshold; }
 
-	bool replace(const RKey& key, const RData& val)
+	/* Partition of the items of the service, 0 for the default partition.
+	 * The items of the RD_LCACHE type are in the partition named LCache.
+	 */
+	int partition(const std::string& service) const;
+
+	/* Small integer id of the service, for the scoped clear.
+	 * 0 if there are too many services.
+	 */
+	int owner(const std::string& service);
+
+	RData find(const RKey& key);
+
+	RData use(const RKey& key);
+
+	/* Same as find() or use() of each key, datas[i] is of keys[i].
+	 * The keys are grouped by shard, each shard is locked once.
+	 */
+	void findMany(const std::vector<RKey>& keys, std::vector<RData>& datas);
+	void useMany(const std::vector<RKey>& keys, std::vector<RData>& datas);
+
+	/* The data not shorter than XiProxy.Cache.ZipThreshold is stored
+	 * compressed, the compression is done before taking the lock.
+	 */
+	bool replace(const RKey& key, const RData& val);
+
+	/* Same as replace() of each key with datas[i], grouped by shard.
+	 * Return the number of items stored.
+	 */
+	size_t replaceMany(const std::vector<RKey>& keys, const std::vector<RData>& datas);
+
+	bool remove(const RKey& key);
+
+	intmax_t plus(const RKey& key, intmax_t val, uint64_t now, uint64_t after);
+
+	size_t drain(size_t num);
+
+	/* Advance the timing wheels to now and remove the expired items.
+	 * Should be called about once a second.
+	 */
+	size_t expire(uint64_t now);
+
+	/* The items cleared are unreachable at once, and are removed
+	 * from the memory by sweep() later.
+	 */
+	void clear();
+
+	/* Clear the items of the service, return false if the service is unknown */
+	bool clearOwner(const std::string& service);
+
+	void clearType(RDataType type);
+
+	/* Remove the items cleared since the last call, a small number
+	 * of buckets at a time. Called by only one thread.
+	 */
+	size_t sweep();
+
+	/* The secondary indexes from a method or a tag of the service to the
+	 * keys of its items, for the removal in bulk. At most
+	 * XiProxy.Cache.IndexMax keys are indexed, 0 to disable the indexes.
+	 * The #suffix of the service is ignored.
+	 */
+	static RKey methodIndex(const xstr_t& service, const xstr_t& method);
+	static RKey tagIndex(const xstr_t& service, const xstr_t& tag);
+
+	bool indexed() const			{ return _index_max > 0; }
+
+	void index(const RKey& key, const std::vector<RKey>& indexes);
+
+	/* Remove the items in the index, return the number of them removed */
+	size_t removeIndexed(const RKey& index);
+
+	/* Drop the keys of the items gone from a slice of the indexes.
+	 * Called by only one thread.
+	 */
+	size_t pruneIndex();
+
+	void stats(RCacheStats& st);
+
+	void partStats(std::vector<RCachePartStats>& pst);
+
+	/* Count the event without locking */
+	void count(RDataType type, int owner, RCacheEvent ev)
 	{
-		val.setRevision(_revision);
-		Lock lock(*this);
-		return _hashmap.replace(key, val);
+		xatomiclong_inc(&_type_events[stripe()][type < RD_TYPE_NUM ? type : RD_NONE][ev]);
+		xatomiclong_inc(&_owner_events[owner]->n[stripe()][ev]);
 	}
 
-	bool remove(const RKey& key)
+	/* The usages of the types of data (except RD_NONE) and of the services */
+	void usages(std::vector<RCacheUsage>& types, std::vector<RCacheUsage>& owners);
+
+	/* At most num items from random places of the cache */
+	void sample(size_t num, std::vector<RCacheEntry>& entries);
+
+	/* At most num keys with the most hits (hot) and with the most
+	 * bytes of data hit (heavy), in descending order. The counts are
+	 * estimated from a sample of the hits.
+	 */
+	void topKeys(size_t num, std::vector<RCacheEntry>& hot, std::vector<RCacheEntry>& heavy);
+
+	/* Snapshot of the cache in XiProxy.Cache.SnapshotFile, so that a
+	 * restarted process doesn't start with an empty cache.
+	 * The changes after the last save() are lost if the process crashes.
+	 * Only the answers and the LCache items are saved, the copies of
+	 * MCache and Redis are not, as their deletions would be lost.
+	 * The saves are serialized, and after save(true), the last one at
+	 * exit, the periodic ones do nothing.
+	 * Return the number of items saved or restored, negative on error.
+	 */
+	ssize_t save(bool last = false);
+	ssize_t restore();
+
+	/* Seconds between the periodic saves, 0 to save only at exit */
+	int snapshotInterval() const		{ return _snapshot_file.empty() ? 0 : _snapshot_interval; }
+
+	/* Return val itself if it's not zipped, or a new unzipped copy.
+	 * Return null RData if failed to unzip.
+	 */
+	RData unzip(const RData& val);
+
+private:
+	struct Node;
+	struct Usage;
+	struct TopK;
+	struct Part;
+	struct Shard;
+	struct Index;
+
+	/* The low bits of RKey::hash() select the slot within the shard,
+	 * so the shard is picked by the top bits.
+	 */
+	unsigned int shard_index(const RKey& key) const	{ return (key.hash() >> 24) & _shard_mask; }
+	Shard& shard(const RKey& key)		{ return *_shards[shard_index(key)]; }
+
+	Index& index_stripe(const RKey& index)	{ return *_indexes[index.hash2() % _indexes.size()]; }
+
+	bool resident(const RKey& key);
+
+	/* The data to store, zipped, with its partition, size and expiry */
+	struct Entry
 	{
-		Lock lock(*this);
-		return _hashmap.remove(key);
-	}
+		RData val;
+		int part;
+		size_t size;
+		uint32_t etick;
+	};
 
-	intmax_t plus(const RKey& key, intmax_t val, uint64_t now, uint64_t after);
+	Entry prepare(const RData& data);
+	bool store(Shard& s, const RKey& key, Entry& ent);
+	RData lookup(Shard& s, const RKey& key, bool use);
+	void lookup_many(const std::vector<RKey>& keys, std::vector<RData>& datas, bool use);
+	void by_shard(const std::vector<RKey>& keys, std::vector<std::pair<unsigned int, size_t> >& order);
+
+	uint32_t tick(uint64_t tsc) const	{ return (tsc - _base_tsc) / _tick_tsc; }
 
-	size_t drain(size_t num)
+	uint32_t expire_tick(const RData& val) const;
+
+	RData zip(const RData& val);
+
+	bool stale(const RData& val) const
 	{
-		Lock lock(*this);
-		return _hashmap.drain(num);
+		int rev = val.revision();
+		return (rev <= xatomic_get(&_clear_all)
+			|| rev <= xatomic_get(&_clear_type[val.type() < RD_TYPE_NUM ? val.type() : RD_NONE])
+			|| rev <= xatomic_get(&_clear_owner[val.owner()]));
 	}
 
-	size_t reap(size_t num, uint64_t before)
+	int revision() const			{ return xatomic_get(&_revision); }
+
+	/* The event counters are striped by thread, to keep the threads
+	 * from contending for the same cache line.
+	 */
+	enum { STRIPES = 16 };
+	struct OwnerEvents
 	{
-		size_t n = 0;
-		Lock lock(*this);
-		for (n = 0; n < num; ++n)
-		{
-			HashMap::node_type* node = _hashmap.most_stale();
-			if (node && (uint64_t)(before - node->data.ctime()) < INT64_MAX)
-				_hashmap.remove_node(node);
-			else
-				break;
-		}
-		return n;
-	}
+		xatomiclong_t n[STRIPES][RC_EVENT_NUM];
+	};
 
-	void clear()
+	static unsigned int stripe()
 	{
-		++_revision;
+		uint64_t x = (uintptr_t)pthread_self();
+		return (x * UINT64_C(0x9E3779B97F4A7C15)) >> 60;
 	}
 
+	OwnerEvents* new_owner_events();
+
+	void describe(const Node *node, uint64_t now, const std::vector<std::string>& owners, RCacheEntry& ent);
+	void top_entries(std::vector<std::pair<RKey, RCacheEntry> >& tops, size_t num, const std::vector<std::string>& owners);
+	void bump_revision(xatomic_t *clear_revision);
+
 private:
-	typedef LruHashMap<RKey, RData> HashMap;
-	HashMap _hashmap;
-	int _revision;
+	std::vector<Shard*> _shards;
+	unsigned int _shard_mask;
+	RCachePolicy _policy;
+	uint64_t _base_tsc;
+	uint64_t _tick_tsc;
+	uint64_t _expire_max_tsc;
+	size_t _zip_threshold;
+	std::map<std::string, int> _part_map;
+	std::vector<std::string> _part_names;
+	std::vector<int> _part_shares;
+	int _lcache_part;
+
+	xatomic_t _revision;			// of the items inserted now
+	xatomic_t _clear_all;			// items with the revision not above these are cleared
+	xatomic_t _clear_type[RD_TYPE_NUM];
+	xatomic_t _clear_owner[RCACHE_OWNER_MAX];
+	int _swept_revision;
+
+	std::vector<Index*> _indexes;
+	size_t _index_max;
+
+	XMutex _owner_mutex;
+	std::map<std::string, int> _owner_map;
+	std::vector<std::string> _owner_names;
+
+	xatomiclong_t _type_events[STRIPES][RD_TYPE_NUM][RC_EVENT_NUM];
+	OwnerEvents *_owner_events[RCACHE_OWNER_MAX];
+	int _expire_max;
+	std::string _snapshot_file;
+	int _snapshot_interval;
+	XMutex _snapshot_mutex;
+	bool _snapshot_closed;
+
+	struct ZipStats: public XMutex
+	{
+		uint64_t zip_num;
+		uint64_t zip_in_bytes;
+		uint64_t zip_out_bytes;
+		uint64_t zip_tsc;
+		uint64_t unzip_num;
+		uint64_t unzip_tsc;
+	} _zst;
 };
 
 typedef XPtr<RCache> RCachePtr;
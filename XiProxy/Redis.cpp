@@ -1,8 +1,10 @@
 #include "Redis.h"
+#include "XiProxy.h"
 #include "xic/Engine.h"
 #include "dlog/dlog.h"
 #include "xslib/vbs.h"
 #include "xslib/xlog.h"
+#include "xslib/rdtsc.h"
 
 
 xic::MethodTab::PairType Redis::_funpairs[] = {
@@ -23,9 +25,12 @@ static void start_dispatcher()
 	the_dispatcher->start();
 }
 
-Redis::Redis(const xic::EnginePtr& engine, const std::string& service, int revision, const std::string& servers)
-	: RevServant(engine, service, revision), _servers(servers)
+Redis::Redis(const xic::EnginePtr& engine, const std::string& service, int revision, const std::string& servers,
+		const RCachePtr& rcache, const PeerBusPtr& peerbus)
+	: RevServant(engine, service, revision), _servers(servers), _rcache(rcache), _peerbus(peerbus)
 {
+	_rcache_part = _rcache->partition(_service);
+	_rcache_owner = _rcache->owner(_service);
 	pthread_once(&dispatcher_once, start_dispatcher);
 
 	_redisgroup.reset(new RedisGroup(the_dispatcher, _service, servers));
@@ -58,6 +63,16 @@ void Redis::getInfo(xic::VDictWriter& dw)
 	dw.kv("servers", _servers);
 }
 
+void Redis::invalidate(const xic::QuestPtr& quest, const xstr_t& key)
+{
+	if (xp_hotkey_threshold <= 0)
+		return;
+
+	RKey rkey(RD_REDIS, quest->service(), key);
+	_rcache->remove(rkey);
+	_peerbus->invalidate(rkey);
+}
+
 class Callback_default: public RedisResultCallback
 {
 	xic::WaiterPtr _waiter;
@@ -261,17 +276,36 @@ struct Callback_inc_dec: public Callback_default
 
 struct Callback_get: public Callback_default
 {
+	RCachePtr _rcache;	// not null if the value of the hot key is to be cached
+	RKey _rkey;
+	int _part;
+	int _owner;
+
 	Callback_get(const xic::WaiterPtr& waiter)
 		: Callback_default(waiter)
 	{
 	}
 
+	Callback_get(const xic::WaiterPtr& waiter, const RCachePtr& rcache, const RKey& rkey, int part, int owner)
+		: Callback_default(waiter), _rcache(rcache), _rkey(rkey), _part(part), _owner(owner)
+	{
+	}
+
 	virtual void handle(xic::AnswerWriter& aw, const vbs_list_t& ls)
 	{
 		const vbs_data_t *d0 = ls.first ? &ls.first->value : NULL;
 		if (d0 && d0->kind == VBS_BLOB)
 		{
 			aw.param("value", d0);
+			if (_rcache)
+			{
+				uint64_t now = rdtsc();
+				RData rdata(now, RD_REDIS, d0->d_blob);
+				rdata.setExpire(now + xp_hotkey_ttl * cpu_frequency());
+				rdata.setPartition(_part);
+				rdata.setOwner(_owner);
+				_rcache->replace(_rkey, rdata);
+			}
 		}
 	}
 };
@@ -340,6 +374,8 @@ XIC_METHOD(Redis, _1CALL)
 	const xstr_t& key = args.wantXstr("key");
 	const vbs_list_t* cmd = args.want_list("cmd");
 
+	// The command may change the key, the peers are told as well.
+	invalidate(quest, key);
 	RedisResultCallbackPtr cb(new Callback_1call(current.asynchronous()));
 	_redisgroup->_1call(cb, key, cmd);
 	return xic::ASYNC_ANSWER;
@@ -351,6 +387,7 @@ XIC_METHOD(Redis, _NCALL)
 	const xstr_t& key = args.wantXstr("key");
 	const vbs_list_t* cmds = args.want_list("cmds");
 
+	invalidate(quest, key);
 	RedisResultCallbackPtr cb(new Callback_ncall(current.asynchronous(), cmds->count));
 	_redisgroup->_ncall(cb, key, cmds);
 	return xic::ASYNC_ANSWER;
@@ -362,6 +399,7 @@ XIC_METHOD(Redis, _TCALL)
 	const xstr_t& key = args.wantXstr("key");
 	const vbs_list_t* cmds = args.want_list("cmds");
 
+	invalidate(quest, key);
 	RedisResultCallbackPtr cb(new Callback_tcall(current.asynchronous(), cmds->count));
 	_redisgroup->_tcall(cb, key, cmds);
 	return xic::ASYNC_ANSWER;
@@ -374,6 +412,7 @@ XIC_METHOD(Redis, set)
 	const xstr_t& value = args.wantBlob("value");
 	int expire = args.getInt("expire");
 
+	invalidate(quest, key);
 	RedisResultCallbackPtr cb(new Callback_set(current.asynchronous()));
 	_redisgroup->set(cb, key, value, expire);
 	return xic::ASYNC_ANSWER;
@@ -384,6 +423,7 @@ XIC_METHOD(Redis, delete)
 	xic::VDict args = quest->args();
 	const xstr_t& key = args.wantXstr("key");
 
+	invalidate(quest, key);
 	RedisResultCallbackPtr cb(new Callback_delete(current.asynchronous()));
 	_redisgroup->remove(cb, key);
 	return xic::ASYNC_ANSWER;
@@ -395,6 +435,7 @@ XIC_METHOD(Redis, increment)
 	const xstr_t& key = args.wantXstr("key");
 	int64_t value = args.wantInt("value");
 
+	invalidate(quest, key);
 	RedisResultCallbackPtr cb(new Callback_inc_dec(current.asynchronous()));
 	_redisgroup->increment(cb, key, value);
 	return xic::ASYNC_ANSWER;
@@ -406,6 +447,7 @@ XIC_METHOD(Redis, decrement)
 	const xstr_t& key = args.wantXstr("key");
 	int64_t value = args.wantInt("value");
 
+	invalidate(quest, key);
 	RedisResultCallbackPtr cb(new Callback_inc_dec(current.asynchronous()));
 	_redisgroup->decrement(cb, key, value);
 	return xic::ASYNC_ANSWER;
@@ -416,8 +458,30 @@ XIC_METHOD(Redis, get)
 {
 	xic::VDict args = quest->args();
 	const xstr_t& key = args.wantXstr("key");
-	
-	RedisResultCallbackPtr cb(new Callback_get(current.asynchronous()));
+
+	// The value of the hot key is cached for a short time, to keep
+	// the calls of it off the single redis server.
+	RKey rkey(RD_REDIS, quest->service(), key);
+	if (!_hotkeys.touch(rkey, key, _engine->time()))
+	{
+		RedisResultCallbackPtr cb(new Callback_get(current.asynchronous()));
+		_redisgroup->get(cb, key);
+		return xic::ASYNC_ANSWER;
+	}
+
+	RData rdata = _rcache->find(rkey);
+	if (rdata && rdata.type() == RD_REDIS
+		&& (rdtsc() - rdata.ctime()) < (uint64_t)xp_hotkey_ttl * cpu_frequency()
+		&& (rdata = _rcache->unzip(rdata)))
+	{
+		_rcache->count(RD_REDIS, _rcache_owner, RC_HIT);
+		xic::AnswerWriter aw;
+		aw.paramBlob("value", rdata.data(), rdata.length());
+		return aw;
+	}
+	_rcache->count(RD_REDIS, _rcache_owner, RC_MISS);
+
+	RedisResultCallbackPtr cb(new Callback_get(current.asynchronous(), _rcache, rkey, _rcache_part, _rcache_owner));
 	_redisgroup->get(cb, key);
 	return xic::ASYNC_ANSWER;
 }
@@ -3,6 +3,9 @@
 
 #include "RedisGroup.h"
 #include "RevServant.h"
+#include "RCache.h"
+#include "PeerBus.h"
+#include "HotKeys.h"
 #include "xic/ServantI.h"
 
 
@@ -27,13 +30,24 @@ class Redis: public RevServant, private XMutex
 
 	std::string _servers;
 	RedisGroupPtr _redisgroup;
+	RCachePtr _rcache;
+	int _rcache_part;
+	int _rcache_owner;
+	PeerBusPtr _peerbus;
+	HotKeys _hotkeys;
+
+	/* Remove the promoted hot key from the local cache, and from those of the peers */
+	void invalidate(const xic::QuestPtr& quest, const xstr_t& key);
 public:
-	Redis(const xic::EnginePtr& engine, const std::string& service, int revision, const std::string& servers);
+	Redis(const xic::EnginePtr& engine, const std::string& service, int revision, const std::string& servers,
+		const RCachePtr& rcache, const PeerBusPtr& peerbus);
 	virtual ~Redis();
 
 	virtual xic::AnswerPtr process(const xic::QuestPtr& quest, const xic::Current& current);
 	virtual void getInfo(xic::VDictWriter& dw);
 
+	HotKeys& hotKeys()			{ return _hotkeys; }
+
 private:
 #define CMD(X) XIC_METHOD_DECLARE(X);
 	REDIS_CMDS
@@ -0,0 +1,224 @@
+#include "ServantRegistry.h"
+#include "xslib/jenkins.h"
+#include <string.h>
+
+#define TABLE_MIN_SLOTS		16
+
+
+static inline uint32_t name_hash(const void *data, size_t len)
+{
+	return jenkins_hash(data, len, 0);
+}
+
+
+ServantRegistry::Table::Table(size_t num, int generation)
+	: _size(0), _generation(generation)
+{
+	// At most half of the slots are used.
+	size_t n = TABLE_MIN_SLOTS;
+	while (n < num * 2)
+		n <<= 1;
+	_slots.resize(n);
+	_mask = n - 1;
+}
+
+void ServantRegistry::Table::add(uint32_t hash, const std::string& name, const RevServantPtr& srv)
+{
+	uint32_t i = hash & _mask;
+	while (_slots[i].srv)
+		i = (i + 1) & _mask;
+
+	Slot& slot = _slots[i];
+	slot.hash = hash;
+	slot.name = name;
+	slot.srv = srv;
+	++_size;
+}
+
+RevServantPtr ServantRegistry::Table::find(const xstr_t& service) const
+{
+	uint32_t hash = name_hash(service.data, service.len);
+	for (uint32_t i = hash & _mask; _slots[i].srv; i = (i + 1) & _mask)
+	{
+		const Slot& slot = _slots[i];
+		if (slot.hash == hash && slot.name.length() == (size_t)service.len
+			&& memcmp(slot.name.data(), service.data, service.len) == 0)
+		{
+			return slot.srv;
+		}
+	}
+	return RevServantPtr();
+}
+
+void ServantRegistry::Table::servants(std::vector<RevServantPtr>& srvs) const
+{
+	for (size_t i = 0; i < _slots.size(); ++i)
+	{
+		if (_slots[i].srv)
+			srvs.push_back(_slots[i].srv);
+	}
+}
+
+
+ServantRegistry::ServantRegistry()
+{
+	xatomic_set(&_generation, 1);
+	_table.reset(new Table(0, 1));
+	pthread_key_create(&_key, release_cache);
+}
+
+ServantRegistry::~ServantRegistry()
+{
+	pthread_key_delete(_key);
+	for (std::set<Cache *>::iterator iter = _caches.begin(); iter != _caches.end(); ++iter)
+	{
+		Cache *cache = *iter;
+		if (cache->table)
+			cache->table->xref_dec();
+		delete cache;
+	}
+}
+
+void ServantRegistry::release_cache(void *arg)
+{
+	Cache *cache = (Cache *)arg;
+	ServantRegistry *registry = cache->registry;
+	{
+		XMutex::Lock lock(registry->_caches_mutex);
+		registry->_caches.erase(cache);
+	}
+	if (cache->table)
+		cache->table->xref_dec();
+	delete cache;
+}
+
+void ServantRegistry::publish(Table *table)
+{
+	_table.reset(table);
+	xatomic_set(&_generation, table->_generation);
+}
+
+/* Called after publish() without the lock of the registry.
+ * The lookups hold the mutex of the thread and then the lock of the
+ * registry, so the other way round here would deadlock.
+ */
+void ServantRegistry::retire()
+{
+	int generation = xatomic_get(&_generation);
+	XMutex::Lock lock(_caches_mutex);
+	for (std::set<Cache *>::iterator iter = _caches.begin(); iter != _caches.end(); ++iter)
+	{
+		Cache *cache = *iter;
+		XMutex::Lock lk(*cache);
+		if (cache->table && cache->table->_generation != generation)
+		{
+			cache->table->xref_dec();
+			cache->table = NULL;
+		}
+	}
+}
+
+ServantRegistry::Table *ServantRegistry::copy_except(const std::string& service, size_t num)
+{
+	const Table *old = _table.get();
+	Table *table = new Table(num, old->_generation + 1);
+	for (size_t i = 0; i < old->_slots.size(); ++i)
+	{
+		const Table::Slot& slot = old->_slots[i];
+		if (slot.srv && slot.name != service)
+			table->add(slot.hash, slot.name, slot.srv);
+	}
+	return table;
+}
+
+RevServantPtr ServantRegistry::find(const xstr_t& service)
+{
+	Cache *cache = (Cache *)pthread_getspecific(_key);
+	if (!cache)
+	{
+		cache = new Cache();
+		cache->registry = this;
+		cache->table = NULL;
+		pthread_setspecific(_key, cache);
+		XMutex::Lock lock(_caches_mutex);
+		_caches.insert(cache);
+	}
+
+	XMutex::Lock lk(*cache);
+	Table *table = cache->table;
+	if (!table || table->_generation != xatomic_get(&_generation))
+	{
+		{
+			Lock lock(*this);
+			table = _table.get();
+			table->xref_inc();
+		}
+		if (cache->table)
+			cache->table->xref_dec();
+		cache->table = table;
+	}
+	return table->find(service);
+}
+
+ServantRegistry::TablePtr ServantRegistry::snapshot()
+{
+	Lock lock(*this);
+	return _table;
+}
+
+void ServantRegistry::insert(const std::string& service, const RevServantPtr& srv)
+{
+	{
+		Lock lock(*this);
+		Table *table = copy_except(service, _table->_size + 1);
+		table->add(name_hash(service.data(), service.length()), service, srv);
+		publish(table);
+	}
+	retire();
+}
+
+bool ServantRegistry::remove(const std::string& service)
+{
+	{
+		Lock lock(*this);
+		const Table *old = _table.get();
+		xstr_t xs = XSTR_CXX(service);
+		if (!old->find(xs))
+			return false;
+
+		publish(copy_except(service, old->_size - 1));
+	}
+	retire();
+	return true;
+}
+
+size_t ServantRegistry::remove(const std::vector<RevServantPtr>& srvs)
+{
+	std::set<RevServant *> gone;
+	for (size_t i = 0; i < srvs.size(); ++i)
+		gone.insert(srvs[i].get());
+
+	size_t num;
+	{
+		Lock lock(*this);
+		const Table *old = _table.get();
+		std::vector<const Table::Slot *> kept;
+		for (size_t i = 0; i < old->_slots.size(); ++i)
+		{
+			const Table::Slot& slot = old->_slots[i];
+			if (slot.srv && gone.find(slot.srv.get()) == gone.end())
+				kept.push_back(&slot);
+		}
+
+		num = old->_size - kept.size();
+		if (num == 0)
+			return 0;
+
+		Table *table = new Table(kept.size(), old->_generation + 1);
+		for (size_t i = 0; i < kept.size(); ++i)
+			table->add(kept[i]->hash, kept[i]->name, kept[i]->srv);
+		publish(table);
+	}
+	retire();
+	return num;
+}
@@ -0,0 +1,91 @@
+#ifndef ServantRegistry_h_
+#define ServantRegistry_h_
+
+#include "RevServant.h"
+#include "xslib/XLock.h"
+#include "xslib/xatomic.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <set>
+
+/* The servants of BigServant keyed by the service name.
+ * The table is never changed once published. A writer builds a new
+ * table under the lock and publishes it with a new generation.
+ * Each thread keeps a reference to the table it used last, and takes
+ * the lock only when the generation has changed, so the lookups of
+ * the services don't contend with each other or with the writers.
+ * The reference is guarded by a mutex of the thread, which the writer
+ * takes only to drop the references to the retired tables, so the
+ * removed servants are freed even if the thread is idle.
+ */
+class ServantRegistry: private XMutex
+{
+public:
+	class Table: public XRefCount
+	{
+		friend class ServantRegistry;
+		struct Slot
+		{
+			uint32_t hash;
+			std::string name;
+			RevServantPtr srv;
+		};
+
+		std::vector<Slot> _slots;
+		uint32_t _mask;
+		size_t _size;
+		int _generation;
+
+		Table(size_t num, int generation);
+		void add(uint32_t hash, const std::string& name, const RevServantPtr& srv);
+	public:
+		RevServantPtr find(const xstr_t& service) const;
+		size_t size() const			{ return _size; }
+
+		/* Append all the servants to srvs */
+		void servants(std::vector<RevServantPtr>& srvs) const;
+	};
+	typedef XPtr<Table> TablePtr;
+
+	ServantRegistry();
+	~ServantRegistry();
+
+	/* Only the mutex of the calling thread is taken, unless the table
+	 * has been changed since the last lookup in the thread.
+	 */
+	RevServantPtr find(const xstr_t& service);
+
+	TablePtr snapshot();
+
+	void insert(const std::string& service, const RevServantPtr& srv);
+
+	/* return true if found */
+	bool remove(const std::string& service);
+
+	/* Remove the servants if they are still in the table,
+	 * return the number removed.
+	 */
+	size_t remove(const std::vector<RevServantPtr>& srvs);
+
+private:
+	struct Cache: public XMutex
+	{
+		ServantRegistry *registry;
+		Table *table;
+	};
+
+	static void release_cache(void *arg);
+	Table *copy_except(const std::string& service, size_t num);
+	void publish(Table *table);
+	void retire();
+
+	TablePtr _table;
+	xatomic_t _generation;
+	pthread_key_t _key;
+	XMutex _caches_mutex;
+	std::set<Cache *> _caches;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "SlabAlloc.h"
+#include "xslib/XLock.h"
+#include "xslib/xatomic.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MIN_SHIFT	5
+#define CHUNK_SIZE	(64*1024)
+#define BATCH_BYTES	(8*1024)
+#define BATCH_MAX	32
+
+
+struct FreeBlock
+{
+	FreeBlock *next;
+};
+
+struct SlabClass: public XMutex
+{
+	size_t size;
+	unsigned int batch;
+	FreeBlock *free;
+	size_t num_free;
+	char *carve;
+	char *carve_end;
+	size_t reserved;
+	size_t carved;
+	xatomiclong_t used;
+};
+
+struct ThreadCache
+{
+	FreeBlock *head[SLAB_CLASS_NUM];
+	unsigned int num[SLAB_CLASS_NUM];
+};
+
+static SlabClass the_classes[SLAB_CLASS_NUM];
+static xatomiclong_t large_used;
+static pthread_key_t cache_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+static inline size_t class_size(unsigned int cls)
+{
+	if (cls == 0)
+		return 1 << MIN_SHIFT;
+	unsigned int shift = MIN_SHIFT + (cls - 1) / 4;
+	return ((size_t)1 << shift) + ((cls - 1) % 4 + 1) * ((size_t)1 << (shift - 2));
+}
+
+static inline unsigned int size_class(size_t size)
+{
+	if (size <= (1 << MIN_SHIFT))
+		return 0;
+
+	unsigned int shift = 0;
+	for (size_t n = size - 1; n > 1; n >>= 1)
+		++shift;
+
+	size_t step = (size_t)1 << (shift - 2);
+	size_t k = (size - ((size_t)1 << shift) + step - 1) / step;
+	return (shift - MIN_SHIFT) * 4 + k;
+}
+
+static void release_blocks(unsigned int cls, FreeBlock *head, unsigned int num)
+{
+	SlabClass& sc = the_classes[cls];
+	FreeBlock *tail = head;
+	while (tail->next)
+		tail = tail->next;
+
+	XMutex::Lock lock(sc);
+	tail->next = sc.free;
+	sc.free = head;
+	sc.num_free += num;
+}
+
+static void flush_cache(void *arg)
+{
+	ThreadCache *tc = (ThreadCache *)arg;
+	for (unsigned int i = 0; i < SLAB_CLASS_NUM; ++i)
+	{
+		if (tc->head[i])
+			release_blocks(i, tc->head[i], tc->num[i]);
+	}
+	free(tc);
+}
+
+static void init_classes()
+{
+	for (unsigned int i = 0; i < SLAB_CLASS_NUM; ++i)
+	{
+		SlabClass& sc = the_classes[i];
+		sc.size = class_size(i);
+		sc.batch = BATCH_BYTES / sc.size;
+		if (sc.batch < 2)
+			sc.batch = 2;
+		else if (sc.batch > BATCH_MAX)
+			sc.batch = BATCH_MAX;
+		sc.free = NULL;
+		sc.num_free = 0;
+		sc.carve = NULL;
+		sc.carve_end = NULL;
+		sc.reserved = 0;
+		sc.carved = 0;
+		xatomiclong_set(&sc.used, 0);
+	}
+	xatomiclong_set(&large_used, 0);
+	pthread_key_create(&cache_key, flush_cache);
+}
+
+static ThreadCache *thread_cache()
+{
+	pthread_once(&init_once, init_classes);
+	ThreadCache *tc = (ThreadCache *)pthread_getspecific(cache_key);
+	if (!tc)
+	{
+		tc = (ThreadCache *)calloc(1, sizeof(ThreadCache));
+		if (tc)
+			pthread_setspecific(cache_key, tc);
+	}
+	return tc;
+}
+
+/* Move a batch of blocks from the global pool to the thread cache.
+ */
+static bool refill(ThreadCache *tc, unsigned int cls)
+{
+	SlabClass& sc = the_classes[cls];
+	XMutex::Lock lock(sc);
+	unsigned int n = 0;
+	while (n < sc.batch)
+	{
+		FreeBlock *b;
+		if (sc.free)
+		{
+			b = sc.free;
+			sc.free = b->next;
+			--sc.num_free;
+		}
+		else
+		{
+			if (sc.carve + sc.size > sc.carve_end)
+			{
+				size_t chunk = CHUNK_SIZE > sc.size * 2 ? CHUNK_SIZE : sc.size * 2;
+				char *p = (char *)malloc(chunk);
+				if (!p)
+					break;
+				sc.carve = p;
+				sc.carve_end = p + chunk;
+				sc.reserved += chunk;
+			}
+			b = (FreeBlock *)sc.carve;
+			sc.carve += sc.size;
+			++sc.carved;
+		}
+		b->next = tc->head[cls];
+		tc->head[cls] = b;
+		++tc->num[cls];
+		++n;
+	}
+	return n > 0;
+}
+
+void *slab_alloc(size_t size, uint8_t *cls)
+{
+	ThreadCache *tc = size <= SLAB_SIZE_MAX ? thread_cache() : NULL;
+	if (!tc)
+	{
+		void *p = malloc(size);
+		if (p)
+			xatomiclong_inc(&large_used);
+		*cls = SLAB_LARGE;
+		return p;
+	}
+
+	unsigned int c = size_class(size);
+	if (!tc->head[c] && !refill(tc, c))
+		return NULL;
+
+	FreeBlock *b = tc->head[c];
+	tc->head[c] = b->next;
+	--tc->num[c];
+	xatomiclong_inc(&the_classes[c].used);
+	*cls = c;
+	return b;
+}
+
+void slab_free(void *ptr, uint8_t cls)
+{
+	if (!ptr)
+		return;
+
+	if (cls == SLAB_LARGE)
+	{
+		xatomiclong_dec(&large_used);
+		free(ptr);
+		return;
+	}
+
+	SlabClass& sc = the_classes[cls];
+	FreeBlock *b = (FreeBlock *)ptr;
+	xatomiclong_dec(&sc.used);
+
+	ThreadCache *tc = thread_cache();
+	if (!tc)
+	{
+		b->next = NULL;
+		release_blocks(cls, b, 1);
+		return;
+	}
+
+	b->next = tc->head[cls];
+	tc->head[cls] = b;
+	++tc->num[cls];
+
+	if (tc->num[cls] >= sc.batch * 2)
+	{
+		// Give half of them back to the global pool.
+		FreeBlock *head = tc->head[cls];
+		FreeBlock *last = head;
+		for (unsigned int k = 1; k < sc.batch; ++k)
+			last = last->next;
+		tc->head[cls] = last->next;
+		last->next = NULL;
+		tc->num[cls] -= sc.batch;
+		release_blocks(cls, head, sc.batch);
+	}
+}
+
+size_t slab_block_size(size_t size)
+{
+	return size <= SLAB_SIZE_MAX ? class_size(size_class(size)) : size;
+}
+
+void slab_stats(SlabClassStats st[])
+{
+	pthread_once(&init_once, init_classes);
+	for (unsigned int i = 0; i < SLAB_CLASS_NUM; ++i)
+	{
+		SlabClass& sc = the_classes[i];
+		XMutex::Lock lock(sc);
+		st[i].size = sc.size;
+		st[i].reserved = sc.reserved;
+		st[i].used = xatomiclong_get(&sc.used);
+		st[i].idle = sc.num_free;
+		// The used counter isn't protected by the lock, it may be a bit ahead.
+		size_t out = sc.carved - sc.num_free;
+		st[i].cached = out > st[i].used ? out - st[i].used : 0;
+	}
+
+	SlabClassStats& large = st[SLAB_CLASS_NUM];
+	memset(&large, 0, sizeof(large));
+	large.used = xatomiclong_get(&large_used);
+}
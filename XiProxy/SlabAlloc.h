@@ -0,0 +1,46 @@
+#ifndef SlabAlloc_h_
+#define SlabAlloc_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size class allocator for the cached data.
+ * There are 4 size classes for every power of 2, from 32 bytes up to
+ * SLAB_SIZE_MAX. Each thread keeps a small cache of free blocks for
+ * every class, so most allocations and frees take no lock.
+ * Larger blocks are malloc()ed directly and belong to SLAB_LARGE.
+ * The memory of the slabs is never returned to the system.
+ */
+
+#define SLAB_CLASS_NUM		41
+#define SLAB_SIZE_MAX		(32*1024)
+#define SLAB_LARGE		0xff
+
+
+struct SlabClassStats
+{
+	size_t size;		// block size of the class, 0 for SLAB_LARGE
+	size_t reserved;	// bytes taken from the system
+	size_t used;		// blocks being used
+	size_t cached;		// free blocks in the per-thread caches
+	size_t idle;		// free blocks in the global pool
+};
+
+
+/* The size class is stored in *cls, it must be given back to slab_free().
+ * Return NULL if out of memory.
+ */
+void *slab_alloc(size_t size, uint8_t *cls);
+
+void slab_free(void *ptr, uint8_t cls);
+
+/* Number of bytes actually allocated for a block of size bytes */
+size_t slab_block_size(size_t size);
+
+/* st should have room for SLAB_CLASS_NUM + 1 entries,
+ * the last one is for SLAB_LARGE.
+ */
+void slab_stats(SlabClassStats st[]);
+
+
+#endif
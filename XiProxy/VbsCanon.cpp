@@ -0,0 +1,127 @@
+#include "VbsCanon.h"
+#include "xslib/xbuf.h"
+#include "xslib/XError.h"
+#include <algorithm>
+#include <stdint.h>
+
+/* Each value starts with one of these, followed by the length of the
+ * bytes or the number of the items, so no value is the prefix of
+ * another one, whatever the bytes of the scalars are.
+ */
+enum
+{
+	CANON_STRING = 's',
+	CANON_BLOB = 'b',
+	CANON_SCALAR = 'v',
+	CANON_LIST = 'l',
+	CANON_DICT = 'd',
+};
+
+typedef std::pair<std::string, const vbs_data_t*> CanonItem;
+
+static void canon_data(const vbs_data_t *d, std::string& out);
+
+static void canon_u32(uint32_t n, std::string& out)
+{
+	char buf[4] = { (char)n, (char)(n >> 8), (char)(n >> 16), (char)(n >> 24) };
+	out.append(buf, sizeof(buf));
+}
+
+static void canon_bytes(int kind, const xstr_t& xs, std::string& out)
+{
+	out += (char)kind;
+	canon_u32(xs.len, out);
+	out.append((const char *)xs.data, xs.len);
+}
+
+static void canon_scalar(const vbs_data_t *d, std::string& out)
+{
+	unsigned char buf[64];
+	size_t len = vbs_size_of_data(d);
+	if (len > sizeof(buf))
+		throw XERROR_FMT(XError, "vbs data too large, kind=%d size=%zd", d->kind, len);
+
+	xbuf_t xb = XBUF_INIT(buf, sizeof(buf));
+	vbs_packer_t pk = VBS_PACKER_INIT(xbuf_xio.write, &xb, -1);
+	if (vbs_pack_data(&pk, d) != 0)
+		throw XERROR_FMT(XError, "vbs_pack_data() failed, kind=%d", d->kind);
+	out += (char)CANON_SCALAR;
+	out += (char)xb.len;
+	out.append((const char *)buf, xb.len);
+}
+
+static void canon_key(const vbs_data_t *d, std::string& out)
+{
+	if (d->kind == VBS_STRING)
+		canon_bytes(CANON_STRING, d->d_xstr, out);
+	else
+		canon_scalar(d, out);
+}
+
+static void canon_dict(const vbs_dict_t *dict, const std::vector<std::string> *excludes, std::string& out)
+{
+	std::vector<CanonItem> items;
+	items.reserve(dict->count);
+	for (const vbs_ditem_t *ent = dict->first; ent; ent = ent->next)
+	{
+		if (excludes && ent->key.kind == VBS_STRING)
+		{
+			const xstr_t& k = ent->key.d_xstr;
+			if (std::binary_search(excludes->begin(), excludes->end(), std::string((const char *)k.data, k.len)))
+				continue;
+		}
+
+		items.push_back(CanonItem(std::string(), &ent->value));
+		canon_key(&ent->key, items.back().first);
+	}
+	std::sort(items.begin(), items.end());
+
+	out += (char)CANON_DICT;
+	canon_u32(items.size(), out);
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		out += items[i].first;
+		canon_data(items[i].second, out);
+	}
+}
+
+static void canon_list(const vbs_list_t *list, std::string& out)
+{
+	uint32_t num = 0;
+	for (const vbs_litem_t *ent = list->first; ent; ent = ent->next)
+		++num;
+
+	out += (char)CANON_LIST;
+	canon_u32(num, out);
+	for (const vbs_litem_t *ent = list->first; ent; ent = ent->next)
+		canon_data(&ent->value, out);
+}
+
+static void canon_data(const vbs_data_t *d, std::string& out)
+{
+	switch (d->kind)
+	{
+	case VBS_STRING:
+		canon_bytes(CANON_STRING, d->d_xstr, out);
+		break;
+	case VBS_BLOB:
+		canon_bytes(CANON_BLOB, d->d_blob, out);
+		break;
+	case VBS_LIST:
+		canon_list(d->d_list, out);
+		break;
+	case VBS_DICT:
+		canon_dict(d->d_dict, NULL, out);
+		break;
+	default:
+		canon_scalar(d, out);
+		break;
+	}
+}
+
+void vbs_canon_dict(const vbs_dict_t *dict, const std::vector<std::string> *excludes, std::string& out)
+{
+	// Never equal to the raw VBS of a dict.
+	out += '\0';
+	canon_dict(dict, excludes, out);
+}
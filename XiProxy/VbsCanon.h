@@ -0,0 +1,16 @@
+#ifndef VbsCanon_h_
+#define VbsCanon_h_
+
+#include "xslib/vbs.h"
+#include <string>
+#include <vector>
+
+/* Append the canonical form of the dict to out, which is the same
+ * for the dicts of the same content whatever the order of the items.
+ * The items of the dicts are sorted by key recursively.
+ * The top level items with a key in excludes (sorted) are skipped.
+ * The result is for hashing only, it is not VBS.
+ */
+void vbs_canon_dict(const vbs_dict_t *dict, const std::vector<std::string> *excludes, std::string& out);
+
+#endif
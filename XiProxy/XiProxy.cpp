@@ -32,6 +32,17 @@ static char build_info[] = "$build: XiProxy-" XIPROXY_VERSION " " __DATE__ " " _
 #define SLOW_MSEC_DEFAULT	1000
 #define REFRESH_TIME_DEFAULT	(3600*1)
 #define REFRESH_TIME_MIN	60
+#define COALESCE_MAX_DEFAULT	256
+#define COALESCE_MSEC_DEFAULT	3000
+#define HOTKEY_THRESHOLD_DEFAULT	0
+#define HOTKEY_DECAY_DEFAULT	10
+#define HOTKEY_TTL_DEFAULT	1
+#define HOTKEY_MAX_DEFAULT	32
+#define HEDGE_BUDGET_DEFAULT	5
+#define BREAKER_FAILURES_DEFAULT	5
+#define BREAKER_ERROR_PERCENT_DEFAULT	50
+#define BREAKER_OPEN_TIME_DEFAULT	10
+#define RETRY_BUDGET_DEFAULT	10
 
 char xp_the_ip[64];
 int xp_log_level = LOG_LEVEL_DEFAULT;
@@ -39,6 +50,17 @@ int64_t xp_ultra_slow_msec = ULTRA_SLOW_MSEC_DEFAULT;
 int64_t xp_slow_warning_msec = SLOW_MSEC_DEFAULT;
 unsigned int xp_refresh_time = REFRESH_TIME_DEFAULT;
 int xp_delay_msec = 0;
+int xp_coalesce_max = COALESCE_MAX_DEFAULT;
+int xp_coalesce_msec = COALESCE_MSEC_DEFAULT;
+int xp_hotkey_threshold = HOTKEY_THRESHOLD_DEFAULT;
+int xp_hotkey_decay = HOTKEY_DECAY_DEFAULT;
+int xp_hotkey_ttl = HOTKEY_TTL_DEFAULT;
+int xp_hotkey_max = HOTKEY_MAX_DEFAULT;
+int xp_hedge_budget = HEDGE_BUDGET_DEFAULT;
+int xp_breaker_failures = BREAKER_FAILURES_DEFAULT;
+int xp_breaker_error_percent = BREAKER_ERROR_PERCENT_DEFAULT;
+int xp_breaker_open_time = BREAKER_OPEN_TIME_DEFAULT;
+int xp_retry_budget = RETRY_BUDGET_DEFAULT;
 
 
 char *xp_get_time_str(time_t t, char *buf)
@@ -75,10 +97,33 @@ xic::AnswerPtr XiProxyCtrl::process(const xic::QuestPtr& quest, const xic::Curre
 	{
 		return _bigsrv->markProxyMethods(quest, current);
 	}
+	else if (xstr_equal_cstr(&method, "getCacheInfo"))
+	{
+		return _bigsrv->getCacheInfo(quest, current);
+	}
+	else if (xstr_equal_cstr(&method, "getCacheStats"))
+	{
+		return _bigsrv->getCacheStats(quest, current);
+	}
+	else if (xstr_equal_cstr(&method, "getCacheSample"))
+	{
+		return _bigsrv->getCacheSample(quest, current);
+	}
+	else if (xstr_equal_cstr(&method, "getCacheTop"))
+	{
+		return _bigsrv->getCacheTop(quest, current);
+	}
+	else if (xstr_equal_cstr(&method, "getHotKeys"))
+	{
+		return _bigsrv->getHotKeys(quest, current);
+	}
+	else if (xstr_equal_cstr(&method, "getPeerStats"))
+	{
+		return _bigsrv->getPeerStats(quest, current);
+	}
 	else if (xstr_equal_cstr(&method, "clearCache"))
 	{
-		_bigsrv->clearCache();
-		return xic::AnswerWriter();
+		return _bigsrv->clearCache(quest, current);
 	}
 
 	throw XERROR_MSG(xic::MethodNotFoundException, make_string(method));
@@ -117,6 +162,44 @@ static int run(int argc, char **argv, const xic::EnginePtr& engine)
 	// Do NOT set this value above 0 in production environment.
 	xp_delay_msec = setting->getInt("XiProxy.Service.Delay", 0);
 
+	// Concurrent misses of the same cached answer wait for the first one,
+	// at most Coalesce of them, and at most CoalesceTimeout milliseconds.
+	xp_coalesce_max = setting->getInt("XiProxy.Service.Coalesce", COALESCE_MAX_DEFAULT);
+	xp_coalesce_msec = setting->getInt("XiProxy.Service.CoalesceTimeout", COALESCE_MSEC_DEFAULT);
+	if (xp_coalesce_msec <= 0)
+		xp_coalesce_max = 0;
+
+	// The keys of MCache.get and Redis.get got at least Threshold times
+	// (halved every Decay seconds) are cached for TTL seconds. Off if 0.
+	xp_hotkey_threshold = setting->getInt("XiProxy.HotKey.Threshold", HOTKEY_THRESHOLD_DEFAULT);
+	xp_hotkey_decay = setting->getInt("XiProxy.HotKey.Decay", HOTKEY_DECAY_DEFAULT);
+	xp_hotkey_ttl = setting->getInt("XiProxy.HotKey.TTL", HOTKEY_TTL_DEFAULT);
+	xp_hotkey_max = setting->getInt("XiProxy.HotKey.Max", HOTKEY_MAX_DEFAULT);
+	if (xp_hotkey_threshold > 0xffff)
+		xp_hotkey_threshold = 0xffff;
+	if (xp_hotkey_ttl <= 0)
+		xp_hotkey_threshold = 0;
+
+	// The duplicate calls of the hedged methods are at most Budget
+	// percent of their calls.
+	xp_hedge_budget = setting->getInt("XiProxy.Hedge.Budget", HEDGE_BUDGET_DEFAULT);
+	if (xp_hedge_budget > 100)
+		xp_hedge_budget = 100;
+
+	// The endpoints of the services with -lb:p2c are ejected for
+	// OpenTime seconds when they fail too much. Failures = 0 to not count
+	// the consecutive failures.
+	xp_breaker_failures = setting->getInt("XiProxy.Breaker.Failures", BREAKER_FAILURES_DEFAULT);
+	xp_breaker_error_percent = setting->getInt("XiProxy.Breaker.ErrorPercent", BREAKER_ERROR_PERCENT_DEFAULT);
+	xp_breaker_open_time = setting->getInt("XiProxy.Breaker.OpenTime", BREAKER_OPEN_TIME_DEFAULT);
+	xp_retry_budget = setting->getInt("XiProxy.Breaker.RetryBudget", RETRY_BUDGET_DEFAULT);
+	if (xp_breaker_error_percent < 1)
+		xp_breaker_error_percent = 1;
+	if (xp_breaker_open_time < 1)
+		xp_breaker_open_time = 1;
+	if (xp_retry_budget > 100)
+		xp_retry_budget = 100;
+
 	xic::AdapterPtr adapter = engine->createAdapter();
 	if (setting->getString("XiProxy.ListFile").empty())
 		throw XERROR_MSG(XError, "XiProxy.ListFile is required to be set in configuration");
@@ -124,9 +207,10 @@ static int run(int argc, char **argv, const xic::EnginePtr& engine)
 	BigServantPtr bigsrv(new BigServant(engine, setting));
 	XPtr<Dlog> dlogger(new Dlog());
 	adapter->addServant("Dlog", dlogger);
-	adapter->addServant("LCache", new LCache(bigsrv->rcache()));
+	adapter->addServant("LCache", new LCache(bigsrv));
 	adapter->addServant("Quickie", new Quickie(bigsrv));
 	adapter->addServant("XiProxyCtrl", new XiProxyCtrl(bigsrv));
+	adapter->addServant("XiProxyPeer", bigsrv->peerbus());
 	adapter->setDefaultServant(bigsrv);
 
 	HttpHandlerPtr httpHandler;
@@ -141,6 +225,8 @@ static int run(int argc, char **argv, const xic::EnginePtr& engine)
 
 	if (httpHandler)
 		httpHandler->stop();
+
+	bigsrv->rcache()->save(true);
 	return 0;
 }
 
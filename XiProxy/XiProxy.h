@@ -7,6 +7,17 @@ extern int64_t xp_ultra_slow_msec;
 extern int64_t xp_slow_warning_msec;
 extern unsigned int xp_refresh_time;
 extern int xp_delay_msec;
+extern int xp_coalesce_max;
+extern int xp_coalesce_msec;
+extern int xp_hotkey_threshold;
+extern int xp_hotkey_decay;
+extern int xp_hotkey_ttl;
+extern int xp_hotkey_max;
+extern int xp_hedge_budget;
+extern int xp_breaker_failures;
+extern int xp_breaker_error_percent;
+extern int xp_breaker_open_time;
+extern int xp_retry_budget;
 
 
 char *xp_get_time_str(time_t t, char *buf);
@@ -1,19 +1,36 @@
 #include "XiServant.h"
 #include "XiProxy.h"
+#include "VbsCanon.h"
 #include "dlog/dlog.h"
 #include "xslib/xlog.h"
 #include "xslib/rdtsc.h"
 #include <string.h>
 
+#define HEDGE_CREDIT_MAX	(100 * 10)
+#define HEDGE_SAMPLES_MIN	100
+#define HEDGE_SAMPLES_MAX	1024
 
 XiServant::XiServant(const xic::EnginePtr& engine, const std::string& identity, int revision,
-	const xic::ProxyPtr& prx, BigServant* bigServant)
-	: RevServant(engine, identity, revision), _prx(prx), _bigServant(bigServant),
-		_rcache(bigServant->rcache()), _timer(bigServant->timer())
+	const xic::ProxyPtr& prx, const P2cBalancerPtr& balancer, const std::string& cache_rules, BigServant* bigServant)
+	: RevServant(engine, identity, revision), _prx(prx), _balancer(balancer), _bigServant(bigServant),
+		_rcache(bigServant->rcache()), _timer(bigServant->timer()), _cache_policy(identity, cache_rules)
 {
 	xatomic_set(&_call_total, 0);
 	xatomic_set(&_call_underway, 0);
 	xatomic_set(&_rcache_hits, 0);
+	xatomic_set(&_stale_hits, 0);
+	xatomic_set(&_coalesced, 0);
+	xatomic_set(&_coalesce_timeouts, 0);
+	xatomic_set(&_coalesce_overflows, 0);
+	xatomic_set(&_hedges_sent, 0);
+	xatomic_set(&_hedges_won, 0);
+	xatomic_set(&_hedges_denied, 0);
+	xatomic_set(&_retries_sent, 0);
+	xatomic_set(&_retries_denied, 0);
+	_hedge_credit = 0;
+	_flight_seq = 0;
+	_rcache_part = _rcache->partition(_service);
+	_rcache_owner = _rcache->owner(_service);
 	_expire_time = _start_time + (time_t)(xp_refresh_time * (1.0 + 0.1 * random() / RAND_MAX));
 	_last_time = 0;
 	_last_usec = 0;
@@ -25,21 +42,80 @@ XiServant::~XiServant()
 	delete _mtab;
 }
 
+/* The calls of a hedged quest, the first answer wins.
+ */
+class Hedge: public XRefCount, private XMutex
+{
+	bool _answered;
+public:
+	Hedge()
+		: _answered(false)
+	{
+	}
+
+	/* Return true if this is the first answer */
+	bool answer()
+	{
+		Lock lock(*this);
+		bool first = !_answered;
+		_answered = true;
+		return first;
+	}
+
+	bool answered()
+	{
+		Lock lock(*this);
+		return _answered;
+	}
+};
+typedef XPtr<Hedge> HedgePtr;
+
 class XiServantCompletion: public xic::Completion
 {
 	XiServantPtr _xsrv;
 	xic::WaiterPtr _waiter;
 	uint64_t _start_tsc;
 	RKey _rkey;
-	int _cache;
+	CacheRule _cache;
 	bool _debut;
+	uint64_t _flight;
+	ssize_t _endpoint;
+	uint64_t _probe;
+	HedgePtr _hedge;
+	bool _duplicate;
+	bool _retry;
 public:
-	XiServantCompletion(XiServant *ksrv, const xic::WaiterPtr& waiter, int cache, const RKey& rkey, bool debut)
-		: _xsrv(ksrv), _waiter(waiter), _rkey(rkey), _cache(cache), _debut(debut)
+	/* waiter is NULL if the call refreshes a stale answer already returned to the caller.
+	 * cache.ttl is the CACHE of the call, 0 for no caching.
+	 */
+	XiServantCompletion(XiServant *ksrv, const xic::WaiterPtr& waiter, const CacheRule& cache, const RKey& rkey, bool debut, uint64_t flight = 0)
+		: _xsrv(ksrv), _waiter(waiter), _rkey(rkey), _cache(cache), _debut(debut), _flight(flight),
+		_endpoint(-1), _probe(0), _duplicate(false), _retry(false)
 	{
 		_start_tsc = rdtsc();
 	}
 
+	/* The endpoint chosen by the balancer of the servant */
+	void setEndpoint(size_t idx, uint64_t probe)	{ _endpoint = idx; _probe = probe; }
+	ssize_t endpoint() const		{ return _endpoint; }
+
+	const CacheRule& cache() const		{ return _cache; }
+
+	/* Only the calls with a client waiting are hedged */
+	bool hedgeable() const			{ return _waiter && !_duplicate && _cache.hedge; }
+	void startHedge()			{ _hedge.reset(new Hedge()); }
+	bool answered() const			{ return _hedge && _hedge->answered(); }
+
+	/* The completion of the hedge or the retry of the call, sharing the hedge */
+	XiServantCompletion *duplicate(bool retry) const
+	{
+		XiServantCompletion *cb = new XiServantCompletion(_xsrv.get(), _waiter, _cache, _rkey, _debut, _flight);
+		cb->_hedge = _hedge;
+		cb->_duplicate = retry ? _duplicate : true;
+		cb->_retry = retry;
+		return cb;
+	}
+
 	virtual void completed(const xic::ResultPtr& result);
 };
 
@@ -59,6 +135,108 @@ public:
 	}
 };
 
+class HedgeTimer: public XTimerTask
+{
+	XiServantPtr _xsrv;
+	xic::QuestPtr _quest;
+	XiServantCompletionPtr _first;
+public:
+	HedgeTimer(XiServant *xsrv, const xic::QuestPtr& quest, const XiServantCompletionPtr& first)
+		: _xsrv(xsrv), _quest(quest), _first(first)
+	{
+	}
+
+	virtual void runTimerTask(const XTimerPtr& timer)
+	{
+		_xsrv->hedge(_quest, _first);
+	}
+};
+
+class FlightTimeout: public XTimerTask
+{
+	XiServantPtr _xsrv;
+	RKey _rkey;
+	uint64_t _flight;
+public:
+	FlightTimeout(XiServant *xsrv, const RKey& rkey, uint64_t flight)
+		: _xsrv(xsrv), _rkey(rkey), _flight(flight)
+	{
+	}
+
+	virtual void runTimerTask(const XTimerPtr& timer)
+	{
+		_xsrv->flight_timeout(_rkey, _flight);
+	}
+};
+
+static void free_rope_rdata(void *cookie, void *buf)
+{
+	RData::unref_rdata(cookie);
+}
+
+static xic::AnswerPtr make_answer(const RData& rdata, int status)
+{
+	xstr_t xs = rdata.xstr();
+	xic::AnswerPtr answer = xic::Answer::create();
+	answer->setStatus(status);
+	rope_t *rope = answer->args_rope();
+	void *cookie = RData::ref_rdata(rdata);
+	if (!rope_append_external(rope, xs.data, xs.len, free_rope_rdata, cookie))
+	{
+		RData::unref_rdata(cookie);
+		dlog("FATAL", "rope_append_external() failed");
+		return xic::AnswerPtr();
+	}
+	return answer;
+}
+
+/* Only the exceptions of xic on the connection or the socket, and the
+ * timeouts, tell that the endpoint is unhealthy. The others, such as
+ * xic.MethodNotFoundException, are raised by a healthy server for a bad
+ * quest. The quest failed on the connection may be retried on another
+ * endpoint.
+ */
+static P2cBalancer::Outcome call_outcome(xic::Answer *a, bool *conn_failed)
+{
+	*conn_failed = false;
+	if (a->status() == 0)
+		return P2cBalancer::CALL_OK;
+
+	xic::VDict args = a->args();
+	xstr_t exname = args.getXstr("exname");
+	if (!xstr_start_with_cstr(&exname, "xic."))
+		return P2cBalancer::CALL_ERROR;
+
+	*conn_failed = xstr_start_with_cstr(&exname, "xic.Connect") || xstr_start_with_cstr(&exname, "xic.Socket");
+	if (*conn_failed || xstr_end_with_cstr(&exname, "TimeoutException"))
+		return P2cBalancer::CALL_FAILED;
+	return P2cBalancer::CALL_ERROR;
+}
+
+static xic::QuestPtr copy_quest(const xic::QuestPtr& quest)
+{
+	xic::QuestWriter qw(quest->method());
+	xstr_t raw = xstr_slice(&quest->args_xstr(), 1, -1);
+	qw.raw(raw.data, raw.len);
+	xic::QuestPtr q = qw.take();
+	q->setService(quest->service());
+	xic::ContextBuilder ctxBuilder(quest->context());
+	q->setContext(ctxBuilder.build());
+	return q;
+}
+
+static void respond(const XiServantPtr& xsrv, const xic::WaiterPtr& waiter, const xic::AnswerPtr& answer)
+{
+	if (xp_delay_msec <= 0)
+	{
+		waiter->response(answer);
+	}
+	else
+	{
+		xsrv->timer()->addTask(new DelayedResponse(waiter, answer), xp_delay_msec);
+	}
+}
+
 void XiServantCompletion::completed(const xic::ResultPtr& result)
 {
 	xic::Quest* q = result->quest().get();
@@ -67,27 +245,76 @@ void XiServantCompletion::completed(const xic::ResultPtr& result)
 	uint64_t current_tsc = rdtsc();
 	int64_t used_usec = (current_tsc - _start_tsc) * 1000000 / cpu_frequency();
 
-	if (xp_delay_msec <= 0)
+	int status = a->status();
+	if (_cache.hedge == HEDGE_P95)
+		_xsrv->hedgeSample(q->method(), used_usec);
+	if (_endpoint >= 0)
 	{
-		_waiter->response(answer);
+		bool conn_failed;
+		P2cBalancer::Outcome outcome = call_outcome(a, &conn_failed);
+		_xsrv->balancer()->done(_endpoint, used_usec, outcome, _probe);
+
+		// The call failed on the connection is retried once on another
+		// endpoint, if the method allows and the retry budget permits.
+		if (conn_failed && _cache.retry && _waiter && !_retry && (!_hedge || !_hedge->answered())
+			&& _xsrv->retry(result->quest(), this))
+		{
+			_xsrv->call_end(q->method(), used_usec, false);
+			return;
+		}
 	}
-	else
+
+	if (_hedge)
 	{
-		_xsrv->timer()->addTask(new DelayedResponse(_waiter, answer), xp_delay_msec);
+		// The answer of the other call of the hedged quest has been
+		// used, this one is discarded.
+		if (!_hedge->answer())
+		{
+			_xsrv->call_end(q->method(), used_usec, false);
+			return;
+		}
+		if (_duplicate)
+			_xsrv->hedgeWon();
 	}
 
-	int status = a->status();
+	RData rdata;
+	if (_cache.ttl || _flight)
+		rdata = RData(current_tsc, RD_ANSWER, a->args_xstr());
+
+	if (_flight)
+	{
+		// The followers share the data of the answer.
+		std::vector<XiServant::Follower> followers;
+		_xsrv->land(_rkey, _flight, followers);
+		for (size_t i = 0; i < followers.size(); ++i)
+		{
+			xic::AnswerPtr ans = rdata ? make_answer(rdata, status) : xic::AnswerPtr();
+			if (!ans)
+				ans = answer;
+			respond(_xsrv, followers[i].waiter, ans);
+		}
+	}
+
+	if (_waiter)
+		respond(_xsrv, _waiter, answer);
+
 	bool add = _debut && (status == 0);
 	_xsrv->call_end(q->method(), used_usec, add);
 
-	if (_cache)
+	if (_cache.ttl)
 	{
 		const RCachePtr& rcache = _xsrv->rcache();
-		RData rdata(current_tsc, RD_ANSWER, a->args_xstr());
-		if (rdata)
+		// The exception answer is cached for the negative ttl (1 second by default).
+		// The normal answer is kept for the grace time of CACHE_STALE also.
+		int ttl = status ? _cache.negative : (_cache.ttl > 0 ? _cache.ttl : -_cache.ttl) + _cache.stale;
+		if (rdata && ttl > 0 && (!_cache.size_max || rdata.length() <= _cache.size_max))
 		{
 			rdata.setStatus(status);
-			rcache->replace(_rkey, rdata);
+			rdata.setExpire(current_tsc + ttl * cpu_frequency());
+			rdata.setPartition(_xsrv->rcachePartition());
+			rdata.setOwner(_xsrv->rcacheOwner());
+			if (rcache->replace(_rkey, rdata) && rcache->indexed())
+				_xsrv->indexAnswer(_rkey, q);
 		}
 		else
 		{
@@ -104,7 +331,7 @@ void XiServantCompletion::completed(const xic::ResultPtr& result)
 		char caution_locus[128], *lp = caution_locus;
 
 		xstr_t c0 = xstr_null;
-		xic::ConnectionPtr con0 = _waiter->getConnection();
+		xic::ConnectionPtr con0 = _waiter ? _waiter->getConnection() : xic::ConnectionPtr();
 		if (con0)
 			xstr_cxx(&c0, con0->info());
 
@@ -172,14 +399,9 @@ void XiServantCompletion::completed(const xic::ResultPtr& result)
 	}
 }
 
-static void free_rope_rdata(void *cookie, void *buf)
-{
-	RData::unref_rdata(cookie);
-}
-
 xic::AnswerPtr XiServant::process(const xic::QuestPtr& quest, const xic::Current& current)
 {
-	xic::CompletionPtr cb;
+	XiServantCompletionPtr cb;
 	xic::Quest* q = quest.get();
 
 	MyMethodTab::NodeType *node = NULL;
@@ -205,49 +427,189 @@ xic::AnswerPtr XiServant::process(const xic::QuestPtr& quest, const xic::Current
 	{
 		xic::VDict ctx = q->context();
 		int cache = ctx.getInt("CACHE");
+		// The rule of the method applies if the client has no CACHE
+		// or the rule is forced.
+		CacheRule cr;
+		const CacheRule *rule = _cache_policy.find(q->method());
+		if (rule)
+			cr = *rule;
+		if (rule && (rule->force || !cache))
+			cache = rule->ttl;
+		else if (cache)
+			cr.stale = ctx.getInt("CACHE_STALE");
+		cr.ttl = cache;
+		int stale = cr.stale;
 		RKey rkey;
+		uint64_t flight = 0;
 		if (!cache)
 			goto no_cache;
 
-		rkey.set(q->service(), q->method(), q->args_xstr());
+		if (cr.canonical)
+		{
+			std::string canon;
+			vbs_canon_dict(q->args().dict(), cr.excludes, canon);
+			xstr_t xs = XSTR_CXX(canon);
+			rkey.set(q->service(), q->method(), xs);
+		}
+		else
+		{
+			rkey.set(q->service(), q->method(), q->args_xstr());
+		}
 		if (cache > 0)
 		{
 			RData rdata = _rcache->find(rkey);
 			if (rdata.type() == RD_ANSWER)
 			{
 				int status = rdata.status();
-				// exception answer only cache 1 second.
-				uint64_t expire = (status ? 1 : cache) * cpu_frequency();
+				uint64_t expire = (status ? cr.negative : cache) * cpu_frequency();
+				// A normal answer in the grace time is returned at once,
+				// and refreshed in the background.
+				uint64_t grace = (status || stale <= 0) ? expire : expire + stale * cpu_frequency();
+				uint64_t age = rdtsc() - rdata.ctime();
+				if (rdata.zipped() && age < grace)
+					rdata = _rcache->unzip(rdata);
+
 				xstr_t xs = rdata.xstr();
-				if ((rdtsc() - rdata.ctime()) < expire && 
-					xs.len >= 2 && xs.data[xs.len-1] == VBS_TAIL)
+				if (age < grace && xs.len >= 2 && xs.data[xs.len-1] == VBS_TAIL)
 				{
-					xatomic_inc(&_rcache_hits);
-					xic::AnswerPtr answer = xic::Answer::create();
-					answer->setStatus(status);
-					rope_t *rope = answer->args_rope();
-					void *cookie = RData::ref_rdata(rdata);
-					if (rope_append_external(rope, xs.data, xs.len, free_rope_rdata, cookie))
+					xic::AnswerPtr answer = make_answer(rdata, status);
+					if (answer && age < expire)
 					{
+						xatomic_inc(&_rcache_hits);
+						_rcache->count(RD_ANSWER, _rcache_owner, RC_HIT);
 						return answer;
 					}
-					else
+					else if (answer)
 					{
-						RData::unref_rdata(cookie);
-						dlog("FATAL", "rope_append_external() failed");
+						xatomic_inc(&_stale_hits);
+						_rcache->count(RD_ANSWER, _rcache_owner, RC_STALE);
+						if (takeoff(rkey, &flight))
+						{
+							xatomic_inc(&_call_underway);
+							cb.reset(new XiServantCompletion(this, xic::WaiterPtr(), cr, rkey, debut, flight));
+							emit(quest, cb);
+						}
+						return answer;
 					}
 				}
 			}
+
+			_rcache->count(RD_ANSWER, _rcache_owner, RC_MISS);
+			if (xp_coalesce_max > 0 && coalesce(rkey, quest, current, cr, debut, &flight))
+				return xic::ASYNC_ANSWER;
 		}
 	
 	no_cache:
 		xatomic_inc(&_call_underway);
-		cb.reset(new XiServantCompletion(this, current.asynchronous(), cache, rkey, debut));
+		cb.reset(new XiServantCompletion(this, current.asynchronous(), cr, rkey, debut, flight));
+	}
+
+	emit(quest, cb);
+	return xic::ASYNC_ANSWER;
+}
+
+bool XiServant::takeoff(const RKey& rkey, uint64_t *flight)
+{
+	XMutex::Lock lock(_flight_mutex);
+	std::map<RKey, Flight>::iterator iter = _flights.find(rkey);
+	if (iter != _flights.end())
+		return false;
+
+	Flight& f = _flights[rkey];
+	f.id = ++_flight_seq;
+	*flight = f.id;
+	return true;
+}
+
+bool XiServant::coalesce(const RKey& rkey, const xic::QuestPtr& quest, const xic::Current& current, const CacheRule& cache, bool debut, uint64_t *flight)
+{
+	XMutex::Lock lock(_flight_mutex);
+	std::map<RKey, Flight>::iterator iter = _flights.find(rkey);
+	if (iter == _flights.end())
+	{
+		// This call is the leader.
+		Flight& f = _flights[rkey];
+		f.id = ++_flight_seq;
+		*flight = f.id;
+		return false;
+	}
+
+	Flight& f = iter->second;
+	if (f.followers.size() >= (size_t)xp_coalesce_max)
+	{
+		xatomic_inc(&_coalesce_overflows);
+		return false;
+	}
+
+	if (f.followers.empty())
+		_timer->addTask(new FlightTimeout(this, rkey, f.id), xp_coalesce_msec);
+
+	Follower fo;
+	fo.quest = quest;
+	fo.waiter = current.asynchronous();
+	fo.cache = cache;
+	fo.debut = debut;
+	f.followers.push_back(fo);
+	xatomic_inc(&_coalesced);
+	return true;
+}
+
+void XiServant::land(const RKey& rkey, uint64_t flight, std::vector<Follower>& followers)
+{
+	XMutex::Lock lock(_flight_mutex);
+	std::map<RKey, Flight>::iterator iter = _flights.find(rkey);
+	if (iter != _flights.end() && iter->second.id == flight)
+	{
+		followers.swap(iter->second.followers);
+		_flights.erase(iter);
+	}
+}
+
+void XiServant::flight_timeout(const RKey& rkey, uint64_t flight)
+{
+	std::vector<Follower> followers;
+	land(rkey, flight, followers);
+	if (followers.empty())
+		return;
+
+	xatomic_inc(&_coalesce_timeouts);
+	dlog("XP_COALESCE", "service=%s followers=%zd timeout=%d", _service.c_str(), followers.size(), xp_coalesce_msec);
+	for (size_t i = 0; i < followers.size(); ++i)
+	{
+		const Follower& fo = followers[i];
+		xatomic_inc(&_call_underway);
+		XiServantCompletionPtr cb(new XiServantCompletion(this, fo.waiter, fo.cache, rkey, fo.debut));
+		emit(fo.quest, cb);
 	}
+}
 
+void XiServant::emit(const xic::QuestPtr& quest, const XiServantCompletionPtr& cb)
+{
+	xic::Quest* q = quest.get();
 	if (_serviceChanged)
 		q->setService(_origin);
 
+	if (_balancer)
+	{
+		xic::ProxyPtr prx;
+		uint64_t probe;
+		size_t idx = _balancer->pick(prx, cb.get() != NULL, -1, &probe);
+		int delay = 0;
+		if (cb)
+		{
+			cb->setEndpoint(idx, probe);
+			if (cb->hedgeable())
+				delay = hedgeDelay(q->method(), cb->cache());
+			if (delay > 0)
+				cb->startHedge();
+		}
+
+		prx->emitQuest(quest, cb);
+		if (delay > 0)
+			_timer->addTask(new HedgeTimer(this, quest, cb), delay);
+		return;
+	}
+
 	time_t now = _engine->time();
 	if (_prx->loadBalance() == xic::Proxy::LB_NORMAL && now > _expire_time)
 	{
@@ -260,7 +622,147 @@ xic::AnswerPtr XiServant::process(const xic::QuestPtr& quest, const xic::Current
 	}
 
 	_prx->emitQuest(quest, cb);
-	return xic::ASYNC_ANSWER;
+}
+
+int XiServant::hedgeDelay(const xstr_t& method, const CacheRule& rule)
+{
+	if (xp_hedge_budget <= 0 || _balancer->size() < 2)
+		return 0;
+
+	XMutex::Lock lock(_hedge_mutex);
+	_hedge_credit += xp_hedge_budget;
+	if (_hedge_credit > HEDGE_CREDIT_MAX)
+		_hedge_credit = HEDGE_CREDIT_MAX;
+
+	if (rule.hedge > 0)
+		return rule.hedge;
+
+	std::map<std::string, Latency>::iterator iter = _latencies.find(make_string(method));
+	if (iter == _latencies.end() || iter->second.total < HEDGE_SAMPLES_MIN)
+		return 0;
+
+	// The p95 is interpolated in the bucket it falls in.
+	const Latency& lat = iter->second;
+	uint32_t rank = lat.total - lat.total / 20;
+	uint32_t sum = 0;
+	for (int i = 0; i < 32; ++i)
+	{
+		if (sum + lat.buckets[i] >= rank)
+		{
+			int64_t low = i ? (int64_t)1 << (i - 1) : 0;
+			int64_t usec = low + (((int64_t)1 << i) - low) * (rank - sum) / lat.buckets[i];
+			int msec = usec / 1000;
+			return msec > 0 ? msec : 1;
+		}
+		sum += lat.buckets[i];
+	}
+	return 0;
+}
+
+void XiServant::hedgeSample(const xstr_t& method, int64_t usec)
+{
+	// The bucket i is for the latency in [2**(i-1), 2**i) microseconds.
+	int i = 0;
+	while (usec > 0 && i < 31)
+	{
+		usec >>= 1;
+		++i;
+	}
+
+	XMutex::Lock lock(_hedge_mutex);
+	Latency& lat = _latencies[make_string(method)];
+	if (lat.total >= HEDGE_SAMPLES_MAX)
+	{
+		lat.total = 0;
+		for (int k = 0; k < 32; ++k)
+		{
+			lat.buckets[k] >>= 1;
+			lat.total += lat.buckets[k];
+		}
+	}
+	++lat.buckets[i];
+	++lat.total;
+}
+
+void XiServant::hedge(const xic::QuestPtr& quest, const XiServantCompletionPtr& first)
+{
+	if (first->answered())
+		return;
+
+	{
+		XMutex::Lock lock(_hedge_mutex);
+		if (_hedge_credit < 100)
+		{
+			xatomic_inc(&_hedges_denied);
+			return;
+		}
+		_hedge_credit -= 100;
+	}
+
+	// The quest is copied, the first one may still be in use.
+	xic::QuestPtr q = copy_quest(quest);
+	XiServantCompletionPtr cb(first->duplicate(false));
+	xic::ProxyPtr prx;
+	uint64_t probe;
+	size_t idx = _balancer->pick(prx, true, first->endpoint(), &probe);
+	cb->setEndpoint(idx, probe);
+	xatomic_inc(&_call_underway);
+	xatomic_inc(&_hedges_sent);
+	prx->emitQuest(q, cb);
+}
+
+bool XiServant::retry(const xic::QuestPtr& quest, const XiServantCompletionPtr& failed)
+{
+	if (_balancer->size() < 2)
+		return false;
+
+	if (!_balancer->takeRetry())
+	{
+		xatomic_inc(&_retries_denied);
+		return false;
+	}
+
+	xic::QuestPtr q = copy_quest(quest);
+	XiServantCompletionPtr cb(failed->duplicate(true));
+	xic::ProxyPtr prx;
+	uint64_t probe;
+	size_t idx = _balancer->pick(prx, true, failed->endpoint(), &probe);
+	cb->setEndpoint(idx, probe);
+	xatomic_inc(&_call_underway);
+	xatomic_inc(&_retries_sent);
+	prx->emitQuest(q, cb);
+	return true;
+}
+
+RKey XiServant::answerKey(const xstr_t& method, const vbs_dict_t *args) const
+{
+	xstr_t service = XSTR_CXX(_service);
+	const CacheRule *rule = _cache_policy.find(method);
+	if (rule && rule->canonical)
+	{
+		std::string canon;
+		vbs_canon_dict(args, rule->excludes, canon);
+		xstr_t xs = XSTR_CXX(canon);
+		return RKey(service, method, xs);
+	}
+	return RKey(service, method, args->_raw);
+}
+
+void XiServant::indexAnswer(const RKey& rkey, xic::Quest *quest)
+{
+	std::vector<RKey> indexes;
+	indexes.push_back(RCache::methodIndex(quest->service(), quest->method()));
+
+	// The tags are separated by commas.
+	xstr_t tags = quest->context().getXstr("CACHE_TAGS");
+	xstr_t tag;
+	while (xstr_delimit_char(&tags, ',', &tag))
+	{
+		xstr_trim(&tag);
+		if (tag.len)
+			indexes.push_back(RCache::tagIndex(quest->service(), tag));
+	}
+	_rcache->index(rkey, indexes);
 }
 
 void XiServant::call_end(const xstr_t& method, int usec, bool add)
@@ -288,6 +790,8 @@ void XiServant::getInfo(xic::VDictWriter& dw)
 
 	dw.kv("type", "external");
 	dw.kv("proxy", _prx->str());
+	if (_balancer)
+		_balancer->getInfo(dw);
 	dw.kv("age", _engine->time() - _start_time);
 	dw.kv("expire_time", xp_get_time_str(_expire_time, buf));
 	xic::ConnectionPtr con = _prx->getConnection();
@@ -301,8 +805,17 @@ void XiServant::getInfo(xic::VDictWriter& dw)
 	}
 	dw.kv("connection", buf);
 	dw.kv("num_rcache_hit", xatomic_get(&_rcache_hits));
+	dw.kv("num_rcache_stale_hit", xatomic_get(&_stale_hits));
 	dw.kv("num_call_total", xatomic_get(&_call_total));
 	dw.kv("num_call_underway", xatomic_get(&_call_underway));
+	dw.kv("num_call_coalesced", xatomic_get(&_coalesced));
+	dw.kv("num_coalesce_timeout", xatomic_get(&_coalesce_timeouts));
+	dw.kv("num_coalesce_overflow", xatomic_get(&_coalesce_overflows));
+	dw.kv("num_hedge_sent", xatomic_get(&_hedges_sent));
+	dw.kv("num_hedge_won", xatomic_get(&_hedges_won));
+	dw.kv("num_hedge_denied", xatomic_get(&_hedges_denied));
+	dw.kv("num_retry_sent", xatomic_get(&_retries_sent));
+	dw.kv("num_retry_denied", xatomic_get(&_retries_denied));
 
 	std::string last_method;
 	time_t last_time;
@@ -5,23 +5,85 @@
 #include "BigServant.h"
 #include "MyMethodTab.h"
 #include "RCache.h"
+#include "CachePolicy.h"
+#include "P2cBalancer.h"
+#include <vector>
+#include <map>
+
+class XiServantCompletion;
+typedef XPtr<XiServantCompletion> XiServantCompletionPtr;
 
 class XiServant: public RevServant, private XMutex
 {
+public:
+	/* A call waiting for the answer of the same cache miss */
+	struct Follower
+	{
+		xic::QuestPtr quest;
+		xic::WaiterPtr waiter;
+		CacheRule cache;
+		bool debut;
+	};
+
+private:
 	xic::ProxyPtr _prx;
+	P2cBalancerPtr _balancer;
 	BigServantPtr _bigServant;
 	RCachePtr _rcache;
 	XTimerPtr _timer;
 	xatomic_t _call_total;
 	xatomic_t _call_underway;
 	xatomic_t _rcache_hits;
+	xatomic_t _stale_hits;
+	int _rcache_part;
+	int _rcache_owner;
 	time_t _expire_time;
 	time_t _last_time;
 	int _last_usec;
 	std::string _last_method;
 	MyMethodTab* _mtab;
+	CachePolicy _cache_policy;
+
+	/* The pending upstream call of a cache miss, keyed by RKey */
+	struct Flight
+	{
+		uint64_t id;
+		std::vector<Follower> followers;
+	};
+	XMutex _flight_mutex;
+	std::map<RKey, Flight> _flights;
+	uint64_t _flight_seq;
+	xatomic_t _coalesced;
+	xatomic_t _coalesce_timeouts;
+	xatomic_t _coalesce_overflows;
+
+	/* The latency histogram of a method hedged at p95, in buckets of
+	 * power of 2 microseconds, halved when the total reaches a limit.
+	 */
+	struct Latency
+	{
+		uint32_t buckets[32];
+		uint32_t total;
+	};
+	XMutex _hedge_mutex;
+	std::map<std::string, Latency> _latencies;
+	int _hedge_credit;
+	xatomic_t _hedges_sent;
+	xatomic_t _hedges_won;
+	xatomic_t _hedges_denied;
+	xatomic_t _retries_sent;
+	xatomic_t _retries_denied;
+
+	/* msec to wait before hedging the call, 0 for no hedging */
+	int hedgeDelay(const xstr_t& method, const CacheRule& rule);
+
+	bool takeoff(const RKey& rkey, uint64_t *flight);
+	bool coalesce(const RKey& rkey, const xic::QuestPtr& quest, const xic::Current& current, const CacheRule& cache, bool debut, uint64_t *flight);
+	void emit(const xic::QuestPtr& quest, const XiServantCompletionPtr& cb);
 public:
-	XiServant(const xic::EnginePtr& engine, const std::string& identity, int revision, const xic::ProxyPtr& prx, BigServant* bigServant);
+	/* balancer is NULL unless the service has the option -lb:p2c */
+	XiServant(const xic::EnginePtr& engine, const std::string& identity, int revision, const xic::ProxyPtr& prx,
+		const P2cBalancerPtr& balancer, const std::string& cache_rules, BigServant* bigServant);
 	virtual ~XiServant();
 
 	virtual xic::AnswerPtr process(const xic::QuestPtr& quest, const xic::Current& current);
@@ -30,8 +92,36 @@ public:
 	void markProxyMethods(xic::AnswerWriter& aw, const xic::QuestPtr& quest);
 
 	void call_end(const xstr_t& method, int usec, bool add);
+
+	/* Take the followers of the flight, the flight is finished. */
+	void land(const RKey& rkey, uint64_t flight, std::vector<Follower>& followers);
+
+	/* The followers of the flight waited too long, let them call by themselves. */
+	void flight_timeout(const RKey& rkey, uint64_t flight);
+
+	/* The call is not answered in time, send a duplicate of it to
+	 * another endpoint if the hedge budget allows.
+	 */
+	void hedge(const xic::QuestPtr& quest, const XiServantCompletionPtr& first);
+	void hedgeSample(const xstr_t& method, int64_t usec);
+	void hedgeWon()				{ xatomic_inc(&_hedges_won); }
+
+	/* Retry the call failed on the connection on another endpoint,
+	 * return false if it is not allowed by the retry budget.
+	 */
+	bool retry(const xic::QuestPtr& quest, const XiServantCompletionPtr& failed);
+
 	const RCachePtr& rcache() const		{ return _rcache; }
+	int rcachePartition() const		{ return _rcache_part; }
+	int rcacheOwner() const			{ return _rcache_owner; }
 	const XTimerPtr& timer() const 		{ return _timer; }
+	const P2cBalancerPtr& balancer() const	{ return _balancer; }
+
+	/* The cache key of the answer, as the rule of the method says */
+	RKey answerKey(const xstr_t& method, const vbs_dict_t *args) const;
+
+	/* Index the cached answer by its method and the tags in CACHE_TAGS */
+	void indexAnswer(const RKey& rkey, xic::Quest *quest);
 };
 typedef XPtr<XiServant> XiServantPtr;
 
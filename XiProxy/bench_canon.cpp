@@ -0,0 +1,132 @@
+/* The cost of deriving the cache key from the canonical form of the
+ * args, as Canonical cache rules do, against hashing the raw args.
+ * The dicts have string keys and integer and string values, in the
+ * reverse order of the keys.
+ *	bench_canon [seconds_per_size]
+ */
+#include "VbsCanon.h"
+#include "hash128.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+struct Dict
+{
+	vbs_dict_t dict;
+	std::vector<vbs_ditem_t> items;
+	std::vector<std::string> strs;
+
+	Dict(size_t num)
+		: items(num), strs(num * 2)
+	{
+		memset(&dict, 0, sizeof(dict));
+		memset(&items[0], 0, sizeof(vbs_ditem_t) * num);
+		for (size_t i = 0; i < num; ++i)
+		{
+			char buf[64];
+			snprintf(buf, sizeof(buf), "arg%03zu", num - i);
+			strs[i * 2] = buf;
+			snprintf(buf, sizeof(buf), "value of arg%03zu", num - i);
+			strs[i * 2 + 1] = buf;
+
+			xstr_t key = XSTR_CXX(strs[i * 2]);
+			xstr_t value = XSTR_CXX(strs[i * 2 + 1]);
+			vbs_ditem_t& ent = items[i];
+			ent.key.kind = VBS_STRING;
+			ent.key.d_xstr = key;
+			if (i % 2)
+			{
+				ent.value.kind = VBS_STRING;
+				ent.value.d_xstr = value;
+			}
+			else
+			{
+				ent.value.kind = VBS_INTEGER;
+				ent.value.d_int = i * 1000;
+			}
+			ent.next = i + 1 < num ? &items[i + 1] : NULL;
+		}
+		dict.first = num ? &items[0] : NULL;
+		dict.last = num ? &items[num - 1].next : &dict.first;
+		dict.count = num;
+	}
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Return nanoseconds per key */
+static double run(const Dict& d, const std::vector<std::string> *excludes, double seconds, size_t *bytes, unsigned int *sink)
+{
+	std::string out;
+	unsigned char digest[16];
+	size_t num = 0;
+	double start = now();
+	double elapsed;
+	do {
+		for (int i = 0; i < 64; ++i)
+		{
+			out.clear();
+			vbs_canon_dict(&d.dict, excludes, out);
+			hash128_context ctx;
+			hash128_start(&ctx, 0);
+			hash128_update(&ctx, out.data(), out.length());
+			hash128_finish(&ctx, digest);
+			*sink += digest[0];
+		}
+		num += 64;
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+	*bytes = out.length();
+	return elapsed * 1e9 / num;
+}
+
+/* Hashing the same number of bytes, as the raw args are hashed without
+ * a Canonical rule.
+ */
+static double run_raw(size_t len, double seconds, unsigned int *sink)
+{
+	std::string raw(len, 'x');
+	unsigned char digest[16];
+	size_t num = 0;
+	double start = now();
+	double elapsed;
+	do {
+		for (int i = 0; i < 64; ++i)
+		{
+			hash128_context ctx;
+			hash128_start(&ctx, 0);
+			hash128_update(&ctx, raw.data(), raw.length());
+			hash128_finish(&ctx, digest);
+			*sink += digest[0];
+		}
+		num += 64;
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+	return elapsed * 1e9 / num;
+}
+
+int main(int argc, char **argv)
+{
+	double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+	std::vector<std::string> excludes;
+	excludes.push_back("arg001");
+
+	unsigned int sink = 0;
+	printf("%6s %8s %10s %12s %14s\n", "items", "bytes", "raw_ns", "canon_ns", "canon_excl_ns");
+	for (size_t num = 1; num <= 256; num *= 4)
+	{
+		Dict d(num);
+		size_t bytes, dummy;
+		double c = run(d, NULL, seconds, &bytes, &sink);
+		double e = run(d, &excludes, seconds, &dummy, &sink);
+		double r = run_raw(bytes, seconds, &sink);
+		printf("%6zu %8zu %10.1f %12.1f %14.1f\n", num, bytes, r, c, e);
+	}
+	return sink == 0xdeadbeef;
+}
@@ -0,0 +1,87 @@
+/* The cost of deriving the cache key of an answer, with hash128 as RKey
+ * does now and with SHA-1 as it did before, for args of 16 B to 64 KB.
+ *	bench_hash128 [seconds_per_size]
+ */
+#include "hash128.h"
+#include "xslib/sha1.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static const char service[] = "UserService";
+static const char method[] = "getProfile";
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void key_hash128(const unsigned char *args, size_t len, unsigned char digest[16])
+{
+	hash128_context ctx;
+	uint32_t type = 0;
+	hash128_start(&ctx, 0);
+	hash128_update(&ctx, &type, sizeof(type));
+	hash128_update(&ctx, service, sizeof(service) - 1);
+	hash128_update(&ctx, method, sizeof(method) - 1);
+	hash128_update(&ctx, args, len);
+	hash128_finish(&ctx, digest);
+}
+
+static void key_sha1(const unsigned char *args, size_t len, unsigned char digest[20])
+{
+	sha1_context ctx;
+	uint32_t type = 0;
+	sha1_start(&ctx);
+	sha1_update(&ctx, &type, sizeof(type));
+	sha1_update(&ctx, service, sizeof(service) - 1);
+	sha1_update(&ctx, method, sizeof(method) - 1);
+	sha1_update(&ctx, args, len);
+	sha1_finish(&ctx, digest);
+}
+
+/* Return nanoseconds per key */
+static double run(bool sha1, const unsigned char *args, size_t len, double seconds, unsigned int *sink)
+{
+	unsigned char digest[20];
+	size_t num = 0;
+	double start = now();
+	double elapsed;
+	do {
+		for (int i = 0; i < 64; ++i)
+		{
+			if (sha1)
+				key_sha1(args, len, digest);
+			else
+				key_hash128(args, len, digest);
+			*sink += digest[0];
+		}
+		num += 64;
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+	return elapsed * 1e9 / num;
+}
+
+int main(int argc, char **argv)
+{
+	double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+	size_t max = 64 * 1024;
+	unsigned char *args = (unsigned char *)malloc(max);
+	for (size_t i = 0; i < max; ++i)
+		args[i] = (unsigned char)random();
+
+	unsigned int sink = 0;
+	printf("%8s %12s %12s %8s\n", "args", "sha1_ns", "hash128_ns", "speedup");
+	for (size_t len = 16; len <= max; len *= 4)
+	{
+		double s = run(true, args, len, seconds, &sink);
+		double h = run(false, args, len, seconds, &sink);
+		printf("%8zu %12.1f %12.1f %7.1fx\n", len, s, h, s / h);
+	}
+
+	free(args);
+	return sink == 0xdeadbeef;
+}
@@ -0,0 +1,112 @@
+/* Hit ratio of the LRU and TinyLFU policies of RCache, replaying
+ * synthetic traces: Zipf accesses, and Zipf accesses interrupted by
+ * scans of keys never seen again.
+ *	bench_policy [cache_items] [accesses]
+ */
+#include "RCache.h"
+#include "xslib/Setting.h"
+#include "xslib/rdtsc.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#define NUM_KEY		(1024*1024)
+
+class Zipf
+{
+	std::vector<double> _cdf;
+public:
+	Zipf(size_t n, double s)
+	{
+		_cdf.resize(n);
+		double sum = 0;
+		for (size_t i = 0; i < n; ++i)
+		{
+			sum += 1.0 / pow(i + 1, s);
+			_cdf[i] = sum;
+		}
+		for (size_t i = 0; i < n; ++i)
+			_cdf[i] /= sum;
+	}
+
+	size_t next(unsigned int *seed) const
+	{
+		double u = rand_r(seed) / (RAND_MAX + 1.0);
+		return std::lower_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin();
+	}
+};
+
+/* The keys of the scans are above NUM_KEY, none of them is repeated.
+ * scan_every is 0 for no scan.
+ */
+static void make_trace(const Zipf& zipf, size_t num, size_t scan_every, size_t scan_len, std::vector<size_t>& trace)
+{
+	unsigned int seed = 1;
+	size_t cold = NUM_KEY;
+	trace.clear();
+	while (trace.size() < num)
+	{
+		if (scan_every && trace.size() % scan_every == 0)
+		{
+			for (size_t i = 0; i < scan_len; ++i)
+				trace.push_back(cold++);
+		}
+		trace.push_back(zipf.next(&seed));
+	}
+}
+
+static double hit_ratio(const char *policy, size_t items, const std::vector<size_t>& trace)
+{
+	char buf[32];
+	SettingPtr setting = newSetting();
+	snprintf(buf, sizeof(buf), "%zu", items);
+	setting->insert("XiProxy.Cache.NumberMax", buf);
+	setting->insert("XiProxy.Cache.Policy", policy);
+	RCachePtr cache(new RCache(setting));
+
+	char data[64] = { 0 };
+	xstr_t xs = XSTR_INIT((unsigned char *)data, sizeof(data));
+	size_t hits = 0;
+	for (size_t i = 0; i < trace.size(); ++i)
+	{
+		int len = snprintf(buf, sizeof(buf), "key-%zu", trace[i]);
+		RKey key(RD_ANSWER, buf, len);
+		if (cache->use(key))
+			++hits;
+		else
+			cache->replace(key, RData(rdtsc(), RD_ANSWER, xs));
+	}
+	return 100.0 * hits / trace.size();
+}
+
+int main(int argc, char **argv)
+{
+	size_t items = argc > 1 ? atoi(argv[1]) : 16*1024;
+	size_t num = argc > 2 ? atoi(argv[2]) : 2*1024*1024;
+
+	struct {
+		const char *name;
+		double s;
+		size_t scan_every;
+		size_t scan_len;
+	} traces[] = {
+		{ "zipf-0.8", 0.8, 0, 0 },
+		{ "zipf-1.0", 1.0, 0, 0 },
+		{ "zipf-0.8+scan", 0.8, 100000, 50000 },
+		{ "zipf-1.0+scan", 1.0, 100000, 50000 },
+	};
+
+	printf("items=%zu accesses=%zu keys=%d\n", items, num, NUM_KEY);
+	printf("%-16s %8s %8s\n", "trace", "lru%", "tinylfu%");
+	std::vector<size_t> trace;
+	for (size_t i = 0; i < sizeof(traces) / sizeof(traces[0]); ++i)
+	{
+		Zipf zipf(NUM_KEY, traces[i].s);
+		make_trace(zipf, num, traces[i].scan_every, traces[i].scan_len, trace);
+		double lru = hit_ratio("lru", items, trace);
+		double lfu = hit_ratio("tinylfu", items, trace);
+		printf("%-16s %8.2f %8.2f\n", traces[i].name, lru, lfu);
+	}
+	return 0;
+}
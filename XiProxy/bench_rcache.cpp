@@ -0,0 +1,117 @@
+/* Contention of RCache lookups by the number of shards.
+ * Each thread looks up random keys of a full cache, replacing one in
+ * ten of them, as the cached answers of XiServant are used.
+ *	bench_rcache [threads] [seconds]
+ */
+#include "RCache.h"
+#include "xslib/Setting.h"
+#include "xslib/rdtsc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define NUM_KEY		(64*1024)
+#define THREAD_MAX	64
+
+struct Worker
+{
+	pthread_t thr;
+	RCache *cache;
+	const std::vector<RKey> *keys;
+	double seconds;
+	unsigned int seed;
+	uint64_t ops;
+	uint64_t hits;
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *work(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	const std::vector<RKey>& keys = *w->keys;
+	char buf[100] = { 0 };
+	xstr_t xs = XSTR_INIT((unsigned char *)buf, sizeof(buf));
+	double stop = now() + w->seconds;
+	do {
+		for (int i = 0; i < 1024; ++i)
+		{
+			const RKey& key = keys[rand_r(&w->seed) % keys.size()];
+			if (i % 10 == 0)
+			{
+				w->cache->replace(key, RData(rdtsc(), RD_ANSWER, xs));
+			}
+			else if (w->cache->use(key))
+			{
+				++w->hits;
+			}
+		}
+		w->ops += 1024;
+	} while (now() < stop);
+	return NULL;
+}
+
+static double run(int shards, int threads, double seconds, const std::vector<RKey>& keys)
+{
+	char buf[32];
+	SettingPtr setting = newSetting();
+	snprintf(buf, sizeof(buf), "%d", NUM_KEY);
+	setting->insert("XiProxy.Cache.NumberMax", buf);
+	snprintf(buf, sizeof(buf), "%d", shards);
+	setting->insert("XiProxy.Cache.Shards", buf);
+	RCachePtr cache(new RCache(setting));
+
+	char data[100] = { 0 };
+	xstr_t xs = XSTR_INIT((unsigned char *)data, sizeof(data));
+	for (size_t i = 0; i < keys.size(); ++i)
+		cache->replace(keys[i], RData(rdtsc(), RD_ANSWER, xs));
+
+	Worker workers[THREAD_MAX];
+	for (int i = 0; i < threads; ++i)
+	{
+		Worker& w = workers[i];
+		w.cache = cache.get();
+		w.keys = &keys;
+		w.seconds = seconds;
+		w.seed = i + 1;
+		w.ops = 0;
+		w.hits = 0;
+		pthread_create(&w.thr, NULL, work, &w);
+	}
+
+	uint64_t ops = 0;
+	for (int i = 0; i < threads; ++i)
+	{
+		pthread_join(workers[i].thr, NULL);
+		ops += workers[i].ops;
+	}
+	return ops / seconds;
+}
+
+int main(int argc, char **argv)
+{
+	int threads = argc > 1 ? atoi(argv[1]) : 8;
+	double seconds = argc > 2 ? atof(argv[2]) : 2;
+	if (threads < 1 || threads > THREAD_MAX)
+		threads = 8;
+
+	std::vector<RKey> keys;
+	for (int i = 0; i < NUM_KEY; ++i)
+	{
+		char name[32];
+		int len = snprintf(name, sizeof(name), "key-%d", i);
+		keys.push_back(RKey(RD_ANSWER, name, len));
+	}
+
+	printf("threads=%d keys=%d\n", threads, NUM_KEY);
+	printf("%8s %14s\n", "shards", "ops/s");
+	for (int shards = 1; shards <= 64; shards *= 4)
+		printf("%8d %14.0f\n", shards, run(shards, threads, seconds, keys));
+	return 0;
+}
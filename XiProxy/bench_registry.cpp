@@ -0,0 +1,188 @@
+/* Lookups of the servants in the ServantRegistry against a std::map
+ * under a mutex, as BigServant did before, by the number of threads,
+ * with and without a writer inserting a servant every millisecond.
+ *	bench_registry [max_threads] [seconds]
+ */
+#include "ServantRegistry.h"
+#include "xic/Engine.h"
+#include "xslib/Setting.h"
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define NUM_SERVICE	200
+#define THREAD_MAX	64
+
+/* RevServant::getInfo() uses it, it is in XiProxy.cpp */
+char *xp_get_time_str(time_t t, char *buf)
+{
+	sprintf(buf, "%ld", (long)t);
+	return buf;
+}
+
+class NullServant: public RevServant
+{
+public:
+	NullServant(const xic::EnginePtr& engine, const std::string& service, int revision)
+		: RevServant(engine, service, revision)
+	{
+	}
+
+	virtual xic::AnswerPtr process(const xic::QuestPtr& quest, const xic::Current& current)
+	{
+		throw XERROR_MSG(xic::ServiceNotFoundException, service());
+	}
+};
+
+struct ServantMap: public XMutex
+{
+	std::map<std::string, RevServantPtr> map;
+};
+
+static xic::EnginePtr the_engine;
+static std::vector<std::string> names;
+static ServantRegistry *registry;
+static ServantMap *servants;
+static double seconds;
+static volatile bool writer_stop;
+
+struct Worker
+{
+	pthread_t thr;
+	bool map;
+	unsigned int seed;
+	uint64_t ops;
+	uint64_t found;
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *work(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	double stop = now() + seconds;
+	do {
+		for (int i = 0; i < 1024; ++i)
+		{
+			const std::string& name = names[rand_r(&w->seed) % names.size()];
+			if (w->map)
+			{
+				XMutex::Lock lock(*servants);
+				if (servants->map.find(name) != servants->map.end())
+					++w->found;
+			}
+			else
+			{
+				xstr_t xs = XSTR_CXX(name);
+				if (registry->find(xs))
+					++w->found;
+			}
+		}
+		w->ops += 1024;
+	} while (now() < stop);
+	return NULL;
+}
+
+static void *insert_loop(void *arg)
+{
+	bool map = *(bool *)arg;
+	for (size_t i = 0; !writer_stop; ++i)
+	{
+		const std::string& name = names[i % names.size()];
+		RevServantPtr srv(new NullServant(the_engine, name, i));
+		if (map)
+		{
+			XMutex::Lock lock(*servants);
+			servants->map[name] = srv;
+		}
+		else
+		{
+			registry->insert(name, srv);
+		}
+		usleep(1000);
+	}
+	return NULL;
+}
+
+static double run(bool map, bool writer, int threads)
+{
+	pthread_t wthr;
+	writer_stop = false;
+	if (writer)
+		pthread_create(&wthr, NULL, insert_loop, &map);
+
+	Worker workers[THREAD_MAX];
+	for (int i = 0; i < threads; ++i)
+	{
+		Worker& w = workers[i];
+		w.map = map;
+		w.seed = i + 1;
+		w.ops = 0;
+		w.found = 0;
+		pthread_create(&w.thr, NULL, work, &w);
+	}
+
+	uint64_t ops = 0;
+	for (int i = 0; i < threads; ++i)
+	{
+		pthread_join(workers[i].thr, NULL);
+		ops += workers[i].ops;
+	}
+
+	writer_stop = true;
+	if (writer)
+		pthread_join(wthr, NULL);
+	return ops / seconds;
+}
+
+static int bench(int argc, char **argv, const xic::EnginePtr& engine)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	seconds = argc > 2 ? atof(argv[2]) : 1;
+	if (max_threads < 1 || max_threads > THREAD_MAX)
+		max_threads = 8;
+
+	the_engine = engine;
+	registry = new ServantRegistry();
+	servants = new ServantMap();
+	for (int i = 0; i < NUM_SERVICE; ++i)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "Service%d", i);
+		names.push_back(name);
+		RevServantPtr srv(new NullServant(engine, name, 0));
+		registry->insert(name, srv);
+		servants->map[name] = srv;
+	}
+
+	printf("services=%d\n", NUM_SERVICE);
+	printf("%8s %8s %14s %14s\n", "threads", "writer", "map_ops/s", "registry_ops/s");
+	for (int writer = 0; writer < 2; ++writer)
+	{
+		for (int threads = 1; threads <= max_threads; threads *= 2)
+		{
+			double m = run(true, writer, threads);
+			double r = run(false, writer, threads);
+			printf("%8d %8s %14.0f %14.0f\n", threads, writer ? "yes" : "no", m, r);
+		}
+	}
+
+	delete servants;
+	delete registry;
+	the_engine.reset();
+	engine->shutdown();
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	SettingPtr setting = newSetting();
+	return xic::start_xic_pt(bench, argc, argv, setting);
+}
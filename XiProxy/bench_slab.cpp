@@ -0,0 +1,125 @@
+/* The cost of slab_alloc()/slab_free() against malloc()/free().
+ * Each thread keeps a window of live blocks of random sizes and frees
+ * the oldest one for every new one, as the cache replaces its items.
+ *	bench_slab [threads] [seconds]
+ */
+#include "SlabAlloc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define WINDOW		4096
+#define THREAD_MAX	64
+
+struct Block
+{
+	void *ptr;
+	uint8_t cls;
+};
+
+struct Worker
+{
+	pthread_t thr;
+	bool slab;
+	size_t max;
+	double seconds;
+	unsigned int seed;
+	uint64_t ops;
+	Block blocks[WINDOW];
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *work(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	memset(w->blocks, 0, sizeof(w->blocks));
+	double stop = now() + w->seconds;
+	size_t k = 0;
+	do {
+		for (int i = 0; i < 1024; ++i)
+		{
+			Block& b = w->blocks[k++ % WINDOW];
+			size_t size = 16 + rand_r(&w->seed) % w->max;
+			if (w->slab)
+			{
+				if (b.ptr)
+					slab_free(b.ptr, b.cls);
+				b.ptr = slab_alloc(size, &b.cls);
+			}
+			else
+			{
+				free(b.ptr);
+				b.ptr = malloc(size);
+			}
+			*(char *)b.ptr = 0;
+		}
+		w->ops += 1024;
+	} while (now() < stop);
+
+	for (int i = 0; i < WINDOW; ++i)
+	{
+		Block& b = w->blocks[i];
+		if (w->slab)
+			slab_free(b.ptr, b.cls);
+		else
+			free(b.ptr);
+	}
+	return NULL;
+}
+
+static double run(bool slab, size_t max, int threads, double seconds)
+{
+	Worker *workers = new Worker[threads];
+	for (int i = 0; i < threads; ++i)
+	{
+		Worker& w = workers[i];
+		w.slab = slab;
+		w.max = max;
+		w.seconds = seconds;
+		w.seed = i + 1;
+		w.ops = 0;
+		pthread_create(&w.thr, NULL, work, &w);
+	}
+
+	uint64_t ops = 0;
+	for (int i = 0; i < threads; ++i)
+	{
+		pthread_join(workers[i].thr, NULL);
+		ops += workers[i].ops;
+	}
+	delete[] workers;
+	return ops / seconds;
+}
+
+int main(int argc, char **argv)
+{
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	double seconds = argc > 2 ? atof(argv[2]) : 1;
+	if (threads < 1 || threads > THREAD_MAX)
+		threads = 4;
+
+	printf("threads=%d window=%d\n", threads, WINDOW);
+	printf("%8s %14s %14s\n", "size_max", "malloc_ops/s", "slab_ops/s");
+	for (size_t max = 256; max <= SLAB_SIZE_MAX; max *= 4)
+	{
+		double m = run(false, max, threads, seconds);
+		double s = run(true, max, threads, seconds);
+		printf("%8zu %14.0f %14.0f\n", max, m, s);
+	}
+
+	SlabClassStats st[SLAB_CLASS_NUM + 1];
+	size_t reserved = 0;
+	slab_stats(st);
+	for (int i = 0; i <= SLAB_CLASS_NUM; ++i)
+		reserved += st[i].reserved;
+	printf("slab reserved %zu bytes\n", reserved);
+	return 0;
+}
@@ -0,0 +1,77 @@
+/* Time of saving a full RCache to the snapshot file and of restoring it
+ * into a new cache, as done at exit and at start of XiProxy.
+ *	bench_snapshot [items] [data size]
+ */
+#include "RCache.h"
+#include "xslib/Setting.h"
+#include "xslib/rdtsc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static char snapshot_file[64];
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static RCachePtr new_cache(int num)
+{
+	char buf[32];
+	SettingPtr setting = newSetting();
+	setting->insert("XiProxy.Cache.SnapshotFile", snapshot_file);
+	snprintf(buf, sizeof(buf), "%d", num);
+	setting->insert("XiProxy.Cache.NumberMax", buf);
+	setting->insert("XiProxy.Cache.ExpireMax", "3600");
+	return RCachePtr(new RCache(setting));
+}
+
+int main(int argc, char **argv)
+{
+	int num = argc > 1 ? atoi(argv[1]) : 64*1024;
+	int size = argc > 2 ? atoi(argv[2]) : 100;
+	if (num <= 0 || size <= 0)
+	{
+		fprintf(stderr, "Usage: %s [items] [data size]\n", argv[0]);
+		return 1;
+	}
+	snprintf(snapshot_file, sizeof(snapshot_file), "/tmp/bench_snapshot.%d", (int)getpid());
+
+	RCachePtr cache = new_cache(num);
+	std::string data(size, 'x');
+	for (int i = 0; i < num; ++i)
+	{
+		char buf[32];
+		int len = snprintf(buf, sizeof(buf), "key-%d", i);
+		xstr_t xs = XSTR_CXX(data);
+		cache->replace(RKey(RD_ANSWER, buf, len), RData(rdtsc(), RD_ANSWER, xs));
+	}
+
+	double start = now();
+	ssize_t saved = cache->save();
+	double save_time = now() - start;
+
+	struct stat st;
+	if (saved < 0 || stat(snapshot_file, &st) < 0)
+	{
+		fprintf(stderr, "save() failed\n");
+		unlink(snapshot_file);
+		return 1;
+	}
+
+	RCachePtr restored = new_cache(num);
+	start = now();
+	ssize_t loaded = restored->restore();
+	double restore_time = now() - start;
+	unlink(snapshot_file);
+
+	printf("items=%zd/%zd bytes=%lld\n", loaded, saved, (long long)st.st_size);
+	printf("save    %8.1f ms\n", save_time * 1000);
+	printf("restore %8.1f ms  %.0f items/s\n", restore_time * 1000, loaded / restore_time);
+	return loaded == saved ? 0 : 1;
+}
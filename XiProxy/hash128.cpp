@@ -0,0 +1,146 @@
+#include "hash128.h"
+#include <string.h>
+
+#define C1	0x87c37b91114253d5ULL
+#define C2	0x4cf5ad432745937fULL
+
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/* The blocks are read and the digest is written in little endian, so
+ * the digests kept in the snapshot file and sent to the peers are the
+ * same on any host.
+ */
+static inline uint64_t get64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline void put64(unsigned char *p, uint64_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void mix_block(uint64_t& h1, uint64_t& h2, const unsigned char *p)
+{
+	uint64_t k1 = get64(p);
+	uint64_t k2 = get64(p + 8);
+
+	k1 *= C1; k1 = rotl64(k1, 31); k1 *= C2; h1 ^= k1;
+	h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+	k2 *= C2; k2 = rotl64(k2, 33); k2 *= C1; h2 ^= k2;
+	h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+}
+
+void hash128_start(hash128_context *ctx, uint64_t seed)
+{
+	ctx->h1 = seed;
+	ctx->h2 = seed;
+	ctx->total = 0;
+	ctx->buflen = 0;
+}
+
+void hash128_update(hash128_context *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint64_t h1 = ctx->h1;
+	uint64_t h2 = ctx->h2;
+
+	ctx->total += len;
+	if (ctx->buflen)
+	{
+		size_t n = 16 - ctx->buflen;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buflen, p, n);
+		ctx->buflen += n;
+		p += n;
+		len -= n;
+		if (ctx->buflen < 16)
+			return;
+		mix_block(h1, h2, ctx->buf);
+		ctx->buflen = 0;
+	}
+
+	for (; len >= 16; p += 16, len -= 16)
+	{
+		mix_block(h1, h2, p);
+	}
+
+	if (len)
+	{
+		memcpy(ctx->buf, p, len);
+		ctx->buflen = len;
+	}
+
+	ctx->h1 = h1;
+	ctx->h2 = h2;
+}
+
+void hash128_finish(hash128_context *ctx, unsigned char digest[16])
+{
+	uint64_t h1 = ctx->h1;
+	uint64_t h2 = ctx->h2;
+	const unsigned char *tail = ctx->buf;
+	uint64_t k1 = 0;
+	uint64_t k2 = 0;
+
+	switch (ctx->buflen)
+	{
+	case 15: k2 ^= (uint64_t)tail[14] << 48;
+	case 14: k2 ^= (uint64_t)tail[13] << 40;
+	case 13: k2 ^= (uint64_t)tail[12] << 32;
+	case 12: k2 ^= (uint64_t)tail[11] << 24;
+	case 11: k2 ^= (uint64_t)tail[10] << 16;
+	case 10: k2 ^= (uint64_t)tail[ 9] << 8;
+	case  9: k2 ^= (uint64_t)tail[ 8] << 0;
+		k2 *= C2; k2 = rotl64(k2, 33); k2 *= C1; h2 ^= k2;
+
+	case  8: k1 ^= (uint64_t)tail[ 7] << 56;
+	case  7: k1 ^= (uint64_t)tail[ 6] << 48;
+	case  6: k1 ^= (uint64_t)tail[ 5] << 40;
+	case  5: k1 ^= (uint64_t)tail[ 4] << 32;
+	case  4: k1 ^= (uint64_t)tail[ 3] << 24;
+	case  3: k1 ^= (uint64_t)tail[ 2] << 16;
+	case  2: k1 ^= (uint64_t)tail[ 1] << 8;
+	case  1: k1 ^= (uint64_t)tail[ 0] << 0;
+		k1 *= C1; k1 = rotl64(k1, 31); k1 *= C2; h1 ^= k1;
+	}
+
+	h1 ^= ctx->total;
+	h2 ^= ctx->total;
+
+	h1 += h2;
+	h2 += h1;
+
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	put64(digest, h1);
+	put64(digest + 8, h2);
+}
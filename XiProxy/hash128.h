@@ -0,0 +1,29 @@
+#ifndef hash128_h_
+#define hash128_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming MurmurHash3 x64_128.
+ * Not cryptographic, only for identifying the cache items.
+ * The result is the same however the data is split into updates.
+ */
+
+struct hash128_context
+{
+	uint64_t h1;
+	uint64_t h2;
+	uint64_t total;
+	size_t buflen;
+	unsigned char buf[16];
+};
+
+
+void hash128_start(hash128_context *ctx, uint64_t seed);
+
+void hash128_update(hash128_context *ctx, const void *data, size_t len);
+
+void hash128_finish(hash128_context *ctx, unsigned char digest[16]);
+
+
+#endif
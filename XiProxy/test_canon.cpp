@@ -0,0 +1,185 @@
+/* The canonical form of the args is the same for the same content in
+ * any order, and differs for any other content, in particular for the
+ * scalars whose VBS bytes look like the framing of the containers.
+ * The args are written in a small notation: {key:value,...} [value,...]
+ * integers and 'strings'.
+ */
+#include "VbsCanon.h"
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failed;
+
+class Parser
+{
+	std::deque<std::string> _strs;
+	std::deque<vbs_list_t> _lists;
+	std::deque<vbs_dict_t> _dicts;
+	std::deque<vbs_litem_t> _litems;
+	std::deque<vbs_ditem_t> _ditems;
+	const char *_p;
+
+	xstr_t str(const char *start, size_t len)
+	{
+		_strs.push_back(std::string(start, len));
+		xstr_t xs = XSTR_CXX(_strs.back());
+		return xs;
+	}
+
+	void value(vbs_data_t *d)
+	{
+		memset(d, 0, sizeof(*d));
+		if (*_p == '[')
+		{
+			_lists.push_back(vbs_list_t());
+			vbs_list_t *ls = &_lists.back();
+			memset(ls, 0, sizeof(*ls));
+			ls->last = &ls->first;
+			for (++_p; *_p != ']'; )
+			{
+				_litems.push_back(vbs_litem_t());
+				vbs_litem_t *ent = &_litems.back();
+				memset(ent, 0, sizeof(*ent));
+				value(&ent->value);
+				*ls->last = ent;
+				ls->last = &ent->next;
+				++ls->count;
+				if (*_p == ',')
+					++_p;
+			}
+			++_p;
+			d->kind = VBS_LIST;
+			d->d_list = ls;
+		}
+		else if (*_p == '{')
+		{
+			d->kind = VBS_DICT;
+			d->d_dict = dict();
+		}
+		else if (*_p == '\'')
+		{
+			const char *end = strchr(++_p, '\'');
+			d->kind = VBS_STRING;
+			d->d_xstr = str(_p, end - _p);
+			_p = end + 1;
+		}
+		else
+		{
+			char *end;
+			d->kind = VBS_INTEGER;
+			d->d_int = strtol(_p, &end, 10);
+			_p = end;
+		}
+	}
+
+	vbs_dict_t *dict()
+	{
+		_dicts.push_back(vbs_dict_t());
+		vbs_dict_t *dt = &_dicts.back();
+		memset(dt, 0, sizeof(*dt));
+		dt->last = &dt->first;
+		for (++_p; *_p != '}'; )
+		{
+			_ditems.push_back(vbs_ditem_t());
+			vbs_ditem_t *ent = &_ditems.back();
+			memset(ent, 0, sizeof(*ent));
+			const char *colon = strchr(_p, ':');
+			ent->key.kind = VBS_STRING;
+			ent->key.d_xstr = str(_p, colon - _p);
+			_p = colon + 1;
+			value(&ent->value);
+			*dt->last = ent;
+			dt->last = &ent->next;
+			++dt->count;
+			if (*_p == ',')
+				++_p;
+		}
+		++_p;
+		return dt;
+	}
+
+public:
+	std::string canon(const char *args, const std::vector<std::string> *excludes = NULL)
+	{
+		_p = args;
+		std::string out;
+		vbs_canon_dict(dict(), excludes, out);
+		return out;
+	}
+};
+
+static void check(const char *a, const char *b, bool same)
+{
+	Parser parser;
+	if ((parser.canon(a) == parser.canon(b)) != same)
+	{
+		printf("FAIL %s and %s should %s\n", a, b, same ? "be the same" : "differ");
+		++failed;
+	}
+}
+
+struct Case
+{
+	const char *a;
+	const char *b;
+	bool same;
+};
+
+static const Case cases[] = {
+	{ "{a:1,b:'x'}", "{b:'x',a:1}", true },
+	{ "{a:{x:1,y:[2,3]}}", "{a:{y:[2,3],x:1}}", true },
+	{ "{a:[[]]}", "{a:[27,29]}", false },
+	{ "{a:[{}]}", "{a:[-27,-29]}", false },
+	{ "{a:[[],[]]}", "{a:[[[]]]}", false },
+	{ "{a:[[1],[2]]}", "{a:[[1,2]]}", false },
+	{ "{a:[1,2]}", "{a:[2,1]}", false },
+	{ "{a:[]}", "{a:{}}", false },
+	{ "{a:1}", "{a:'1'}", false },
+	{ "{a:{b:1}}", "{a:{b:1},c:[]}", false },
+};
+
+/* Two integers in a list against every container shape of two levels */
+static void small_integers()
+{
+	static const char *shapes[] = {
+		"{a:[]}", "{a:{}}", "{a:[[]]}", "{a:[{}]}", "{a:[[],[]]}", "{a:[{},{}]}",
+		"{a:[[],{}]}", "{a:[{},[]]}",
+	};
+
+	for (int i = -64; i <= 64; ++i)
+	{
+		for (int j = -64; j <= 64; ++j)
+		{
+			char args[64];
+			snprintf(args, sizeof(args), "{a:[%d,%d]}", i, j);
+			for (size_t k = 0; k < sizeof(shapes) / sizeof(shapes[0]); ++k)
+				check(args, shapes[k], false);
+		}
+	}
+}
+
+static void excludes()
+{
+	std::vector<std::string> excludes;
+	excludes.push_back("b");
+	Parser parser;
+	if (parser.canon("{a:1,b:2}", &excludes) != parser.canon("{a:1}")
+		|| parser.canon("{a:1,b:2}", &excludes) != parser.canon("{b:3,a:1}", &excludes))
+	{
+		printf("FAIL excludes\n");
+		++failed;
+	}
+}
+
+int main()
+{
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+		check(cases[i].a, cases[i].b, cases[i].same);
+	small_integers();
+	excludes();
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
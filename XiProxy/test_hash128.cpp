@@ -0,0 +1,118 @@
+/* Known answer test of hash128 against the reference MurmurHash3_x64_128.
+ */
+#include "hash128.h"
+#include <stdio.h>
+#include <string.h>
+
+struct Vector
+{
+	const char *data;
+	uint64_t seed;
+	const char *digest;
+};
+
+/* From the reference implementation, digest bytes in the order h1, h2,
+ * each in little endian.
+ */
+static const Vector vectors[] = {
+	{ "", 0, "00000000000000000000000000000000" },
+	{ "hello", 0, "029bbd41b3a7d8cb191dae486a901e5b" },
+	{ "The quick brown fox jumps over the lazy dog", 0, "6c1b07bc7bbc4be347939ac4a93c437a" },
+	{ "The quick brown fox jumps over the lazy dog", 42, "d7d50bfe93cf0d748f5c70ecf46c54c4" },
+};
+
+static void hash(const void *data, size_t len, uint64_t seed, unsigned char digest[16])
+{
+	hash128_context ctx;
+	hash128_start(&ctx, seed);
+	hash128_update(&ctx, data, len);
+	hash128_finish(&ctx, digest);
+}
+
+static void to_hex(const unsigned char digest[16], char hex[33])
+{
+	for (int i = 0; i < 16; ++i)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+/* The verification of SMHasher: the keys {}, {0}, {0,1} ... {0..254}
+ * are hashed with the seed 256 - len, and the 256 digests are hashed
+ * with the seed 0. The first 4 bytes in little endian are 0x6384BA69
+ * for MurmurHash3_x64_128.
+ */
+static bool verification()
+{
+	unsigned char key[256];
+	unsigned char digests[256 * 16];
+	for (int i = 0; i < 256; ++i)
+	{
+		key[i] = (unsigned char)i;
+		hash(key, i, 256 - i, &digests[i * 16]);
+	}
+
+	unsigned char final[16];
+	hash(digests, sizeof(digests), 0, final);
+	uint32_t v = final[0] | (final[1] << 8) | (final[2] << 16) | ((uint32_t)final[3] << 24);
+	if (v != 0x6384BA69)
+	{
+		printf("FAIL verification 0x%08X != 0x6384BA69\n", v);
+		return false;
+	}
+	return true;
+}
+
+/* The digest is the same however the data is split into updates */
+static bool streaming()
+{
+	unsigned char data[1000];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = (unsigned char)(i * 131 + 7);
+
+	for (size_t len = 0; len <= sizeof(data); len += 37)
+	{
+		unsigned char whole[16];
+		hash(data, len, len, whole);
+		for (size_t step = 1; step <= 33; ++step)
+		{
+			hash128_context ctx;
+			hash128_start(&ctx, len);
+			for (size_t pos = 0; pos < len; pos += step)
+				hash128_update(&ctx, data + pos, pos + step <= len ? step : len - pos);
+
+			unsigned char split[16];
+			hash128_finish(&ctx, split);
+			if (memcmp(whole, split, 16) != 0)
+			{
+				printf("FAIL streaming len=%zu step=%zu\n", len, step);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i)
+	{
+		const Vector& v = vectors[i];
+		unsigned char digest[16];
+		char hex[33];
+		hash(v.data, strlen(v.data), v.seed, digest);
+		to_hex(digest, hex);
+		if (strcmp(hex, v.digest) != 0)
+		{
+			printf("FAIL \"%s\" seed=%ju: %s != %s\n", v.data, (uintmax_t)v.seed, hex, v.digest);
+			++failed;
+		}
+	}
+
+	if (!verification())
+		++failed;
+	if (!streaming())
+		++failed;
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+/* The secondary indexes of RCache: the keys of the method and tag
+ * indexes, index() up to XiProxy.Cache.IndexMax, pruneIndex() of the
+ * evicted items, removeIndexed() and the index counts of stats().
+ */
+#include "RCache.h"
+#include "xslib/Setting.h"
+#include "xslib/rdtsc.h"
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_ITEM	300
+#define NUMBER_MAX	100
+
+static int failed;
+
+#define CHECK(cond)	do { if (!(cond)) { printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); ++failed; } } while (0)
+
+static xstr_t X(const char *s)
+{
+	xstr_t xs = XSTR_C(s);
+	return xs;
+}
+
+static RKey item_key(int i)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "key-%d", i);
+	return RKey(RD_ANSWER, buf, len);
+}
+
+static RCachePtr new_cache(const char *index_max)
+{
+	char buf[32];
+	SettingPtr setting = newSetting();
+	snprintf(buf, sizeof(buf), "%d", NUMBER_MAX);
+	setting->insert("XiProxy.Cache.NumberMax", buf);
+	if (index_max)
+		setting->insert("XiProxy.Cache.IndexMax", index_max);
+	return RCachePtr(new RCache(setting));
+}
+
+static void replace(RCache *cache, int i, const RKey& index, const RKey *tag)
+{
+	char data[10] = { 0 };
+	xstr_t xs = XSTR_INIT((unsigned char *)data, sizeof(data));
+	cache->replace(item_key(i), RData(rdtsc(), RD_ANSWER, xs));
+
+	std::vector<RKey> indexes;
+	indexes.push_back(index);
+	if (tag)
+		indexes.push_back(*tag);
+	cache->index(item_key(i), indexes);
+}
+
+static void index_keys()
+{
+	RKey get = RCache::methodIndex(X("Foo"), X("get"));
+	CHECK(RCache::methodIndex(X("Foo#2"), X("get")) == get);
+	CHECK(!(RCache::methodIndex(X("Foo"), X("put")) == get));
+	CHECK(!(RCache::methodIndex(X("Bar"), X("get")) == get));
+	CHECK(!(RCache::tagIndex(X("Foo"), X("get")) == get));
+}
+
+/* The odd items are indexed by get, the even ones by put, every 10th
+ * one also by a tag. Only NUMBER_MAX of them stay in the cache.
+ */
+static void prune_and_remove()
+{
+	RCachePtr cache = new_cache(NULL);
+	RKey get = RCache::methodIndex(X("Foo"), X("get"));
+	RKey put = RCache::methodIndex(X("Foo"), X("put"));
+	RKey tag = RCache::tagIndex(X("Foo"), X("user:7"));
+	for (int i = 0; i < NUM_ITEM; ++i)
+		replace(cache.get(), i, i % 2 ? get : put, i % 10 == 0 ? &tag : NULL);
+
+	RCacheStats st;
+	cache->stats(st);
+	CHECK(st.index_lists == 3);
+	CHECK(st.index_keys == NUM_ITEM + NUM_ITEM / 10);
+	CHECK(st.index_overflows == 0);
+
+	size_t gone = 0, odd = 0, tagged = 0;
+	for (int i = 0; i < NUM_ITEM; ++i)
+	{
+		if (!cache->find(item_key(i)))
+			gone += (i % 10 == 0) ? 2 : 1;
+		else if (i % 10 == 0)
+			++tagged;
+		else if (i % 2)
+			++odd;
+	}
+	CHECK(gone > 0);
+
+	size_t pruned = 0, n;
+	while ((n = cache->pruneIndex()) > 0)
+		pruned += n;
+	CHECK(pruned == gone);
+	cache->stats(st);
+	CHECK(st.index_keys == NUM_ITEM + NUM_ITEM / 10 - gone);
+
+	CHECK(cache->removeIndexed(tag) == tagged);
+	for (int i = 0; i < NUM_ITEM; i += 10)
+		CHECK(!cache->find(item_key(i)));
+
+	CHECK(cache->removeIndexed(get) == odd);
+	CHECK(cache->removeIndexed(get) == 0);
+	for (int i = 1; i < NUM_ITEM; i += 2)
+		CHECK(!cache->find(item_key(i)));
+
+	cache->stats(st);
+	CHECK(st.index_lists == 1);
+	CHECK(st.num > 0 && st.num == st.index_keys - tagged);
+}
+
+static void index_max()
+{
+	RKey get = RCache::methodIndex(X("Foo"), X("get"));
+
+	// Divided among the stripes, 1 key for each.
+	RCachePtr cache = new_cache("16");
+	for (int i = 0; i < 10; ++i)
+		replace(cache.get(), i, get, NULL);
+	RCacheStats st;
+	cache->stats(st);
+	CHECK(st.index_keys == 1);
+	CHECK(st.index_overflows == 9);
+
+	cache = new_cache("0");
+	CHECK(!cache->indexed());
+	for (int i = 0; i < 10; ++i)
+		replace(cache.get(), i, get, NULL);
+	cache->stats(st);
+	CHECK(st.index_lists == 0 && st.index_keys == 0);
+	CHECK(cache->removeIndexed(get) == 0);
+	CHECK(cache->find(item_key(0)));
+}
+
+int main()
+{
+	index_keys();
+	prune_and_remove();
+	index_max();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+/* Loopback test of PeerBus: bus A tells bus B, served by the adapter of
+ * the same engine, to drop the keys and the indexes invalidated in A.
+ * Checks the coalescing and the dropping of the queued keys, the flush
+ * by the timer and by flush(), and the removals in the cache of B.
+ *	test_peerbus [port]
+ */
+#include "PeerBus.h"
+#include "xic/Engine.h"
+#include "xslib/XTimer.h"
+#include "xslib/rdtsc.h"
+#include "xslib/Setting.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define QUEUE_MAX	8
+#define NUM_KEY		10
+#define NUM_INDEXED	5
+
+static int failed;
+static char peer_list[64];
+
+#define CHECK(cond)	do { if (!(cond)) { printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); ++failed; } } while (0)
+
+static RKey item_key(int i)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "key-%d", i);
+	return RKey(RD_MCACHE, buf, len);
+}
+
+static intmax_t bus_stat(const PeerBusPtr& bus, const char *name)
+{
+	xic::AnswerWriter aw;
+	bus->getStats(aw);
+	return aw.take()->args().getInt(name);
+}
+
+/* Wait at most 5 seconds for the stat of the bus to reach num */
+static bool wait_stat(const PeerBusPtr& bus, const char *name, intmax_t num)
+{
+	for (int i = 0; i < 100 && bus_stat(bus, name) < num; ++i)
+		usleep(50 * 1000);
+	return bus_stat(bus, name) == num;
+}
+
+static RCachePtr new_cache()
+{
+	SettingPtr setting = newSetting();
+	setting->insert("XiProxy.Cache.NumberMax", "1000");
+	RCachePtr cache(new RCache(setting));
+
+	char data[10] = { 0 };
+	xstr_t xs = XSTR_INIT((unsigned char *)data, sizeof(data));
+	for (int i = 0; i < NUM_KEY + NUM_INDEXED; ++i)
+		cache->replace(item_key(i), RData(rdtsc(), RD_MCACHE, xs));
+	return cache;
+}
+
+static int run(int argc, char **argv, const xic::EnginePtr& engine)
+{
+	XTimerPtr timer = XTimer::create();
+	timer->start();
+
+	RCachePtr cache_a = new_cache();
+	RCachePtr cache_b = new_cache();
+	xstr_t service = XSTR_C("Foo");
+	xstr_t method = XSTR_C("get");
+	RKey index = RCache::methodIndex(service, method);
+	for (int i = NUM_KEY; i < NUM_KEY + NUM_INDEXED; ++i)
+		cache_b->index(item_key(i), std::vector<RKey>(1, index));
+
+	SettingPtr setting_b = newSetting();
+	PeerBusPtr bus_b(new PeerBus(engine, setting_b, cache_b, timer));
+	CHECK(!bus_b->enabled());
+	xic::AdapterPtr adapter = engine->createAdapter();
+	adapter->addServant("XiProxyPeer", bus_b);
+	adapter->activate();
+
+	char buf[32];
+	SettingPtr setting_a = newSetting();
+	setting_a->insert("XiProxy.Peer.List", peer_list);
+	snprintf(buf, sizeof(buf), "%d", QUEUE_MAX);
+	setting_a->insert("XiProxy.Peer.QueueMax", buf);
+	setting_a->insert("XiProxy.Peer.BatchMax", "3");
+	setting_a->insert("XiProxy.Peer.FlushMsec", "200");
+	PeerBusPtr bus_a(new PeerBus(engine, setting_a, cache_a, timer));
+	CHECK(bus_a->enabled());
+
+	// 4 keys, 2 of them again, then 6 more of which only 4 fit.
+	for (int i = 0; i < 4; ++i)
+		bus_a->invalidate(item_key(i));
+	bus_a->invalidate(item_key(0));
+	bus_a->invalidate(item_key(1));
+	for (int i = 4; i < NUM_KEY; ++i)
+		bus_a->invalidate(item_key(i));
+
+	CHECK(bus_stat(bus_a, "queued") == NUM_KEY + 2);
+	CHECK(bus_stat(bus_a, "coalesced") == 2);
+	CHECK(bus_stat(bus_a, "dropped") == NUM_KEY - QUEUE_MAX);
+	CHECK(bus_stat(bus_a, "pending") == QUEUE_MAX);
+
+	// Flushed by the timer.
+	CHECK(wait_stat(bus_b, "received", QUEUE_MAX));
+	CHECK(wait_stat(bus_a, "sent", QUEUE_MAX));
+	CHECK(bus_stat(bus_a, "pending") == 0);
+	CHECK(bus_stat(bus_b, "removed") == QUEUE_MAX);
+	for (int i = 0; i < NUM_KEY; ++i)
+	{
+		CHECK((bool)cache_b->find(item_key(i)) == (i >= QUEUE_MAX));
+		CHECK(cache_a->find(item_key(i)));
+	}
+
+	// Flushed at once, the items of the index are removed in B.
+	bus_a->invalidateIndex(index);
+	bus_a->flush();
+	CHECK(wait_stat(bus_b, "received", QUEUE_MAX + 1));
+	CHECK(bus_stat(bus_b, "removed") == QUEUE_MAX + NUM_INDEXED);
+	for (int i = NUM_KEY; i < NUM_KEY + NUM_INDEXED; ++i)
+		CHECK(!cache_b->find(item_key(i)));
+
+	timer->cancel();
+	engine->shutdown();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	int port = argc > 1 ? atoi(argv[1]) : 20000 + getpid() % 10000;
+	char endpoints[64];
+	snprintf(endpoints, sizeof(endpoints), "@tcp++%d", port);
+	snprintf(peer_list, sizeof(peer_list), "@tcp+127.0.0.1+%d", port);
+
+	SettingPtr setting = newSetting();
+	setting->insert("xic.Endpoints", endpoints);
+	return xic::start_xic_pt(run, argc, argv, setting);
+}
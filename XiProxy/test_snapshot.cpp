@@ -0,0 +1,194 @@
+/* Round trip of the RCache snapshot: the items saved by one cache, in
+ * several threads at once, are restored by another one with the
+ * partitions in another order, with their data, status, partition and
+ * owner, and the restored items of a service are removed by clearOwner().
+ * The items of MCache and Redis are not saved.
+ */
+#include "RCache.h"
+#include "xslib/Setting.h"
+#include "xslib/rdtsc.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define NUM_ITEM	1000
+#define NUM_NEAR	10
+#define SAVE_THREADS	4
+
+static char snapshot_file[64];
+
+static SettingPtr cache_setting(const char *partitions)
+{
+	SettingPtr setting = newSetting();
+	setting->insert("XiProxy.Cache.SnapshotFile", snapshot_file);
+	setting->insert("XiProxy.Cache.NumberMax", "10000");
+	setting->insert("XiProxy.Cache.ExpireMax", "3600");
+	setting->insert("XiProxy.Cache.ZipThreshold", "256");
+	setting->insert("XiProxy.Cache.Partitions", partitions);
+	return setting;
+}
+
+static RKey item_key(int i)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "key-%d", i);
+	return RKey(RD_ANSWER, buf, len);
+}
+
+/* Compressible data of length up to 1000 bytes, some above the threshold */
+static std::string item_data(int i)
+{
+	std::string data;
+	for (int k = 0; k < i % 1000; ++k)
+		data += (char)('a' + (k / 50 + i) % 26);
+	return data;
+}
+
+/* The copies of MCache and Redis, which are not saved */
+static RKey near_key(int i)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "near-%d", i);
+	return RKey(i % 2 ? RD_MCACHE : RD_REDIS, buf, len);
+}
+
+static const char *item_owner(int i)
+{
+	return i % 3 == 0 ? "Svc" : "Other";
+}
+
+static void *save_thread(void *arg)
+{
+	RCache *cache = (RCache *)arg;
+	return (void *)cache->save();
+}
+
+/* Several saves at once, as the periodic one and the one at exit, and
+ * no more save after the last one.
+ */
+static bool save()
+{
+	RCachePtr cache(new RCache(cache_setting("Demo:30 LCache:10")));
+	int demo = cache->partition("Demo");
+	for (int i = 0; i < NUM_ITEM; ++i)
+	{
+		std::string data = item_data(i);
+		xstr_t xs = XSTR_CXX(data);
+		RData d(rdtsc(), RD_ANSWER, xs);
+		d.setStatus(i % 7);
+		d.setPartition(i % 2 ? demo : 0);
+		d.setOwner(cache->owner(item_owner(i)));
+		cache->replace(item_key(i), d);
+	}
+
+	for (int i = 0; i < NUM_NEAR; ++i)
+	{
+		xstr_t xs = XSTR_C("value");
+		cache->replace(near_key(i), RData(rdtsc(), i % 2 ? RD_MCACHE : RD_REDIS, xs));
+	}
+
+	pthread_t thrs[SAVE_THREADS];
+	for (int i = 0; i < SAVE_THREADS; ++i)
+		pthread_create(&thrs[i], NULL, save_thread, cache.get());
+
+	bool ok = true;
+	for (int i = 0; i < SAVE_THREADS; ++i)
+	{
+		void *ret;
+		pthread_join(thrs[i], &ret);
+		if ((ssize_t)ret != NUM_ITEM)
+		{
+			printf("FAIL save() %zd != %d\n", (ssize_t)ret, NUM_ITEM);
+			ok = false;
+		}
+	}
+
+	ssize_t num = cache->save(true);
+	if (num != NUM_ITEM || cache->save() != 0)
+	{
+		printf("FAIL save(true) %zd != %d, or saved after it\n", num, NUM_ITEM);
+		ok = false;
+	}
+	return ok;
+}
+
+static bool restore()
+{
+	RCachePtr cache(new RCache(cache_setting("LCache:10 Other:20 Demo:30")));
+	ssize_t num = cache->restore();
+	if (num != NUM_ITEM)
+	{
+		printf("FAIL restore() %zd != %d\n", num, NUM_ITEM);
+		return false;
+	}
+
+	int demo = cache->partition("Demo");
+	int svc = cache->owner("Svc");
+	int other = cache->owner("Other");
+	int failed = 0;
+	int zipped = 0;
+	for (int i = 0; i < NUM_ITEM; ++i)
+	{
+		RData d = cache->find(item_key(i));
+		if (!d)
+		{
+			printf("FAIL item %d not restored\n", i);
+			++failed;
+			continue;
+		}
+
+		zipped += d.zipped();
+		std::string data = item_data(i);
+		RData u = cache->unzip(d);
+		if (!u || u.length() != data.length() || memcmp(u.data(), data.data(), data.length()) != 0)
+		{
+			printf("FAIL item %d data\n", i);
+			++failed;
+		}
+		if (d.status() != i % 7 || d.partition() != (i % 2 ? demo : 0)
+			|| d.owner() != (i % 3 == 0 ? svc : other))
+		{
+			printf("FAIL item %d status=%d partition=%d owner=%d\n", i, d.status(), d.partition(), d.owner());
+			++failed;
+		}
+	}
+	for (int i = 0; i < NUM_NEAR; ++i)
+	{
+		if (cache->find(near_key(i)))
+		{
+			printf("FAIL near item %d restored\n", i);
+			++failed;
+		}
+	}
+	if (zipped == 0)
+	{
+		printf("FAIL no zipped item restored\n");
+		++failed;
+	}
+
+	if (!cache->clearOwner("Svc"))
+	{
+		printf("FAIL clearOwner() of a restored service\n");
+		++failed;
+	}
+	for (int i = 0; i < NUM_ITEM; ++i)
+	{
+		bool found = cache->find(item_key(i));
+		if (found != (i % 3 != 0))
+		{
+			printf("FAIL item %d %s after clearOwner()\n", i, found ? "found" : "not found");
+			++failed;
+		}
+	}
+	return failed == 0;
+}
+
+int main()
+{
+	snprintf(snapshot_file, sizeof(snapshot_file), "/tmp/test_snapshot.%d", (int)getpid());
+	bool ok = save() && restore();
+	unlink(snapshot_file);
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}